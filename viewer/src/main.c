@@ -1,14 +1,93 @@
+#define _GNU_SOURCE // O_DIRECT, fallocate
 #include <gtk/gtk.h>
 #include <ImageStreamIO/ImageStreamIO.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
-
-#define TRACE_MAX_SAMPLES 360000
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+// ~400 MB when full (plus ~16 bytes per sample of min/max pyramid). A sample
+// takes 336 bytes against 1104 with uint32 histogram counts: 3.3x the samples
+// in the same memory, short of 4x because the 80 bytes of curves and times per
+// sample are not compressed. --mem-budget may shorten the ring.
+#define TRACE_MAX_SAMPLES 1200000
 #define TRACE_HIST_BINS 256
+#define TRACE_CHUNK_SAMPLES 4096 // Trace ring is allocated chunk by chunk as it fills
+#define TRACE_NUM_CHUNKS ((TRACE_MAX_SAMPLES + TRACE_CHUNK_SAMPLES - 1) / TRACE_CHUNK_SAMPLES)
+#define TRACE_PYR_LEVELS 6 // Min/max decimation levels, factor 4 each; 4^6 == TRACE_CHUNK_SAMPLES
+#define TRACE_PYR_NODES 1365 // 1024 + 256 + 64 + 16 + 4 + 1 blocks per chunk
+#define TRACE_FILE_MAX_CHUNKS 16384 // Chunk index entries in a trace file header
+#define TRACE_EXPORT_COLS 11
 #define IMG_HISTORY_FRAMES 2000
 
+// Sampled Autoscale (percentile modes only)
+#define AUTOSCALE_SAMPLE_MIN 65536
+#define AUTOSCALE_SAMPLE_MAX 262144
+#define AUTOSCALE_SAMPLE_SIGMA 3.0
+
+// Histogram Cache
+#define HIST_CACHE_SIZE 8
+#define HIST_CACHE_FINE_BINS 4096 // Autoscale percentiles; multiple of display bins
+
+// Temporal Statistics
+#define TSTAT_SEM_TIMEOUT_NS 100000000L // Worker wakes up to check for stop
+
+// Multi-ROI Statistics
+#define MAX_ROIS 16
+#define ROI_TRACE_LEN 4096
+
+// Trace PSD
+#define PSD_MAX_SEGMENTS 256 // Cached Welch segments (most recent ones are averaged)
+
+// Published Statistics
+#define STATS_VEC_LEN 8 // min, max, mean, median, p10, p90, sum, npix
+
+// Large Buffers
+#define BIG_HUGE_BYTES (2UL << 20) // Huge page size assumed for rounding and alignment
+#define BIG_PREFAULT_STEP (64UL << 20) // Bytes populated between cancellation checks
+#define BIG_PREFAULT_JOBS 4
+#define BIG_NUMA_AUTO -2 // --numa-node default: the UI thread's node
+
+// Memory Budget
+#define MEM_TRACE_SHARE 4 // The trace ring gets at most 1/4 of --mem-budget
+#define MEM_RECORDER_SHARE 8 // Kept for the recorder queue
+
+// Compressed Frame History
+#define HIST_TRACKS 2 // Recorded stream + paired frame of the other stream
+#define HIST_QUEUE_LEN 8 // Raw frames waiting for the encoder
+#define HIST_KEY_INTERVAL 16 // Frames per keyframe; bounds the decode chain
+#define HC_HASH_BITS 14
+#define HC_MIN_MATCH 4
+#define HC_HUFF_BITS 12 // Longest Huffman code; sizes the decode table
+#define HC_PLANE_HDR 9 // Plane mode, stage input size, payload size
+#define HIST_FILE_FLUSH_BYTES (64UL << 20) // --history-file writeback granularity
+#define HREPLAY_AHEAD 8 // Frames the history replay decodes ahead of the shown one
+#define HREPLAY_FRAMES (HIST_TRACKS * (HREPLAY_AHEAD + 1))
+#define HREPLAY_MAX_GAP 1.0 // Longer pauses between recorded frames replay as this many seconds
+
+// Event Trigger
+#define TRIGGER_MAX_CONDS 8
+#define TRIGGER_BASELINE 100 // Frames in the running baseline of '~' conditions
+#define TRIGGER_WARMUP 20 // Frames before a '~' condition can fire
+#define TRIGGER_TRACE_COLS 8 // time, cnt0, min, max, mean, median, p10, p90
+#define TRIGGER_SEM_TIMEOUT_NS 100000000L
+#define TRIGGER_PLAY_GAP 4096  // Frames the player may advance between ticks before it counts as a seek
+#define FITS_BLOCK 2880
+
+// Frame Recorder
+#define REC_WRITE_BYTES (8UL << 20) // Staging block per write() call
+#define REC_ALIGN 4096 // O_DIRECT buffer, offset and length alignment
+#define REC_SEM_TIMEOUT_NS 100000000L
+
 // Enums for Dropdowns
 enum {
     COLORMAP_GREY = 0,
@@ -42,6 +121,16 @@ enum {
     AUTO_COUNT
 };
 
+enum {
+    TSTAT_OFF = 0,
+    TSTAT_MEAN,
+    TSTAT_RMS,
+    TSTAT_MIN,
+    TSTAT_MAX,
+    TSTAT_TBIN,  // Average of N frames (tbin menu fallback, not in the dropdown)
+    TSTAT_COUNT
+};
+
 enum {
     AUTO_MAX_MANUAL = 0,
     AUTO_MAX_DATA,
@@ -63,6 +152,498 @@ enum {
     MODE_2D_COUNT
 };
 
+// Histogram Cache
+// A region of a frame: keys cached histograms together with the frame identity.
+typedef struct {
+    const void *source;  // Stream identity (IMAGE*), NULL if not cacheable
+    uint64_t cnt0;       // Frame counter of the data
+    void *data;
+    uint8_t datatype;
+    int width;           // Row length of data in pixels
+    int x1, y1, x2, y2;  // Half-open pixel rectangle
+} HistRegion;
+
+typedef struct {
+    gboolean valid;
+    HistRegion region;
+    double min;          // Histogram range (data extrema if bins == 0)
+    double max;
+    int bins;            // 0: entry only holds the region extrema
+    uint32_t *hist;
+    int hist_capacity;
+    uint32_t max_count;
+    uint64_t last_used;
+} HistCacheEntry;
+
+typedef struct {
+    HistCacheEntry entries[HIST_CACHE_SIZE];
+    uint64_t tick;
+} HistCache;
+
+// Temporal Statistics
+// Per-pixel mean/RMS/min/max of a stream over a window of frames, computed by a
+// worker thread and published as a local shared-memory stream (<base>.tstat).
+typedef struct {
+    char *source_name;
+    char *out_name;
+    IMAGE source;
+    IMAGE out;
+    int stat;
+    int window;           // Frames per output (block), or 1/alpha (exponential)
+    gboolean exponential; // Mean/RMS decay with alpha = 1/window, output every frame
+    size_t npix;
+    uint64_t last_cnt0;
+    int count;            // Frames accumulated in the current block
+    gboolean seeded;      // Exponential accumulators initialized
+    gboolean fallback;    // Started by the tbin/rms menus for a missing stream
+
+    // Accumulators
+    float *frame;         // Current frame converted to float
+    float *mean;
+    float *m2;            // Welford sum of squared deviations (variance if exponential)
+    float *vmin;
+    float *vmax;
+    double *sum;          // TSTAT_TBIN: wide accumulator, one add per pixel per frame
+
+    GThread *thread;
+    gint running;
+} TemporalStats;
+
+// Trace Storage
+enum {
+    TRACE_CURVE_MIN,
+    TRACE_CURVE_MAX,
+    TRACE_CURVE_MEAN,
+    TRACE_CURVE_MEDIAN,
+    TRACE_CURVE_P01,
+    TRACE_CURVE_P09,
+    TRACE_NUM_CURVES
+};
+
+typedef struct {
+    double time[TRACE_CHUNK_SAMPLES];
+    uint64_t cnt0[TRACE_CHUNK_SAMPLES];
+    double min[TRACE_CHUNK_SAMPLES];
+    double max[TRACE_CHUNK_SAMPLES];
+    double mean[TRACE_CHUNK_SAMPLES];
+    double median[TRACE_CHUNK_SAMPLES];
+    double p01[TRACE_CHUNK_SAMPLES];
+    double p09[TRACE_CHUNK_SAMPLES];
+
+    // Waterfall histogram per sample, counts encoded by trace_hist_encode
+    double hist_min[TRACE_CHUNK_SAMPLES];
+    double hist_max[TRACE_CHUNK_SAMPLES];
+    uint8_t hist[TRACE_CHUNK_SAMPLES * TRACE_HIST_BINS];
+
+    // Min/max pyramid per curve; level L block b covers samples [b*4^L, (b+1)*4^L)
+    float pyr_lo[TRACE_NUM_CURVES][TRACE_PYR_NODES];
+    float pyr_hi[TRACE_NUM_CURVES][TRACE_PYR_NODES];
+} TraceChunk;
+
+// Offset of level L (1..TRACE_PYR_LEVELS) in pyr_lo/pyr_hi
+static const int trace_pyr_offset[TRACE_PYR_LEVELS + 1] = { 0, 0, 1024, 1280, 1344, 1360, 1364 };
+
+// Sample idx of the trace ring; only valid for samples already written
+#define TRACE_CHUNK(app, idx) ((app)->trace_chunks[(idx) / TRACE_CHUNK_SAMPLES])
+#define TRACE_AT(app, field, idx) (TRACE_CHUNK(app, idx)->field[(idx) % TRACE_CHUNK_SAMPLES])
+#define TRACE_HIST_AT(app, idx) (TRACE_CHUNK(app, idx)->hist + (size_t)((idx) % TRACE_CHUNK_SAMPLES) * TRACE_HIST_BINS)
+
+// Trace waterfall, kept as a ring of columns and scrolled on blit.
+// Absolute column c = floor(t * w / duration) lives at surface x = c mod w.
+typedef struct {
+    cairo_surface_t *surf;
+    int w, h;
+    long col;             // Right edge column (newest sample) at last render
+    int head, count;      // Trace ring state at last render
+
+    // Display state the rendered columns depend on
+    double duration;
+    double min_y, max_y;
+    gboolean highlight_active;
+    double highlight_val;
+    gboolean thresholds_enabled;
+    double thresh_min_val, thresh_max_val;
+} TraceWaterfall;
+
+// Real FFT of length n (power of two) via an n/2-point complex FFT, tables cached per n
+typedef struct {
+    int n;
+    int *rev;             // Bit reversal permutation of n/2
+    float *tw_re, *tw_im; // exp(-2 pi i k / n), k < n/2
+    float *window;        // Hann
+    double window_pow;    // Sum of window^2
+    float *z_re, *z_im;   // Scratch, n/2
+} RealFft;
+
+// Welch PSD of one trace curve. Segments start at multiples of n/2 (50% overlap)
+// in absolute sample numbers, so each one is transformed once and cached.
+typedef struct {
+    int curve;
+    RealFft fft;
+    uint64_t seg_key[PSD_MAX_SEGMENTS]; // Segment number + 1, 0 if empty
+    float *seg_pow;       // PSD_MAX_SEGMENTS x (n/2 + 1), |X|^2 / window_pow
+    double *avg;          // n/2 + 1
+} PsdState;
+
+// Trace export: header, then each column's rows back to back (oldest first)
+enum { TRACE_COL_F64, TRACE_COL_U64, TRACE_COL_U8V };
+
+typedef struct {
+    char name[16];
+    uint32_t type;
+    uint32_t width;       // Bytes per row
+    uint64_t offset;      // File offset of the column
+} TraceColumnDesc;
+
+typedef struct {
+    char magic[8];        // "IMTRCOL1"
+    uint32_t ncols;
+    uint32_t hist_bins;
+    uint64_t nrows;
+    uint64_t first_row;   // Earlier rows were overwritten by the live trace during export
+    TraceColumnDesc cols[TRACE_EXPORT_COLS];
+} TraceExportHeader;
+
+// Background export or import of the trace
+typedef struct {
+    gpointer app;             // ViewerApp
+    char *path;
+    gboolean import;
+    gboolean csv;
+    uint64_t a_start, a_end;  // Export: absolute sample range
+    TraceChunk **chunks;      // Import: ring chunks built by the worker
+    uint64_t nrows;
+    gint cancel;
+    gboolean ok;
+    char msg[128];
+    GThread *thread;
+} TraceIoJob;
+
+// Trace file: header page(s) followed by TraceChunk images at a page-aligned stride.
+// Sample times are seconds since epoch (CLOCK_REALTIME).
+typedef struct {
+    double t_first, t_last;
+    uint64_t cnt0_first, cnt0_last;
+} TraceFileIndex;
+
+typedef struct {
+    char magic[8];          // "IMTRACE1"
+    uint32_t chunk_samples;
+    uint32_t hist_bins;
+    uint64_t chunk_bytes;   // Stride between chunks
+    uint64_t header_bytes;  // Offset of chunk 0
+    double epoch;
+    uint64_t nsamples;      // Bumped after the sample is written
+    TraceFileIndex index[TRACE_FILE_MAX_CHUNKS];
+} TraceFileHeader;
+
+typedef struct {
+    int fd;
+    gboolean writable;
+    TraceFileHeader *hdr;
+    size_t header_bytes;
+    size_t chunk_bytes;
+
+    // Writer: only the chunk being filled is mapped
+    TraceChunk *wchunk;
+    int64_t wchunk_idx;
+    double time_offset;   // Trace time -> file time for this session
+    gboolean full;
+
+    // Reader: whole file mapped, paged in on access
+    uint8_t *map;
+    size_t map_len;
+} TraceFile;
+
+// Multi-ROI Statistics
+typedef struct {
+    char name[32];
+    int x1, y1, x2, y2;   // Half-open pixel rectangle
+    int cx1, cy1, cx2, cy2; // Clipped to the frame the bands were planned for
+
+    // Last evaluated frame
+    size_t count;
+    double sum;
+    double mean;
+    double rms;
+    double min;
+    double max;
+
+    // Mean history (ring of ROI_TRACE_LEN)
+    float *trace;
+    int trace_head;
+    int trace_count;
+} Roi;
+
+// An ROI's run of segments within a band
+typedef struct {
+    int roi;
+    int seg_first;        // Inclusive
+    int seg_last;
+} RoiSpan;
+
+// Rows [y1, y2) share the same interval list: the row is cut at every ROI edge
+// into segments, each reduced once and then merged into every ROI covering it.
+typedef struct {
+    int y1, y2;
+    int nseg;
+    int seg_x[2 * MAX_ROIS];          // nseg + 1 breakpoints
+    gboolean seg_used[2 * MAX_ROIS];  // Covered by at least one ROI
+    int nspans;
+    RoiSpan spans[MAX_ROIS];
+} RoiBand;
+
+typedef struct {
+    Roi rois[MAX_ROIS];
+    int nrois;
+    RoiBand bands[2 * MAX_ROIS];
+    int nbands;
+    int plan_width;       // Frame size the bands were built for
+    int plan_height;
+    gboolean dirty;
+} RoiSet;
+
+// Stats output stream: row 0 is the selection, row 1 + i is named ROI i.
+// Values not computed for a row (ROI percentiles, missing ROIs) are NaN.
+typedef struct {
+    IMAGE img;
+    uint32_t depth;       // Circular buffer slices, 0 for a plain 2D stream
+    double rows[1 + MAX_ROIS][STATS_VEC_LEN];
+    gboolean pending;     // Rows filled since the last post
+    uint64_t last_cnt0;   // Source frame of the last post
+} StatsPublisher;
+
+// Compressed history slots, filled by an encoder thread. Track 0 holds the
+// recorded stream, track 1 the paired frame of the other stream. Within a
+// track each slot is a delta against the previous slot unless it is a
+// keyframe. When a keyframe is overwritten the slot after it is replaced by
+// its decoded frame, stored raw, so every slot still in the ring stays
+// decodable. Slot arrays, the
+// queue counters and the decode cache are guarded by lock.
+typedef struct {
+    size_t capacity;     // Slots, same as img_history_capacity
+    size_t frame_size[HIST_TRACKS]; // Bytes, 0 for an unused track
+    size_t nelem[HIST_TRACKS];
+    int esize[HIST_TRACKS];
+    size_t max_frame;    // Largest track, 0 until configured
+    uint8_t **data;      // Indexed track * capacity + slot
+    uint32_t *size;
+    uint8_t *key;        // HC_DELTA, HC_KEY or HC_KEY_RAW (uncompressed)
+    uint8_t *ready;      // Encoded and decodable
+    size_t stored_bytes;
+
+    uint8_t *queue[HIST_QUEUE_LEN];
+    size_t queue_slot[HIST_QUEUE_LEN];
+    int queue_track[HIST_QUEUE_LEN];
+    int q_head, q_count;
+    gboolean busy;       // Worker is encoding queue[q_head]
+
+    // Encoder state (worker only)
+    uint8_t *prev[HIST_TRACKS];
+    gboolean prev_valid[HIST_TRACKS];
+    int since_key[HIST_TRACKS];
+    uint8_t *enc_planes, *enc_out, *enc_lz;
+    uint32_t *enc_table;
+    uint8_t *tail[HIST_TRACKS]; // Decoded frame of tail_slot, the last slot re-keyed
+    long tail_slot[HIST_TRACKS];
+
+    // Last decoded frame per track (main thread)
+    uint8_t *dec_planes, *dec_lz, *cached[HIST_TRACKS];
+    long cached_slot[HIST_TRACKS];
+
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    gboolean running;
+} HistCodec;
+
+// Replay frame decoded ahead by the prefetch worker
+typedef struct {
+    long slot;            // -1 when empty
+    int track;
+    gboolean ok;          // FALSE: the fetch failed, the UI thread retries it
+    size_t size;
+    size_t capacity;
+    uint8_t *buf;
+} HistReplayFrame;
+
+// History transport: steps and plays through the ring by slot (cnt0 order).
+// The ring is not written while this is active (the stream is paused), so the
+// worker can read it; every path that frees or refills the ring calls
+// hreplay_invalidate first.
+typedef struct {
+    gboolean active;      // Display follows slot instead of the live frame or trace cursor
+    size_t slot;
+    uint64_t cnt0;        // Key of slot
+    int src;
+    int dir;              // Playing direction, 0 when stopped
+    double rate;          // Fraction of real time
+    double owed;          // Seconds of frame time not yet stepped over
+    struct timespec last;
+    gboolean loop;
+    uint64_t mark[2];     // Loop range ends (A, B) by key
+    int mark_src[2];
+    gboolean mark_set[2];
+
+    long stride;          // Slots stepped per tick lately; spaces the prefetch
+
+    // Prefetch worker; the request and frames are guarded by lock
+    GThread *thread;
+    GMutex lock;
+    GCond cond;
+    gboolean running;
+    gboolean busy;        // Fetching outside the lock
+    long want[HREPLAY_AHEAD]; // Upcoming slots, nearest first, -1 past the end
+    int want_tracks;      // Bit per track
+    size_t want_size[HIST_TRACKS];
+    HistReplayFrame frames[HREPLAY_FRAMES];
+} HistReplay;
+
+// FITS header: a single 2880-byte block of 80-character cards
+typedef struct {
+    char block[FITS_BLOCK];
+    int ncards;
+    int naxis3_card;
+} FitsHeader;
+
+// One trigger condition on a stats vector entry
+typedef struct {
+    char text[64];        // As given on the command line
+    char source[32];      // "sel" or an ROI name
+    int stat;             // Index into the stats vector
+    char op;              // '>', '<', or '~' (jump of value sigmas from the baseline)
+    double value;
+    double mean, var;     // '~' baseline
+    uint64_t nseen;
+} TriggerCond;
+
+// Dump of one event: history slots to copy, then the trace slice
+typedef struct {
+    gpointer app;         // ViewerApp
+    char dir[512];
+    char cond[64];
+    uint64_t trig_cnt0;
+    int trig_index;       // Cube index of the trigger frame
+    size_t *slots;
+    size_t *max_back;     // Decode chain limit per frame
+    int nframes, written;
+    uint64_t total0;      // img_history_total when scheduled
+    uint64_t budget;      // Records after total0 before the oldest needed slot is reused
+    int track;
+    size_t frame_size;
+    int width, height;
+    uint8_t datatype;
+    double *trace_rows;   // TRIGGER_TRACE_COLS per sample
+    int ntrace;
+    gint cancel;
+    char msg[256];
+    GThread *thread;
+} TriggerJob;
+
+typedef struct {
+    TriggerCond cond[TRIGGER_MAX_CONDS];
+    int ncond;
+    int pre, post;
+    char dir[512];
+
+    // Watcher thread: evaluates every frame of the primary stream
+    char stream[256];     // Name watched, empty when stopped
+    IMAGE source;         // Shared-memory stream
+    gpointer player;      // FilePlayer, instead of source while playing a file
+    uint64_t play_pos;    // Last frame the player reached (atomic)
+    uint64_t last_cnt0, play_done;
+    uint64_t frames, missed;
+    uint8_t *frame;       // Native-order FITS frame being evaluated
+    uint32_t hist[HIST_CACHE_FINE_BINS];
+    GThread *thread;
+    gint running;
+
+    // Shared with the watcher under lock
+    GMutex lock;
+    int region[TRIGGER_MAX_CONDS][4]; // Half-open x1, y1, x2, y2; empty for a missing ROI
+    gboolean fire_new;    // Event not yet taken by trigger_poll
+    gboolean pending;     // Fired, waiting for the post frames
+    uint64_t fire_cnt0;
+    int fire_width, fire_height; // Geometry of the watched stream at the event
+    uint8_t fire_datatype;
+    char fired[64];
+
+    // UI thread
+    uint64_t fire_total;  // History records up to and including the event frame
+    TriggerJob *job;
+} Trigger;
+
+// Recorder: a capture thread copies every Nth frame of a stream into a bounded
+// queue; a writer thread encodes them into staging blocks written to a series
+// of FITS cubes. Queue counters and statistics are guarded by lock.
+typedef struct {
+    IMAGE source;
+    char *stream;
+    char dir[512];
+    char stamp[32];       // Recording start, part of every file name
+    int every;            // Record frames with cnt0 % every == 0
+    uint64_t max_bytes;   // Rollover size
+    int width, height;
+    uint8_t datatype;
+    size_t esize, frame_size;
+    uint64_t last_cnt0;   // Capture thread
+
+    uint8_t *queue;       // qlen raw frames
+    uint64_t *queue_cnt0;
+    int qlen;
+    uint64_t head, tail;  // Frames queued / taken by the writer
+    gboolean stopping;    // No more frames will be queued
+    GMutex lock;
+    GCond cond;
+
+    // Writer state
+    uint8_t *wbuf;        // REC_WRITE_BYTES, REC_ALIGN aligned
+    size_t wfill;
+    int fd;
+    gboolean direct;      // fd is O_DIRECT
+    off_t file_off;       // Bytes of the current file written so far
+    uint64_t file_frames, file_drops;
+    uint64_t file_first_cnt0, file_last_cnt0;
+    int file_index;
+
+    // Statistics (lock)
+    uint64_t written, drop_queue, drop_source, drop_error;
+    int files;
+    char file[600];       // Current file
+    char error[256];      // First write error
+
+    gint capturing;
+    GThread *capture_thread, *writer_thread;
+} Recorder;
+
+// File playback: a FITS cube or raw frame file mapped read-only and shown
+// through an IMAGE of our own, so draw_image reads it like a stream. Raw
+// frames are used in place; FITS frames are decoded into frame.
+typedef struct {
+    IMAGE image;
+    IMAGE_METADATA md;
+    char name[256];       // Stream name shown for the file
+    uint8_t *map;
+    size_t map_len;
+    size_t data_off;      // Offset of frame 0
+    size_t frame_size;
+    uint64_t nframes;
+    gboolean fits;
+    uint8_t *frame;       // Native-order copy of the current FITS frame
+    uint64_t cnt0_first, cnt0_step; // cnt0 of frame i (recorder CNT0FRST/RECEVERY)
+    uint64_t pos;         // Current frame
+    double fps;
+    gboolean playing, loop;
+    double owed;          // Fractional frames due at the next tick
+    struct timespec last; // Time of the last tick while playing
+} FilePlayer;
+
+// Overlay / trace color per ROI index
+static const double roi_colors[8][3] = {
+    {0.2, 0.8, 1.0}, {1.0, 0.6, 0.2}, {0.6, 1.0, 0.3}, {1.0, 0.3, 0.8},
+    {1.0, 1.0, 0.3}, {0.5, 0.5, 1.0}, {0.3, 1.0, 0.8}, {1.0, 0.4, 0.4}
+};
+
 // Stream Context
 typedef struct {
     IMAGE *image;
@@ -70,6 +651,7 @@ typedef struct {
     char *base_image_name;
     int current_tbin;
     gboolean current_rms_mode;
+    TemporalStats *tstat; // In-viewer temporal statistics (NULL when off)
 
     // Scaling state
     double min_val;
@@ -115,6 +697,10 @@ typedef struct {
     int tbin_control_target; // 0 or 1
     GtkWidget *box_tbin_btns; // Box inside popover
     GtkWidget *box_rms_btns;
+    GtkWidget *dropdown_tstat;
+    GtkWidget *dropdown_tstat_window;
+    GtkWidget *check_tstat_exp;
+    gboolean tstat_ui_lock; // Set while controls are synced programmatically
 
     // Image Data Buffer for Cairo
     guchar *display_buffer;
@@ -196,29 +782,45 @@ typedef struct {
     int hist_bins;
     guint32 hist_max_count;
     guint32 hist_full_max_count;
+    HistCache hist_cache; // Per-frame histograms shared by autoscale and display
     double stats_mean;
     double stats_median;
 
-    // Trace Data
-    double *trace_time;
-    double *trace_min;
-    double *trace_max;
-    double *trace_mean;
-    double *trace_median;
-    double *trace_p01;
-    double *trace_p09;
-
-    // Trace Histogram Data (Waterfall)
-    uint32_t *trace_hist_data;
-    double *trace_hist_min;
-    double *trace_hist_max;
+    // Trace Data (chunks allocated on demand, see TRACE_AT)
+    TraceChunk *trace_chunks[TRACE_NUM_CHUNKS];
+    size_t trace_bytes;
+    GtkWidget *lbl_trace_mem;
+    TraceWaterfall trace_wf;
+    TraceFile *trace_rec;   // Sink for live samples (--trace-record)
+    TraceFile *trace_view;  // Trace shows this file instead of live samples (--trace-open)
+    StatsPublisher *stats_pub; // --stats-stream
+    TraceIoJob *trace_io;   // Export/import in progress
+    gboolean trace_frozen;  // Showing an imported trace; live samples are not appended
+    GtkWidget *entry_trace_file;
+    GtkWidget *check_trace_csv;
+    GtkWidget *lbl_trace_io;
+    GtkWidget *scale_trace_view;
+    GtkWidget *lbl_trace_view;
 
     int trace_head;
     int trace_count;
-    struct timespec trace_start_time;
+    uint64_t trace_total;   // Absolute sample number of trace_head
     gboolean trace_active;
     double trace_duration;
 
+    // Trace time base: producer timestamps when available, else local monotonic clock
+    gboolean trace_time_producer;
+    double trace_t0;            // Absolute time of trace time 0 in the current base
+    double trace_last_t;
+    GtkWidget *lbl_trace_clock;
+
+    // Trace PSD
+    PsdState psd;
+    GtkWidget *check_psd;
+    GtkWidget *dropdown_psd_curve;
+    GtkWidget *dropdown_psd_len;
+    GtkWidget *psd_area;
+
     // Trace Cursor
     int trace_cursor_idx;
     gboolean trace_cursor_active;
@@ -308,6 +910,11 @@ typedef struct {
     // ROI Expansion
     GtkWidget *btn_expand_roi;
     GtkWidget *frame_stats;
+
+    // Multi-ROI
+    RoiSet roi_set;
+    GtkWidget *lbl_roi_stats;
+    GtkWidget *roi_trace_area;
     GtkWidget *paned_images;
     GtkWidget *scrolled_roi;
     GtkWidget *roi_image_area;
@@ -318,8 +925,23 @@ typedef struct {
     GtkWidget *btn_ctrl_overlay;
     GtkWidget *btn_stats_overlay;
     GtkWidget *btn_pause;
+    GtkWidget *btn_record;
+    GtkWidget *lbl_record;
+    GtkWidget *lbl_mem; // Memory use, per subsystem in the tooltip
+    GtkWidget *box_play;
+    GtkWidget *btn_play;
+    GtkWidget *check_play_loop;
+    GtkWidget *spin_play_fps;
+    GtkWidget *scale_play;
+    GtkWidget *lbl_play;
     struct timespec last_fps_time;
     uint64_t last_fps_cnt;
+    struct timespec last_fps_ptime; // Producer time at last_fps_cnt
+    gboolean last_fps_ptime_valid;
+
+    // Producer timestamp of the displayed live frame
+    struct timespec current_frame_time;
+    gboolean current_frame_time_valid;
 
     // Track mouse on main image for live updates
     gboolean mouse_over_main;
@@ -336,18 +958,54 @@ typedef struct {
     double auto_gain;
     GtkWidget *dropdown_gain;
 
+    // Auto Scale Sampling (0 = exact)
+    double autoscale_tolerance;
+    char autoscale_label[64]; // Shown in lbl_autoscale_samples
+    GtkWidget *dropdown_autoscale_sampling;
+    GtkWidget *lbl_autoscale_samples;
+
     // History playback
-    uint64_t *trace_cnt0;
     void *history_buffer;
     size_t history_buffer_size;
+    void *history_buffer_sec;
+    size_t history_buffer_sec_size;
     uint64_t current_cnt0;
-
-    // Internal Circular Buffer
-    void *img_history_data; // Flat buffer: frames * frame_size
-    uint64_t *img_history_cnt0; // cnt0 for each frame
+    uint64_t current_cnt0_sec; // Frame counter of raw_buffer_sec
+
+    // Internal Circular Buffer. Track t holds streams[t]; each slot is keyed by
+    // the cnt0 of the stream displayed when it was recorded, and the other
+    // track holds that stream's frame closest in time.
+    void *img_history_data; // Track 0 frames, then track 1 frames
+    uint64_t *img_history_cnt0; // Key cnt0 for each slot
+    uint64_t *img_history_pair_cnt0; // cnt0 of the paired frame in the other track
+    uint8_t *img_history_src; // Stream that was displayed (owner of the key)
+    double *img_history_time; // Frame time of the key (producer clock when it has one), seconds
     size_t img_history_head; // Insertion point
     size_t img_history_capacity; // In frames
     size_t img_history_frame_size; // In bytes
+    size_t img_history_frame_size_sec; // Track 1 bytes, 0 when streams[1] is not loaded
+    size_t img_history_count; // Valid frames
+    uint64_t img_history_total; // Slots recorded so far (read by the trigger dump)
+    int32_t *img_history_index; // cnt0 -> slot, open addressing (-1 = empty)
+    size_t img_history_index_mask; // Index size - 1, power of two >= 2 * capacity
+    HistCodec *hist_codec; // --history-compress (img_history_data unused)
+    int img_history_fd; // --history-file backing the ring, -1 for malloc'd memory
+    size_t img_history_map_len;
+    size_t img_history_flush_slot; // First slot written since the last writeback
+    int img_history_advice; // Current madvise() mode of the mapping
+    Trigger *trigger; // --trigger
+    Recorder *recorder; // NULL when not recording
+    uint64_t record_shown; // Written + dropped when lbl_record was last updated
+    FilePlayer *player; // --play, the primary stream while it lasts
+    gboolean play_ui_lock;
+    HistReplay hreplay;
+    GtkWidget *box_hreplay;
+    GtkWidget *btn_hreplay_back;
+    GtkWidget *btn_hreplay_fwd;
+    GtkWidget *dropdown_hreplay_rate;
+    GtkWidget *check_hreplay_loop;
+    GtkWidget *lbl_hreplay;
+    gboolean hreplay_ui_lock;
 
     // Secondary Stream & Dual View
     StreamContext streams[2];
@@ -402,6 +1060,30 @@ static double opt_max = 0;
 static gboolean has_min = FALSE;
 static gboolean has_max = FALSE;
 static int opt_history = 0;
+static gboolean opt_history_compress = FALSE;
+static gchar *opt_history_file = NULL;
+static gchar **opt_trigger = NULL;
+static int opt_trigger_pre = 50;
+static int opt_trigger_post = 50;
+static gchar *opt_trigger_dir = NULL;
+static gboolean opt_record = FALSE;
+static gchar *opt_record_dir = NULL;
+static int opt_record_every = 1;
+static int opt_record_max_mb = 4096;
+static int opt_record_queue = 64;
+static gchar *opt_play = NULL;
+static gchar *opt_play_raw = NULL;
+static double opt_play_fps = 25;
+static gboolean opt_play_loop = FALSE;
+static gchar *opt_huge_pages = NULL;
+static int opt_numa_node = BIG_NUMA_AUTO;
+static int opt_mem_budget = 0; // MB, 0 for no limit
+static int trace_ring_len = TRACE_MAX_SAMPLES; // Trace ring length in samples, set once at startup
+static char *opt_trace_record = NULL;
+static char *opt_trace_open = NULL;
+static char *opt_stats_stream = NULL;
+static gboolean opt_local_time = FALSE;
+static int opt_stats_cb = 0;
 
 // Custom callback to flag if options were set
 static gboolean
@@ -431,11 +1113,42 @@ static GOptionEntry entries[] =
   { "min", 'm', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, parse_min_cb, "Minimum value for scaling", "VAL" },
   { "max", 'M', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, parse_max_cb, "Maximum value for scaling", "VAL" },
   { "history", 'H', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_history, "Number of frames for history playback (default: 0)", "N" },
+  { "history-compress", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_history_compress, "Store history frames losslessly compressed (encoded on a worker thread)", NULL },
+  { "trigger", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY, &opt_trigger, "Save history around frames where [SOURCE:]STAT>V, STAT<V or STAT~K holds (repeatable)", "COND" },
+  { "trigger-pre", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_trigger_pre, "Frames saved before a trigger (default: 50)", "N" },
+  { "trigger-post", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_trigger_post, "Frames saved after a trigger (default: 50)", "M" },
+  { "trigger-dir", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &opt_trigger_dir, "Directory for trigger dumps (default: .)", "DIR" },
+  { "record", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_record, "Start recording the stream to FITS cubes on connect", NULL },
+  { "record-dir", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &opt_record_dir, "Directory for recordings (default: .)", "DIR" },
+  { "record-every", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_record_every, "Record frames whose cnt0 is a multiple of N (default: 1)", "N" },
+  { "record-max-mb", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_record_max_mb, "Start a new file after MB megabytes (default: 4096)", "MB" },
+  { "record-queue", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_record_queue, "Frames buffered for the recorder's writer thread (default: 64)", "N" },
+  { "play", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &opt_play, "Play a FITS cube (or raw frames, see --play-raw) instead of a stream", "FILE" },
+  { "play-raw", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &opt_play_raw, "Geometry of a headerless --play file, e.g. 640x480:u16 (u8..u64, i8..i64, f32, f64)", "WxH:TYPE" },
+  { "play-fps", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_DOUBLE, &opt_play_fps, "Playback rate in frames per second (default: 25)", "FPS" },
+  { "play-loop", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_play_loop, "Loop playback", NULL },
+  { "huge-pages", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &opt_huge_pages, "Huge pages for large buffers: off, thp (default) or explicit (hugetlbfs, falls back to thp)", "MODE" },
+  { "numa-node", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_numa_node, "Prefer NUMA node N for large buffers (-1: system default; default: the UI thread's node)", "N" },
+  { "mem-budget", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_mem_budget, "Total MB for history, trace and buffers; history depth and trace length are derived from it (-H caps the depth)", "MB" },
+  { "history-file", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &opt_history_file, "Keep the history ring in a memory-mapped scratch file (overwritten)", "FILE" },
+  { "trace-record", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &opt_trace_record, "Append trace samples to FILE", "FILE" },
+  { "local-time", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_local_time, "Timestamp the trace and FPS with the local clock instead of the producer's atime/writetime", NULL },
+  { "stats-stream", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &opt_stats_stream, "Publish selection and ROI statistics to stream NAME", "NAME" },
+  { "stats-cb", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_stats_cb, "Keep the last N stats vectors in a circular buffer (default: 0)", "N" },
+  { "trace-open", 0, G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &opt_trace_open, "Browse a recorded trace FILE instead of the live trace", "FILE" },
   { NULL }
 };
 
 // Forward decl
 static void update_zoom_layout(ViewerApp *app);
+static void trigger_dump_cancel(ViewerApp *app);
+static void trigger_watch_stop(Trigger *tr);
+static void compute_histogram(const HistRegion *r, double min_val, double max_val, int bins, uint32_t *out_hist, uint32_t *out_max_count);
+static size_t hist_region_count(const HistRegion *r);
+static void stats_row_fill(double *r, double min, double max, double mean, double median,
+                           double p10, double p90, double sum, size_t npix);
+static const char* get_datatype_string(int type);
+static void stream_image_close(ViewerApp *app, IMAGE *img);
 static void get_image_screen_geometry(ViewerApp *app, int widget_w, int widget_h, double *center_x, double *center_y, double *scale);
 static void widget_to_image_coords(ViewerApp *app, double wx, double wy, int *ix, int *iy);
 gboolean update_display (gpointer user_data);
@@ -453,6 +1166,10 @@ static void on_blink_toggled(GtkToggleButton *btn, gpointer user_data);
 static void on_blink_time_changed(GtkDropDown *dropdown, GParamSpec *pspec, gpointer user_data);
 static void on_sec_autoscale_toggled(GtkToggleButton *btn, gpointer user_data);
 static void update_stream_ui_state(ViewerApp *app);
+static void hist_cache_invalidate(HistCache *cache);
+static void hreplay_invalidate(ViewerApp *app);
+static void clear_tstat(ViewerApp *app, int target);
+static void update_tstat_ui_state(ViewerApp *app);
 
 static void save_current_stream_state(ViewerApp *app) {
     int idx = app->active_stream;
@@ -626,6 +1343,7 @@ on_prim_load_clicked (GtkButton *btn, gpointer user_data)
     IMAGE test_img;
     if (ImageStreamIO_openIm(&test_img, text) == 0) {
         ImageStreamIO_closeIm(&test_img);
+        clear_tstat(app, 0);
 
         // If we are currently viewing Primary, update immediately
         if (app->active_stream == 0) {
@@ -633,11 +1351,8 @@ on_prim_load_clicked (GtkButton *btn, gpointer user_data)
             if (app->streams[0].image == app->image) app->streams[0].image = NULL;
 
             // Close current app->image (which is Primary)
-            if (app->image) {
-                ImageStreamIO_closeIm(app->image);
-                free(app->image);
-                app->image = NULL;
-            }
+            stream_image_close(app, app->image);
+            app->image = NULL;
             if (app->image_name) free(app->image_name);
 
             app->image = (IMAGE*)malloc(sizeof(IMAGE));
@@ -674,11 +1389,8 @@ on_prim_load_clicked (GtkButton *btn, gpointer user_data)
             app->force_redraw = TRUE;
         } else {
             // We are viewing Secondary. Update streams[0] in background.
-             if (app->streams[0].image) {
-                ImageStreamIO_closeIm(app->streams[0].image);
-                free(app->streams[0].image);
-                app->streams[0].image = NULL;
-            }
+            stream_image_close(app, app->streams[0].image);
+            app->streams[0].image = NULL;
             if (app->streams[0].image_name) free(app->streams[0].image_name);
 
             app->streams[0].image = (IMAGE*)malloc(sizeof(IMAGE));
@@ -710,6 +1422,7 @@ on_prim_load_clicked (GtkButton *btn, gpointer user_data)
             }
         }
 
+        hist_cache_invalidate(&app->hist_cache);
         update_stream_ui_state(app);
 
         // Set Blue on input
@@ -796,6 +1509,7 @@ on_sec_load_clicked (GtkButton *btn, gpointer user_data)
 
         if (test_img.md->size[0] == p_w && test_img.md->size[1] == p_h) {
             ImageStreamIO_closeIm(&test_img); // Close temporary
+            clear_tstat(app, 1);
 
             // If active stream is Secondary, clear app->image before freeing streams[1].image to avoid dangling pointer
             if (app->active_stream == 1 && app->image == app->streams[1].image) app->image = NULL;
@@ -842,6 +1556,7 @@ on_sec_load_clicked (GtkButton *btn, gpointer user_data)
                 app->force_redraw = TRUE;
             }
 
+            hist_cache_invalidate(&app->hist_cache);
             update_stream_ui_state(app);
 
         } else {
@@ -898,6 +1613,7 @@ on_sec_clear_clicked (GtkButton *btn, gpointer user_data)
     }
 
     // Clear streams[1]
+    clear_tstat(app, 1);
     if (app->streams[1].image) {
         ImageStreamIO_closeIm(app->streams[1].image);
         free(app->streams[1].image);
@@ -914,6 +1630,7 @@ on_sec_clear_clicked (GtkButton *btn, gpointer user_data)
     gtk_widget_remove_css_class(GTK_WIDGET(app->entry_sec_stream), "entry-green");
     gtk_widget_remove_css_class(GTK_WIDGET(app->entry_sec_stream), "entry-red");
 
+    hist_cache_invalidate(&app->hist_cache);
     update_stream_ui_state(app);
 }
 
@@ -982,6 +1699,7 @@ on_tbin_target_changed (GtkDropDown *dropdown, GParamSpec *pspec, gpointer user_
     app->tbin_control_target = gtk_drop_down_get_selected(dropdown); // 0 or 1
     update_tbin_menu_state(app);
     update_rms_menu_state(app);
+    update_tstat_ui_state(app);
 }
 
 // 2D Mode Callbacks
@@ -1262,205 +1980,3516 @@ on_flip_y_toggled (GtkToggleButton *btn, gpointer user_data)
     app->force_redraw = TRUE;
 }
 
+// Temporal Statistics
+
 static void
-on_tbin_clicked (GtkButton *btn, gpointer user_data)
-{
-    ViewerApp *app = (ViewerApp *)user_data;
-    int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(btn), "tbin-val"));
-    int target = app->tbin_control_target;
-    StreamContext *ctx = &app->streams[target];
+tstat_convert_frame(const void *src, uint8_t datatype, size_t n, float *dst) {
+    #define TSTAT_CONVERT(type) \
+        { \
+            const type *ptr = (const type*)src; \
+            for (size_t i = 0; i < n; ++i) dst[i] = (float)ptr[i]; \
+        }
 
-    if (!ctx->base_image_name) return;
+    switch (datatype) {
+        case _DATATYPE_FLOAT: memcpy(dst, src, n * sizeof(float)); break;
+        case _DATATYPE_DOUBLE: TSTAT_CONVERT(double); break;
+        case _DATATYPE_UINT8: TSTAT_CONVERT(uint8_t); break;
+        case _DATATYPE_INT16: TSTAT_CONVERT(int16_t); break;
+        case _DATATYPE_UINT16: TSTAT_CONVERT(uint16_t); break;
+        case _DATATYPE_INT32: TSTAT_CONVERT(int32_t); break;
+        case _DATATYPE_UINT32: TSTAT_CONVERT(uint32_t); break;
+        default: memset(dst, 0, n * sizeof(float)); break;
+    }
+}
 
-    if (tbin == ctx->current_tbin && !ctx->current_rms_mode) return;
+static void
+tstat_accumulate_sum(const void *src, uint8_t datatype, size_t n, double *restrict sum) {
+    #define TSTAT_SUM(type) \
+        { \
+            const type *restrict ptr = (const type*)src; \
+            for (size_t i = 0; i < n; ++i) sum[i] += (double)ptr[i]; \
+        }
 
-    ctx->current_tbin = tbin;
-    ctx->current_rms_mode = FALSE;
+    switch (datatype) {
+        case _DATATYPE_FLOAT: TSTAT_SUM(float); break;
+        case _DATATYPE_DOUBLE: TSTAT_SUM(double); break;
+        case _DATATYPE_UINT8: TSTAT_SUM(uint8_t); break;
+        case _DATATYPE_INT16: TSTAT_SUM(int16_t); break;
+        case _DATATYPE_UINT16: TSTAT_SUM(uint16_t); break;
+        case _DATATYPE_INT32: TSTAT_SUM(int32_t); break;
+        case _DATATYPE_UINT32: TSTAT_SUM(uint32_t); break;
+        default: break;
+    }
+}
 
-    if (ctx->image_name) free(ctx->image_name);
+// Accumulator updates: plain float loops over restrict pointers so the compiler
+// vectorizes them (one Welford step per pixel, no per-pixel branches).
+static void
+tstat_update_block(size_t n, const float *restrict x, float *restrict mean, float *restrict m2, float inv_count) {
+    for (size_t i = 0; i < n; ++i) {
+        float d = x[i] - mean[i];
+        mean[i] += d * inv_count;
+        m2[i] += d * (x[i] - mean[i]);
+    }
+}
 
-    if (tbin == 1) {
-        ctx->image_name = strdup(ctx->base_image_name);
-    } else {
-        char buf[256];
-        snprintf(buf, sizeof(buf), "%s.tbin%d", ctx->base_image_name, tbin);
-        ctx->image_name = strdup(buf);
+// Exponentially weighted mean and variance (West 1979)
+static void
+tstat_update_exp(size_t n, const float *restrict x, float *restrict mean, float *restrict var, float alpha) {
+    for (size_t i = 0; i < n; ++i) {
+        float d = x[i] - mean[i];
+        float incr = alpha * d;
+        mean[i] += incr;
+        var[i] = (1.0f - alpha) * (var[i] + d * incr);
     }
+}
 
-    // If we are currently displaying this stream, reload
-    if (target == app->active_stream) {
-        // Clear alias to avoid dangling pointer
-        if (ctx->image == app->image) ctx->image = NULL;
+static void
+tstat_update_extrema(size_t n, const float *restrict x, float *restrict vmin, float *restrict vmax) {
+    for (size_t i = 0; i < n; ++i) {
+        vmin[i] = (x[i] < vmin[i]) ? x[i] : vmin[i];
+        vmax[i] = (x[i] > vmax[i]) ? x[i] : vmax[i];
+    }
+}
 
-        if (ctx->image == app->image) ctx->image = NULL;
+static void
+tstat_publish(TemporalStats *ts) {
+    float *dst = ts->out.array.F;
+    size_t n = ts->npix;
+
+    ts->out.md->write = 1;
+    switch (ts->stat) {
+        case TSTAT_MEAN:
+            memcpy(dst, ts->mean, n * sizeof(float));
+            break;
+        case TSTAT_RMS: {
+            float norm = ts->exponential ? 1.0f : 1.0f / ts->count;
+            for (size_t i = 0; i < n; ++i) dst[i] = sqrtf(ts->m2[i] * norm);
+            break;
+        }
+        case TSTAT_MIN:
+            memcpy(dst, ts->vmin, n * sizeof(float));
+            break;
+        case TSTAT_MAX:
+            memcpy(dst, ts->vmax, n * sizeof(float));
+            break;
+        case TSTAT_TBIN: {
+            double norm = 1.0 / ts->count;
+            for (size_t i = 0; i < n; ++i) dst[i] = (float)(ts->sum[i] * norm);
+            break;
+        }
+    }
+    ImageStreamIO_UpdateIm(&ts->out);
+}
 
-        if (app->image) {
-            ImageStreamIO_closeIm(app->image);
-            free(app->image);
-            app->image = NULL;
+// One incoming frame. Block mode publishes every `window` frames, like the
+// external tbin streams. Exponential mode publishes mean/RMS every frame;
+// min/max always cover blocks of `window` frames.
+static void
+tstat_process_frame(TemporalStats *ts, const void *src_ptr, uint8_t datatype) {
+    size_t n = ts->npix;
+
+    if (ts->stat == TSTAT_TBIN) {
+        if (ts->count == 0) memset(ts->sum, 0, n * sizeof(double));
+        tstat_accumulate_sum(src_ptr, datatype, n, ts->sum);
+        if (++ts->count >= ts->window) {
+            tstat_publish(ts);
+            ts->count = 0;
         }
-        if (app->image_name) free(app->image_name);
-        app->image_name = strdup(ctx->image_name);
+        return;
+    }
 
-        // Reset history buffers as stream changed
-        if (app->img_history_cnt0) memset(app->img_history_cnt0, 0, app->img_history_capacity * sizeof(uint64_t));
-        app->img_history_head = 0;
+    tstat_convert_frame(src_ptr, datatype, n, ts->frame);
+
+    if (ts->count == 0) {
+        memcpy(ts->vmin, ts->frame, n * sizeof(float));
+        memcpy(ts->vmax, ts->frame, n * sizeof(float));
+        if (!ts->exponential || !ts->seeded) {
+            memcpy(ts->mean, ts->frame, n * sizeof(float));
+            memset(ts->m2, 0, n * sizeof(float));
+            ts->seeded = TRUE;
+        } else {
+            tstat_update_exp(n, ts->frame, ts->mean, ts->m2, 1.0f / ts->window);
+        }
     } else {
-        // Just reload the background stream image
-        if (ctx->image) {
-            ImageStreamIO_closeIm(ctx->image);
-            free(ctx->image);
-            ctx->image = NULL;
+        if (ts->exponential) tstat_update_exp(n, ts->frame, ts->mean, ts->m2, 1.0f / ts->window);
+        else tstat_update_block(n, ts->frame, ts->mean, ts->m2, 1.0f / (ts->count + 1));
+        tstat_update_extrema(n, ts->frame, ts->vmin, ts->vmax);
+    }
+    ts->count++;
+
+    gboolean block_done = (ts->count >= ts->window);
+    gboolean extrema = (ts->stat == TSTAT_MIN || ts->stat == TSTAT_MAX);
+    if (block_done || (ts->exponential && !extrema)) tstat_publish(ts);
+    if (block_done) ts->count = 0;
+}
+
+static gpointer
+tstat_worker(gpointer user_data) {
+    TemporalStats *ts = (TemporalStats *)user_data;
+    IMAGE *src = &ts->source;
+
+    // Wait on the source semaphore when it has one, poll otherwise
+    int semindex = (src->md->sem > 0) ? ImageStreamIO_getsemwaitindex(src, 0) : -1;
+    if (semindex >= 0) ImageStreamIO_semflush(src, semindex);
+
+    while (g_atomic_int_get(&ts->running)) {
+        if (semindex >= 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += TSTAT_SEM_TIMEOUT_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            ImageStreamIO_semtimedwait(src, semindex, &deadline);
+        } else {
+            g_usleep(1000);
         }
-        ctx->image = (IMAGE*)malloc(sizeof(IMAGE));
-        ImageStreamIO_openIm(ctx->image, ctx->image_name);
 
-        // If secondary stream changed and we are in 2D mode, we might need to handle buffer resize or redraw
-        if (target == 1 && app->mode_2d) {
-             // Redraw will pick up new data, but buffer size logic in draw_image handles realloc
+        uint64_t cnt0 = src->md->cnt0;
+        if (cnt0 == ts->last_cnt0 || src->md->write) continue;
+
+        uint8_t datatype = src->md->datatype;
+        size_t frame_size = ts->npix * ImageStreamIO_typesize(datatype);
+        uint64_t missed = cnt0 - ts->last_cnt0;
+        ts->last_cnt0 = cnt0;
+
+        if ((src->md->imagetype & CIRCULAR_BUFFER) && src->md->naxis == 3) {
+            // Catch up on frames that arrived while we were busy, oldest first.
+            // The slice after the newest one may already be under write.
+            uint64_t nslices = src->md->size[2];
+            uint64_t cnt1 = src->md->cnt1;
+            uint64_t nread = missed;
+            if (nread > nslices - 1) nread = (nslices > 1) ? nslices - 1 : 1;
+
+            for (uint64_t j = nread; j-- > 0;) {
+                uint64_t slice = (cnt1 + nslices - (j % nslices)) % nslices;
+                tstat_process_frame(ts, (const char*)src->array.raw + slice * frame_size, datatype);
+            }
+        } else {
+            tstat_process_frame(ts, src->array.raw, datatype);
         }
     }
-
-    update_tbin_menu_state(app);
-    update_rms_menu_state(app);
-    app->force_redraw = TRUE;
+    return NULL;
 }
 
 static void
-on_rms_clicked (GtkButton *btn, gpointer user_data)
-{
-    ViewerApp *app = (ViewerApp *)user_data;
-    int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(btn), "tbin-val"));
-    int target = app->tbin_control_target;
-    StreamContext *ctx = &app->streams[target];
+tstat_stop(TemporalStats *ts) {
+    if (!ts) return;
+
+    g_atomic_int_set(&ts->running, 0);
+    if (ts->thread) g_thread_join(ts->thread);
+
+    // Removes the shm file; viewers still attached keep their mapping until closeIm
+    if (ts->out.md) ImageStreamIO_destroyIm(&ts->out);
+    if (ts->source.md) ImageStreamIO_closeIm(&ts->source);
+
+    free(ts->frame);
+    free(ts->mean);
+    free(ts->m2);
+    free(ts->vmin);
+    free(ts->vmax);
+    free(ts->sum);
+    free(ts->source_name);
+    free(ts->out_name);
+    free(ts);
+}
 
-    if (!ctx->base_image_name) return;
+static TemporalStats *
+tstat_start(const char *source_name, int stat, int window, gboolean exponential) {
+    TemporalStats *ts = (TemporalStats*)calloc(1, sizeof(TemporalStats));
+    if (!ts) return NULL;
 
-    if (tbin == ctx->current_tbin && ctx->current_rms_mode) return;
+    if (ImageStreamIO_openIm(&ts->source, source_name) != IMAGESTREAMIO_SUCCESS) {
+        free(ts);
+        return NULL;
+    }
 
-    ctx->current_tbin = tbin;
-    ctx->current_rms_mode = TRUE;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s.tstat", source_name);
+    ts->source_name = strdup(source_name);
+    ts->out_name = strdup(buf);
+    ts->stat = stat;
+    ts->window = (window > 0) ? window : 1;
+    ts->exponential = exponential;
+
+    uint32_t dims[2] = { ts->source.md->size[0], ts->source.md->size[1] };
+    ts->npix = (size_t)dims[0] * dims[1];
+
+    gboolean allocated;
+    if (stat == TSTAT_TBIN) {
+        ts->sum = (double*)malloc(ts->npix * sizeof(double));
+        allocated = (ts->sum != NULL);
+    } else {
+        ts->frame = (float*)malloc(ts->npix * sizeof(float));
+        ts->mean = (float*)malloc(ts->npix * sizeof(float));
+        ts->m2 = (float*)malloc(ts->npix * sizeof(float));
+        ts->vmin = (float*)malloc(ts->npix * sizeof(float));
+        ts->vmax = (float*)malloc(ts->npix * sizeof(float));
+        allocated = (ts->frame && ts->mean && ts->m2 && ts->vmin && ts->vmax);
+    }
+
+    if (!allocated ||
+        ImageStreamIO_createIm(&ts->out, ts->out_name, 2, dims, _DATATYPE_FLOAT, 1, 0, 0) != IMAGESTREAMIO_SUCCESS) {
+        memset(&ts->out, 0, sizeof(IMAGE));
+        tstat_stop(ts);
+        return NULL;
+    }
+    memset(ts->out.array.F, 0, ts->npix * sizeof(float));
+
+    // Start from the next frame
+    ts->last_cnt0 = ts->source.md->cnt0;
+    g_atomic_int_set(&ts->running, 1);
+    ts->thread = g_thread_new("tstat", tstat_worker, ts);
+    return ts;
+}
 
-    if (ctx->image_name) free(ctx->image_name);
+// Large Buffers
+// The history ring, trace chunks and frame-sized work buffers are anonymous
+// mappings. From 2 MB up they are rounded and aligned to 2 MB so they can be
+// backed by huge pages: transparent ones via madvise, or hugetlbfs pages with
+// --huge-pages explicit. Each mapping prefers one NUMA node (that of the UI
+// thread, which does the per-frame work, unless --numa-node says otherwise).
+// The history ring is also pre-faulted by a background thread, so the first
+// pass through it does not stall the UI on page faults.
 
-    char buf[256];
-    snprintf(buf, sizeof(buf), "%s.tbin%d.rms", ctx->base_image_name, tbin);
-    ctx->image_name = strdup(buf);
+enum { BIG_HUGE_OFF, BIG_HUGE_THP, BIG_HUGE_EXPLICIT };
 
-    if (target == app->active_stream) {
-        if (app->image) {
-            ImageStreamIO_closeIm(app->image);
-            free(app->image);
-            app->image = NULL;
-        }
-        if (app->image_name) free(app->image_name);
-        app->image_name = strdup(ctx->image_name);
+typedef struct {
+    char *base;
+    size_t len;
+    gint cancel;
+    GThread *thread;
+} BigPrefault;
 
-        if (app->img_history_cnt0) memset(app->img_history_cnt0, 0, app->img_history_capacity * sizeof(uint64_t));
-        app->img_history_head = 0;
-    } else {
-        if (ctx->image) {
-            ImageStreamIO_closeIm(ctx->image);
-            free(ctx->image);
-            ctx->image = NULL;
+static int big_huge_mode = BIG_HUGE_THP;
+static int big_node = -1; // Preferred NUMA node, -1 for the default policy
+static BigPrefault big_prefault_jobs[BIG_PREFAULT_JOBS]; // Touched from the UI thread only
+
+// Settle the options; call from the UI thread before allocating
+static gboolean
+big_init(const char *huge_pages, int numa_node) {
+    if (!huge_pages || strcmp(huge_pages, "thp") == 0) big_huge_mode = BIG_HUGE_THP;
+    else if (strcmp(huge_pages, "off") == 0) big_huge_mode = BIG_HUGE_OFF;
+    else if (strcmp(huge_pages, "explicit") == 0) big_huge_mode = BIG_HUGE_EXPLICIT;
+    else {
+        fprintf(stderr, "--huge-pages must be off, thp or explicit\n");
+        return FALSE;
+    }
+
+    big_node = numa_node;
+#ifdef SYS_getcpu
+    unsigned cpu, node;
+    if (numa_node == BIG_NUMA_AUTO) big_node = syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? (int)node : -1;
+#else
+    if (numa_node == BIG_NUMA_AUTO) big_node = -1;
+#endif
+    return TRUE;
+}
+
+static size_t
+big_round(size_t len) {
+    size_t unit = len >= BIG_HUGE_BYTES ? BIG_HUGE_BYTES : (size_t)sysconf(_SC_PAGESIZE);
+    return (len + unit - 1) / unit * unit;
+}
+
+static gpointer
+big_prefault_worker(gpointer data) {
+    BigPrefault *job = (BigPrefault *)data;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < job->len && !g_atomic_int_get(&job->cancel); off += BIG_PREFAULT_STEP) {
+        size_t n = job->len - off < BIG_PREFAULT_STEP ? job->len - off : BIG_PREFAULT_STEP;
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(job->base + off, n, MADV_POPULATE_WRITE) == 0) continue;
+#endif
+        // Older kernels: write-fault each page with an atomic no-op, which
+        // cannot lose a concurrent write of the page's owner
+        for (size_t i = 0; i < n; i += page) __atomic_fetch_add(job->base + off + i, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void
+big_prefault_start(char *base, size_t len) {
+    for (int i = 0; i < BIG_PREFAULT_JOBS; ++i) {
+        BigPrefault *job = &big_prefault_jobs[i];
+        if (job->base) continue;
+        job->base = base;
+        job->len = len;
+        g_atomic_int_set(&job->cancel, 0);
+        job->thread = g_thread_new("prefault", big_prefault_worker, job);
+        return;
+    }
+}
+
+// Zero-filled; release with big_free and the same len
+static void *
+big_alloc(size_t len, gboolean prefault) {
+    if (len == 0) return NULL;
+    size_t mlen = big_round(len);
+    gboolean huge = mlen >= BIG_HUGE_BYTES;
+    char *p = (char*)MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (huge && big_huge_mode == BIG_HUGE_EXPLICIT) {
+        static gboolean warned = FALSE;
+        p = (char*)mmap(NULL, mlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED && !warned) {
+            fprintf(stderr, "No reserved huge pages for a %zu MB buffer (vm.nr_hugepages), using transparent ones\n", mlen >> 20);
+            warned = TRUE;
+        }
+    }
+#endif
+    if (p == MAP_FAILED) {
+        // Over-map by one huge page and trim, so the buffer starts on a 2 MB boundary
+        size_t extra = huge ? BIG_HUGE_BYTES : 0;
+        char *raw = (char*)mmap(NULL, mlen + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return NULL;
+        p = raw;
+        if (huge) {
+            p = (char*)(((uintptr_t)raw + BIG_HUGE_BYTES - 1) & ~(uintptr_t)(BIG_HUGE_BYTES - 1));
+            if (p > raw) munmap(raw, p - raw);
+            if (raw + extra > p) munmap(p + mlen, raw + extra - p);
+#ifdef MADV_HUGEPAGE
+            madvise(p, mlen, big_huge_mode == BIG_HUGE_OFF ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+#endif
         }
-        ctx->image = (IMAGE*)malloc(sizeof(IMAGE));
-        ImageStreamIO_openIm(ctx->image, ctx->image_name);
     }
 
-    update_tbin_menu_state(app);
-    update_rms_menu_state(app);
-    app->force_redraw = TRUE;
+#ifdef SYS_mbind
+    if (big_node >= 0 && big_node < (int)(8 * sizeof(unsigned long))) {
+        unsigned long mask = 1UL << big_node;
+        syscall(SYS_mbind, p, mlen, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+    }
+#endif
+    if (prefault) big_prefault_start(p, mlen);
+    return p;
 }
 
 static void
-update_tbin_menu_state (ViewerApp *app)
-{
-    int target = app->tbin_control_target;
-    StreamContext *ctx = &app->streams[target];
-
-    GtkWidget *child = gtk_widget_get_first_child(app->box_tbin_btns);
-    while (child) {
-        if (GTK_IS_BUTTON(child)) {
-            int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(child), "tbin-val"));
+big_free(void *p, size_t len) {
+    if (!p) return;
+    for (int i = 0; i < BIG_PREFAULT_JOBS; ++i) {
+        BigPrefault *job = &big_prefault_jobs[i];
+        if (job->base != p) continue;
+        g_atomic_int_set(&job->cancel, 1);
+        g_thread_join(job->thread);
+        memset(job, 0, sizeof(*job));
+    }
+    munmap(p, big_round(len));
+}
 
-            gboolean exists = FALSE;
-            if (ctx->base_image_name) {
-                if (tbin == 1) {
-                    exists = TRUE;
-                } else {
-                    char buf[256];
-                    snprintf(buf, sizeof(buf), "%s.tbin%d", ctx->base_image_name, tbin);
-                    IMAGE test_img;
-                    if (ImageStreamIO_openIm(&test_img, buf) == 0) {
-                        exists = TRUE;
-                        ImageStreamIO_closeIm(&test_img);
-                    }
-                }
-            }
+// Grow *buf to hold at least need bytes (contents are not kept)
+static gboolean
+big_reserve(void **buf, size_t *size, size_t need) {
+    if (*buf && *size >= need) return TRUE;
+    big_free(*buf, *size);
+    *buf = big_alloc(need, FALSE);
+    *size = *buf ? need : 0;
+    return *buf != NULL;
+}
 
-            gtk_widget_set_sensitive(child, exists);
+// Compressed Frame History
+// Codec: element delta (temporal, or spatial for keyframes), byte shuffle so
+// each plane of the delta is contiguous, then per plane an LZ77 pass with a
+// 64 KiB window and a canonical Huffman stage. Planes that stay zero collapse
+// into long offset-1 matches; noisy low planes are left to Huffman. Each plane
+// keeps whichever of LZ, LZ + Huffman or Huffman alone comes out smallest, or
+// is stored as is when none of them saves anything.
 
-            if (exists) {
-                gtk_widget_add_css_class(child, "tbin-exists");
-            } else {
-                gtk_widget_remove_css_class(child, "tbin-exists");
-            }
+enum { HC_PLANE_LZ, HC_PLANE_LZ_HUFF, HC_PLANE_HUFF, HC_PLANE_RAW };
+enum { HC_DELTA, HC_KEY, HC_KEY_RAW }; // HistCodec.key
 
-            if (tbin == ctx->current_tbin && !ctx->current_rms_mode) {
-                gtk_widget_add_css_class(child, "tbin-selected");
-            } else {
-                gtk_widget_remove_css_class(child, "tbin-selected");
-            }
-        }
-        child = gtk_widget_get_next_sibling(child);
-    }
+static inline size_t
+hc_bound(size_t n) {
+    return n + n / 255 + 16;
 }
 
-static void
-update_rms_menu_state (ViewerApp *app)
-{
-    int target = app->tbin_control_target;
-    StreamContext *ctx = &app->streams[target];
+// Encoded frame of n bytes in up to 8 planes: no plane payload exceeds its
+// size, the rest covers headers, Huffman length tables and a partial byte
+static inline size_t
+hc_frame_bound(size_t n) {
+    return hc_bound(n) + 8 * (HC_PLANE_HDR + 128 + 1);
+}
 
-    GtkWidget *child = gtk_widget_get_first_child(app->box_rms_btns);
-    while (child) {
-        if (GTK_IS_BUTTON(child)) {
-            int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(child), "tbin-val"));
+static inline uint32_t
+hc_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
 
-            gboolean exists = FALSE;
-            if (ctx->base_image_name) {
-                char buf[256];
-                snprintf(buf, sizeof(buf), "%s.tbin%d.rms", ctx->base_image_name, tbin);
-                IMAGE test_img;
-                if (ImageStreamIO_openIm(&test_img, buf) == 0) {
-                    exists = TRUE;
-                    ImageStreamIO_closeIm(&test_img);
-                }
-            }
+static uint8_t *
+hc_put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
 
-            gtk_widget_set_sensitive(child, exists);
+static uint8_t *
+hc_put_sequence(uint8_t *op, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen) {
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15) op = hc_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) return op;
+
+    *op++ = (uint8_t)(offset & 0xFF);
+    *op++ = (uint8_t)(offset >> 8);
+    mlen -= HC_MIN_MATCH;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15) op = hc_put_len(op, mlen - 15);
+    return op;
+}
 
-            if (exists) {
-                gtk_widget_add_css_class(child, "tbin-exists");
-            } else {
-                gtk_widget_remove_css_class(child, "tbin-exists");
+// Returns compressed size; dst must hold hc_bound(n)
+static size_t
+hc_lz_compress(const uint8_t *src, size_t n, uint8_t *dst, uint32_t *table) {
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+    memset(table, 0, sizeof(uint32_t) << HC_HASH_BITS);
+
+    if (n >= HC_MIN_MATCH) {
+        const uint8_t *limit = end - HC_MIN_MATCH;
+        while (ip <= limit) {
+            uint32_t seq = hc_read32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - HC_HASH_BITS);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > 65535 || hc_read32(ref) != seq) {
+                ip++;
+                continue;
             }
-
-            if (tbin == ctx->current_tbin && ctx->current_rms_mode) {
-                gtk_widget_add_css_class(child, "tbin-selected");
-            } else {
-                gtk_widget_remove_css_class(child, "tbin-selected");
+            const uint8_t *mp = ip + HC_MIN_MATCH, *rp = ref + HC_MIN_MATCH;
+            while (mp < end && *mp == *rp) {
+                mp++;
+                rp++;
             }
+            op = hc_put_sequence(op, anchor, ip - anchor, ip - ref, mp - ip);
+            ip = anchor = mp;
         }
-        child = gtk_widget_get_next_sibling(child);
     }
+    if (anchor < end || op == dst) op = hc_put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+// Returns FALSE on malformed input or size mismatch
+static gboolean
+hc_lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t dst_size) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + dst_size;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return FALSE;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) return FALSE;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip >= iend) break;
+
+        if (iend - ip < 2) return FALSE;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return FALSE;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += HC_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || mlen > (size_t)(oend - op)) return FALSE;
+        const uint8_t *ref = op - offset;
+        // Byte copy: overlapping matches repeat the last `offset` bytes
+        for (size_t i = 0; i < mlen; ++i) op[i] = ref[i];
+        op += mlen;
+    }
+    return op == oend;
 }
 
 static void
-refresh_tbin_popover (GtkWidget *popover, gpointer user_data)
-{
-    ViewerApp *app = (ViewerApp *)user_data;
+hc_histogram(const uint8_t *src, size_t n, uint32_t *freq) {
+    memset(freq, 0, 256 * sizeof(uint32_t));
+    for (size_t i = 0; i < n; ++i) freq[src[i]]++;
+}
+
+// Huffman code lengths for the byte frequencies, at most HC_HUFF_BITS long.
+// Over-long trees are rebuilt from flattened frequencies.
+static void
+hc_huff_lengths(const uint32_t *freq_in, uint8_t *len) {
+    uint32_t freq[256];
+    memcpy(freq, freq_in, sizeof(freq));
+    memset(len, 0, 256);
+    for (;;) {
+        uint64_t w[511];
+        int sym[256], parent[511], depth[511], n = 0, max = 0;
+        for (int s = 0; s < 256; ++s)
+            if (freq[s]) sym[n++] = s;
+        if (n == 0) return;
+        if (n == 1) {
+            len[sym[0]] = 1;
+            return;
+        }
+
+        // Leaves by ascending weight, then a two-queue merge: leaves and
+        // internal nodes are each produced in weight order
+        for (int a = 1; a < n; ++a) {
+            int s = sym[a], b = a;
+            for (; b > 0 && freq[sym[b - 1]] > freq[s]; --b) sym[b] = sym[b - 1];
+            sym[b] = s;
+        }
+        for (int a = 0; a < n; ++a) w[a] = freq[sym[a]];
+        int leaf = 0, node = n;
+        for (int k = n; k < 2 * n - 1; ++k) {
+            int pick[2];
+            for (int m = 0; m < 2; ++m)
+                pick[m] = (leaf < n && (node >= k || w[leaf] <= w[node])) ? leaf++ : node++;
+            w[k] = w[pick[0]] + w[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = k;
+        }
+        depth[2 * n - 2] = 0;
+        for (int k = 2 * n - 3; k >= 0; --k) depth[k] = depth[parent[k]] + 1;
+        for (int a = 0; a < n; ++a) {
+            len[sym[a]] = (uint8_t)depth[a];
+            if (depth[a] > max) max = depth[a];
+        }
+        if (max <= HC_HUFF_BITS) return;
+        for (int s = 0; s < 256; ++s)
+            if (freq[s]) freq[s] = (freq[s] >> 1) | 1;
+    }
+}
+
+// Canonical codes: shorter first, then by symbol
+static void
+hc_huff_codes(const uint8_t *len, uint16_t *code) {
+    int count[HC_HUFF_BITS + 1] = { 0 };
+    uint16_t next[HC_HUFF_BITS + 1];
+    for (int s = 0; s < 256; ++s) count[len[s]]++;
+    count[0] = 0;
+    int c = 0;
+    for (int l = 1; l <= HC_HUFF_BITS; ++l) {
+        c = (c + count[l - 1]) << 1;
+        next[l] = (uint16_t)c;
+    }
+    for (int s = 0; s < 256; ++s)
+        if (len[s]) code[s] = next[len[s]]++;
+}
+
+// Encoded size: 128 bytes of 4-bit lengths, then the bit stream
+static size_t
+hc_huff_cost(const uint32_t *freq, const uint8_t *len) {
+    uint64_t bits = 0;
+    for (int s = 0; s < 256; ++s) bits += (uint64_t)freq[s] * len[s];
+    return 128 + (size_t)((bits + 7) / 8);
+}
+
+static size_t
+hc_huff_encode(const uint8_t *src, size_t n, const uint8_t *len, uint8_t *dst) {
+    uint16_t code[256];
+    hc_huff_codes(len, code);
+    uint8_t *op = dst;
+    for (int s = 0; s < 256; s += 2) *op++ = (uint8_t)(len[s] | (len[s + 1] << 4));
+
+    uint64_t bits = 0;
+    int nbits = 0;
+    for (size_t i = 0; i < n; ++i) {
+        bits = (bits << len[src[i]]) | code[src[i]];
+        nbits += len[src[i]];
+        while (nbits >= 8) {
+            nbits -= 8;
+            *op++ = (uint8_t)(bits >> nbits);
+        }
+    }
+    if (nbits > 0) *op++ = (uint8_t)(bits << (8 - nbits));
+    return op - dst;
+}
+
+// Returns FALSE on malformed input
+static gboolean
+hc_huff_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t dst_size) {
+    uint8_t len[256];
+    uint16_t code[256], table[1 << HC_HUFF_BITS];
+    if (n < 128) return FALSE;
+    uint32_t kraft = 0;
+    for (int s = 0; s < 256; ++s) {
+        len[s] = (s & 1) ? src[s / 2] >> 4 : src[s / 2] & 15;
+        if (len[s] > HC_HUFF_BITS) return FALSE;
+        if (len[s]) kraft += 1u << (HC_HUFF_BITS - len[s]);
+    }
+    if (kraft > (1u << HC_HUFF_BITS)) return FALSE;
+
+    // Every code fills the table entries it prefixes: symbol | length << 8
+    hc_huff_codes(len, code);
+    memset(table, 0, sizeof(table));
+    for (int s = 0; s < 256; ++s) {
+        if (!len[s]) continue;
+        uint32_t first = (uint32_t)code[s] << (HC_HUFF_BITS - len[s]);
+        for (uint32_t k = 0; k < (1u << (HC_HUFF_BITS - len[s])); ++k)
+            table[first + k] = (uint16_t)(s | (len[s] << 8));
+    }
+
+    const uint8_t *ip = src + 128, *iend = src + n;
+    uint64_t bits = 0;
+    int nbits = 0;
+    size_t pad = 0, i = 0;
+    while (i < dst_size) {
+        // Refill to at least 48 bits: four codes
+        if (iend - ip >= 8) {
+            int k = (63 - nbits) >> 3;
+            if (k > 0) {
+                uint64_t v;
+                memcpy(&v, ip, 8);
+                v = GUINT64_FROM_BE(v);
+                bits = (bits << (8 * k)) | (v >> (64 - 8 * k));
+                ip += k;
+                nbits += 8 * k;
+            }
+        } else {
+            while (nbits <= 56) {
+                if (ip < iend) bits = (bits << 8) | *ip++;
+                else {
+                    bits <<= 8;
+                    pad++;
+                }
+                nbits += 8;
+            }
+        }
+        int r = dst_size - i < 4 ? (int)(dst_size - i) : 4;
+        while (r-- > 0) {
+            uint16_t e = table[(bits >> (nbits - HC_HUFF_BITS)) & ((1u << HC_HUFF_BITS) - 1)];
+            if (!(e >> 8)) return FALSE;
+            dst[i++] = (uint8_t)e;
+            nbits -= e >> 8;
+        }
+    }
+    // The stream may not end before the last code
+    return (size_t)nbits >= pad * 8;
+}
+
+static inline void
+hc_put32(uint8_t *p, uint32_t v) {
+    memcpy(p, &v, 4);
+}
+
+// Encode esize planes of nelem bytes; dst must hold hc_frame_bound(esize * nelem),
+// scratch hc_bound(nelem)
+static size_t
+hc_encode_planes(const uint8_t *planes, size_t nelem, int esize, uint8_t *dst, uint8_t *scratch, uint32_t *table) {
+    uint8_t *op = dst;
+    for (int k = 0; k < esize; ++k) {
+        const uint8_t *plane = planes + (size_t)k * nelem;
+        uint32_t freq[256];
+        uint8_t len[2][256];
+        hc_histogram(plane, nelem, freq);
+        hc_huff_lengths(freq, len[1]);
+        size_t huff = hc_huff_cost(freq, len[1]);
+
+        // Noise planes (over 4 bits per byte) hold no repeats worth an LZ pass.
+        // Otherwise Huffman over the LZ output may beat both; a code needs at
+        // least a bit per byte, so not where LZ all but removes the plane.
+        const uint8_t *in[2] = { scratch, plane };
+        size_t in_n[2] = { 0, nelem }, best = huff;
+        int mode = HC_PLANE_HUFF;
+        if (huff < 128 + nelem / 2) {
+            size_t lz = hc_lz_compress(plane, nelem, scratch, table);
+            in_n[0] = lz;
+            if (lz <= best) {
+                best = lz;
+                mode = HC_PLANE_LZ;
+            }
+            if (128 + lz / 8 < best) {
+                hc_histogram(scratch, lz, freq);
+                hc_huff_lengths(freq, len[0]);
+                size_t cost = hc_huff_cost(freq, len[0]);
+                if (cost < best) {
+                    best = cost;
+                    mode = HC_PLANE_LZ_HUFF;
+                }
+            }
+        }
+        if (best >= nelem) mode = HC_PLANE_RAW;
+
+        uint8_t *hdr = op;
+        op += HC_PLANE_HDR;
+        hdr[0] = (uint8_t)mode;
+        if (mode == HC_PLANE_RAW) {
+            memcpy(op, plane, nelem);
+            hc_put32(hdr + 1, (uint32_t)nelem);
+            hc_put32(hdr + 5, (uint32_t)nelem);
+            op += nelem;
+        } else if (mode == HC_PLANE_LZ) {
+            memcpy(op, scratch, in_n[0]);
+            hc_put32(hdr + 1, (uint32_t)in_n[0]);
+            hc_put32(hdr + 5, (uint32_t)in_n[0]);
+            op += in_n[0];
+        } else {
+            int m = (mode == HC_PLANE_HUFF);
+            size_t n = hc_huff_encode(in[m], in_n[m], len[m], op);
+            hc_put32(hdr + 1, (uint32_t)in_n[m]);
+            hc_put32(hdr + 5, (uint32_t)n);
+            op += n;
+        }
+    }
+    return op - dst;
+}
+
+// Inverse of hc_encode_planes; scratch must hold hc_bound(nelem)
+static gboolean
+hc_decode_planes(const uint8_t *src, size_t n, size_t nelem, int esize, uint8_t *planes, uint8_t *scratch) {
+    const uint8_t *ip = src, *iend = src + n;
+    for (int k = 0; k < esize; ++k) {
+        uint8_t *plane = planes + (size_t)k * nelem;
+        if (iend - ip < HC_PLANE_HDR) return FALSE;
+        int mode = ip[0];
+        size_t mid = hc_read32(ip + 1), len = hc_read32(ip + 5);
+        ip += HC_PLANE_HDR;
+        if (len > (size_t)(iend - ip)) return FALSE;
+
+        gboolean ok;
+        if (mode == HC_PLANE_LZ) {
+            ok = hc_lz_decompress(ip, len, plane, nelem);
+        } else if (mode == HC_PLANE_LZ_HUFF) {
+            ok = mid <= hc_bound(nelem) && hc_huff_decode(ip, len, scratch, mid) &&
+                 hc_lz_decompress(scratch, mid, plane, nelem);
+        } else if (mode == HC_PLANE_HUFF) {
+            ok = mid == nelem && hc_huff_decode(ip, len, plane, nelem);
+        } else if (mode == HC_PLANE_RAW) {
+            ok = len == nelem;
+            if (ok) memcpy(plane, ip, nelem);
+        } else {
+            ok = FALSE;
+        }
+        if (!ok) return FALSE;
+        ip += len;
+    }
+    return ip == iend;
+}
+
+// Delta against base (or the previous element when base is NULL), zigzag so
+// small negative deltas keep their high bytes zero, then shuffle
+#define HC_DELTA_CASE(T) { \
+    const T *c = (const T*)cur; const T *b = (const T*)base; T prev = 0; \
+    for (size_t i = 0; i < n; ++i) { \
+        T d = b ? (T)(c[i] - b[i]) : (T)(c[i] - prev); \
+        d = (T)((T)(d << 1) ^ (T)(0 - (d >> (sizeof(T) * 8 - 1)))); \
+        prev = c[i]; \
+        const uint8_t *db = (const uint8_t*)&d; \
+        for (int k = 0; k < (int)sizeof(T); ++k) out[k * n + i] = db[k]; \
+    } break; }
+
+static void
+hc_delta_shuffle(const void *cur, const void *base, size_t n, int esize, uint8_t *out) {
+    switch (esize) {
+        case 1: HC_DELTA_CASE(uint8_t)
+        case 2: HC_DELTA_CASE(uint16_t)
+        case 4: HC_DELTA_CASE(uint32_t)
+        case 8: HC_DELTA_CASE(uint64_t)
+    }
+}
+
+// Inverse: frame = base + delta (or running sum when base is NULL); frame may alias base
+#define HC_UNDELTA_CASE(T) { \
+    T *f = (T*)frame; const T *b = (const T*)base; T prev = 0; \
+    for (size_t i = 0; i < n; ++i) { \
+        T d; uint8_t *db = (uint8_t*)&d; \
+        for (int k = 0; k < (int)sizeof(T); ++k) db[k] = in[k * n + i]; \
+        d = (T)((d >> 1) ^ (T)(0 - (d & 1))); \
+        prev = (T)((b ? b[i] : prev) + d); \
+        f[i] = prev; \
+    } break; }
+
+static void
+hc_unshuffle_undelta(const uint8_t *in, const void *base, size_t n, int esize, void *frame) {
+    switch (esize) {
+        case 1: HC_UNDELTA_CASE(uint8_t)
+        case 2: HC_UNDELTA_CASE(uint16_t)
+        case 4: HC_UNDELTA_CASE(uint32_t)
+        case 8: HC_UNDELTA_CASE(uint64_t)
+    }
+}
+
+// Decode entry i (track * capacity + slot) of track t onto frame, which holds
+// the previous slot's frame unless i is a keyframe
+static gboolean
+hist_codec_decode_entry(HistCodec *hc, int t, size_t i, uint8_t *frame, uint8_t *planes, uint8_t *scratch) {
+    if (hc->key[i] == HC_KEY_RAW) {
+        if (hc->size[i] != hc->frame_size[t]) return FALSE;
+        memcpy(frame, hc->data[i], hc->frame_size[t]);
+        return TRUE;
+    }
+    if (!hc_decode_planes(hc->data[i], hc->size[i], hc->nelem[t], hc->esize[t], planes, scratch)) return FALSE;
+    hc_unshuffle_undelta(planes, hc->key[i] ? NULL : frame, hc->nelem[t], hc->esize[t], frame);
+    return TRUE;
+}
+
+// The frame after `slot` of track t as a raw keyframe, before the keyframe in
+// slot is overwritten. Only the oldest slot is stored raw. tail keeps the
+// frame re-keyed last, which is the one overwritten next, so in steady state
+// this costs one delta decode. Worker only: it is the sole writer of the slots.
+static uint8_t *
+hist_codec_rekey(HistCodec *hc, int t, size_t slot) {
+    size_t cap = hc->capacity, next = (slot + 1) % cap;
+    uint8_t *tail = hc->tail[t];
+
+    if (hc->tail_slot[t] != (long)slot &&
+        !hist_codec_decode_entry(hc, t, t * cap + slot, tail, hc->enc_planes, hc->enc_lz)) {
+        hc->tail_slot[t] = -1;
+        return NULL;
+    }
+    hc->tail_slot[t] = -1;
+    if (!hist_codec_decode_entry(hc, t, t * cap + next, tail, hc->enc_planes, hc->enc_lz)) return NULL;
+    hc->tail_slot[t] = (long)next;
+
+    uint8_t *copy = (uint8_t*)malloc(hc->frame_size[t]);
+    if (copy) memcpy(copy, tail, hc->frame_size[t]);
+    return copy;
+}
+
+static gpointer
+hist_codec_worker(gpointer user_data) {
+    HistCodec *hc = (HistCodec *)user_data;
+
+    g_mutex_lock(&hc->lock);
+    for (;;) {
+        while (hc->running && hc->q_count == 0) g_cond_wait(&hc->cond, &hc->lock);
+        if (!hc->running) break;
+        int idx = hc->q_head;
+        int t = hc->queue_track[idx];
+        size_t slot = hc->queue_slot[idx];
+        size_t i = t * hc->capacity + slot;
+        size_t j = t * hc->capacity + (slot + 1) % hc->capacity;
+        gboolean key = !hc->prev_valid[t] || hc->since_key[t] == 0;
+        // Overwriting a keyframe strands the deltas after it
+        gboolean rekey = hc->capacity > 1 && hc->data[i] && hc->key[i] && hc->ready[j] && !hc->key[j];
+        hc->busy = TRUE;
+        g_mutex_unlock(&hc->lock);
+
+        uint8_t *rekeyed = rekey ? hist_codec_rekey(hc, t, slot) : NULL;
+
+        const uint8_t *frame = hc->queue[idx];
+        hc_delta_shuffle(frame, key ? NULL : hc->prev[t], hc->nelem[t], hc->esize[t], hc->enc_planes);
+        size_t n = hc_encode_planes(hc->enc_planes, hc->nelem[t], hc->esize[t], hc->enc_out, hc->enc_lz, hc->enc_table);
+        uint8_t *copy = (uint8_t*)malloc(n);
+        if (copy) memcpy(copy, hc->enc_out, n);
+        memcpy(hc->prev[t], frame, hc->frame_size[t]);
+
+        g_mutex_lock(&hc->lock);
+        if (rekeyed) {
+            hc->stored_bytes += hc->frame_size[t] - hc->size[j];
+            free(hc->data[j]);
+            hc->data[j] = rekeyed;
+            hc->size[j] = (uint32_t)hc->frame_size[t];
+            hc->key[j] = HC_KEY_RAW;
+        }
+        if (hc->data[i]) hc->stored_bytes -= hc->size[i];
+        free(hc->data[i]);
+        hc->data[i] = copy;
+        hc->size[i] = copy ? (uint32_t)n : 0;
+        hc->key[i] = key ? HC_KEY : HC_DELTA;
+        hc->ready[i] = (copy != NULL);
+        if (copy) hc->stored_bytes += n;
+        // A failed allocation breaks the chain; start over with a keyframe
+        hc->prev_valid[t] = (copy != NULL);
+        hc->since_key[t] = key ? 1 : (hc->since_key[t] + 1) % HIST_KEY_INTERVAL;
+        hc->q_head = (idx + 1) % HIST_QUEUE_LEN;
+        hc->q_count--;
+        hc->busy = FALSE;
+        g_cond_broadcast(&hc->cond);
+    }
+    g_mutex_unlock(&hc->lock);
+    return NULL;
+}
+
+// Drop all slots and pending frames; the next frames become keyframes
+static void
+hist_codec_invalidate(HistCodec *hc) {
+    g_mutex_lock(&hc->lock);
+    while (hc->busy) g_cond_wait(&hc->cond, &hc->lock);
+    hc->q_count = 0;
+    for (size_t i = 0; i < HIST_TRACKS * hc->capacity; ++i) {
+        free(hc->data[i]);
+        hc->data[i] = NULL;
+        hc->ready[i] = 0;
+    }
+    hc->stored_bytes = 0;
+    for (int t = 0; t < HIST_TRACKS; ++t) {
+        hc->prev_valid[t] = FALSE;
+        hc->since_key[t] = 0;
+        hc->cached_slot[t] = -1;
+        hc->tail_slot[t] = -1;
+    }
+    g_mutex_unlock(&hc->lock);
+}
+
+static void
+hist_codec_free_buffers(HistCodec *hc) {
+    for (int i = 0; i < HIST_QUEUE_LEN; ++i) {
+        free(hc->queue[i]);
+        hc->queue[i] = NULL;
+    }
+    for (int t = 0; t < HIST_TRACKS; ++t) {
+        free(hc->prev[t]);
+        free(hc->cached[t]);
+        free(hc->tail[t]);
+        hc->prev[t] = hc->cached[t] = hc->tail[t] = NULL;
+        hc->frame_size[t] = 0;
+    }
+    free(hc->enc_planes);
+    free(hc->enc_out);
+    free(hc->enc_lz);
+    free(hc->dec_planes);
+    free(hc->dec_lz);
+    hc->enc_planes = hc->enc_out = hc->enc_lz = hc->dec_planes = hc->dec_lz = NULL;
+    hc->max_frame = 0;
+}
+
+// (Re)size the working buffers for new track geometries (frame_size 0 = unused)
+static gboolean
+hist_codec_configure(HistCodec *hc, const size_t *frame_size, const int *esize) {
+    hist_codec_invalidate(hc);
+    g_mutex_lock(&hc->lock);
+    hist_codec_free_buffers(hc);
+    size_t max_frame = 0;
+    for (int t = 0; t < HIST_TRACKS; ++t)
+        if (frame_size[t] > max_frame) max_frame = frame_size[t];
+
+    gboolean ok = TRUE;
+    for (int i = 0; i < HIST_QUEUE_LEN; ++i) ok &= ((hc->queue[i] = (uint8_t*)malloc(max_frame)) != NULL);
+    for (int t = 0; t < HIST_TRACKS && ok; ++t) {
+        if (frame_size[t] == 0) continue;
+        hc->prev[t] = (uint8_t*)malloc(frame_size[t]);
+        hc->cached[t] = (uint8_t*)malloc(frame_size[t]);
+        hc->tail[t] = (uint8_t*)malloc(frame_size[t]);
+        ok = hc->prev[t] && hc->cached[t] && hc->tail[t];
+    }
+    hc->enc_planes = (uint8_t*)malloc(max_frame);
+    hc->enc_out = (uint8_t*)malloc(hc_frame_bound(max_frame));
+    hc->enc_lz = (uint8_t*)malloc(hc_bound(max_frame));
+    hc->dec_planes = (uint8_t*)malloc(max_frame);
+    hc->dec_lz = (uint8_t*)malloc(hc_bound(max_frame));
+    ok = ok && hc->enc_planes && hc->enc_out && hc->enc_lz && hc->dec_planes && hc->dec_lz;
+    if (ok) {
+        for (int t = 0; t < HIST_TRACKS; ++t) {
+            hc->frame_size[t] = frame_size[t];
+            hc->esize[t] = esize[t];
+            hc->nelem[t] = frame_size[t] ? frame_size[t] / esize[t] : 0;
+        }
+        hc->max_frame = max_frame;
+    } else {
+        fprintf(stderr, "Error: cannot allocate compressed history buffers\n");
+        hist_codec_free_buffers(hc);
+    }
+    g_mutex_unlock(&hc->lock);
+    return ok;
+}
+
+// Queue the frames of every configured track for slot. FALSE when the encoder
+// is behind (the slot is then not recorded) or not configured.
+static gboolean
+hist_codec_enqueue(HistCodec *hc, size_t slot, const void *const *frames) {
+    int pos[HIST_TRACKS], need = 0;
+
+    g_mutex_lock(&hc->lock);
+    for (int t = 0; t < HIST_TRACKS; ++t) need += (hc->frame_size[t] > 0);
+    if (hc->max_frame == 0 || hc->q_count + need > HIST_QUEUE_LEN) {
+        g_mutex_unlock(&hc->lock);
+        return FALSE;
+    }
+    for (int t = 0, k = 0; t < HIST_TRACKS; ++t) {
+        hc->ready[t * hc->capacity + slot] = 0;
+        if (hc->cached_slot[t] == (long)slot) hc->cached_slot[t] = -1;
+        if (hc->frame_size[t] > 0) pos[t] = (hc->q_head + hc->q_count + k++) % HIST_QUEUE_LEN;
+    }
+    g_mutex_unlock(&hc->lock);
+
+    // Only this thread adds to the queue, so these entries stay ours until q_count grows
+    for (int t = 0; t < HIST_TRACKS; ++t) {
+        if (hc->frame_size[t] == 0) continue;
+        memcpy(hc->queue[pos[t]], frames[t], hc->frame_size[t]);
+        hc->queue_slot[pos[t]] = slot;
+        hc->queue_track[pos[t]] = t;
+    }
+
+    g_mutex_lock(&hc->lock);
+    hc->q_count += need;
+    g_cond_signal(&hc->cond);
+    g_mutex_unlock(&hc->lock);
+    return TRUE;
+}
+
+// Decode slot of track into dst. max_back is how many older slots still
+// belong to the history (the chain may not reach past them). Stepping one
+// frame forward from the cached one costs a single delta.
+static gboolean
+hist_codec_decode(HistCodec *hc, int track, size_t slot, size_t max_back, void *dst) {
+    size_t cap = hc->capacity;
+    const uint8_t *key = hc->key + track * cap, *ready = hc->ready + track * cap;
+    gboolean ok = FALSE;
+
+    g_mutex_lock(&hc->lock);
+    if (hc->frame_size[track] == 0) goto out;
+    if (hc->cached_slot[track] != (long)slot) {
+        size_t start = slot, back = 0;
+        for (;;) {
+            if (!ready[start]) goto out;
+            if ((long)start == hc->cached_slot[track] || key[start]) break;
+            if (back == max_back) goto out;
+            start = (start + cap - 1) % cap;
+            back++;
+        }
+
+        gboolean from_cache = ((long)start == hc->cached_slot[track]);
+        hc->cached_slot[track] = -1;
+        for (size_t k = from_cache ? 1 : 0; k <= back; ++k) {
+            size_t j = track * cap + (start + k) % cap;
+            if (!hist_codec_decode_entry(hc, track, j, hc->cached[track], hc->dec_planes, hc->dec_lz)) goto out;
+        }
+        hc->cached_slot[track] = (long)slot;
+    }
+    memcpy(dst, hc->cached[track], hc->frame_size[track]);
+    ok = TRUE;
+out:
+    g_mutex_unlock(&hc->lock);
+    return ok;
+}
+
+static HistCodec *
+hist_codec_new(size_t capacity) {
+    HistCodec *hc = (HistCodec*)calloc(1, sizeof(HistCodec));
+    if (!hc) return NULL;
+    hc->capacity = capacity;
+    hc->data = (uint8_t**)calloc(HIST_TRACKS * capacity, sizeof(uint8_t*));
+    hc->size = (uint32_t*)calloc(HIST_TRACKS * capacity, sizeof(uint32_t));
+    hc->key = (uint8_t*)calloc(HIST_TRACKS * capacity, 1);
+    hc->ready = (uint8_t*)calloc(HIST_TRACKS * capacity, 1);
+    hc->enc_table = (uint32_t*)malloc(sizeof(uint32_t) << HC_HASH_BITS);
+    for (int t = 0; t < HIST_TRACKS; ++t) hc->cached_slot[t] = hc->tail_slot[t] = -1;
+    if (!hc->data || !hc->size || !hc->key || !hc->ready || !hc->enc_table) {
+        free(hc->data);
+        free(hc->size);
+        free(hc->key);
+        free(hc->ready);
+        free(hc->enc_table);
+        free(hc);
+        return NULL;
+    }
+    g_mutex_init(&hc->lock);
+    g_cond_init(&hc->cond);
+    hc->running = TRUE;
+    hc->thread = g_thread_new("hist-codec", hist_codec_worker, hc);
+    return hc;
+}
+
+static void
+hist_codec_free(HistCodec *hc) {
+    if (!hc) return;
+    g_mutex_lock(&hc->lock);
+    hc->running = FALSE;
+    g_cond_broadcast(&hc->cond);
+    g_mutex_unlock(&hc->lock);
+    g_thread_join(hc->thread);
+
+    for (size_t i = 0; i < HIST_TRACKS * hc->capacity; ++i) free(hc->data[i]);
+    hist_codec_free_buffers(hc);
+    free(hc->data);
+    free(hc->size);
+    free(hc->key);
+    free(hc->ready);
+    free(hc->enc_table);
+    g_mutex_clear(&hc->lock);
+    g_cond_clear(&hc->cond);
+    free(hc);
+}
+
+// Frame History Index
+// Lookups first assume the ring holds consecutive cnt0 values and check the slot
+// that implies; gaps (skipped frames, repeats) fall back to the hash index.
+
+// Slots are keyed by (stream, cnt0): in blink mode the displayed stream, and so
+// the cnt0 sequence, alternates from one recorded frame to the next
+static inline size_t
+img_history_hash(const ViewerApp *app, int src, uint64_t cnt0) {
+    return (size_t)(((cnt0 ^ ((uint64_t)src << 56)) * 0x9E3779B97F4A7C15ULL) >> 17) & app->img_history_index_mask;
+}
+
+static inline gboolean
+img_history_slot_is(const ViewerApp *app, size_t slot, int src, uint64_t cnt0) {
+    return app->img_history_cnt0[slot] == cnt0 && app->img_history_src[slot] == src;
+}
+
+static void
+img_history_reset(ViewerApp *app) {
+    trigger_dump_cancel(app);
+    hreplay_invalidate(app);
+    if (app->img_history_cnt0) memset(app->img_history_cnt0, 0, app->img_history_capacity * sizeof(uint64_t));
+    if (app->img_history_index) memset(app->img_history_index, 0xFF, (app->img_history_index_mask + 1) * sizeof(int32_t));
+    app->img_history_head = 0;
+    app->img_history_count = 0;
+    app->img_history_flush_slot = 0;
+    if (app->hist_codec) hist_codec_invalidate(app->hist_codec);
+}
+
+static gboolean
+img_history_init(ViewerApp *app, size_t capacity) {
+    size_t index_size = 1;
+    while (index_size < 2 * capacity) index_size <<= 1;
+    app->img_history_capacity = capacity;
+    app->img_history_cnt0 = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    app->img_history_pair_cnt0 = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    app->img_history_src = (uint8_t*)calloc(capacity, 1);
+    app->img_history_time = (double*)calloc(capacity, sizeof(double));
+    app->img_history_index = (int32_t*)malloc(index_size * sizeof(int32_t));
+    app->img_history_index_mask = index_size - 1;
+    if (!app->img_history_cnt0 || !app->img_history_pair_cnt0 || !app->img_history_src || !app->img_history_time ||
+        !app->img_history_index) return FALSE;
+    img_history_reset(app);
+    return TRUE;
+}
+
+// Drop the index entry for slot (only if the key still points there)
+static void
+img_history_index_remove(ViewerApp *app, size_t slot) {
+    size_t mask = app->img_history_index_mask;
+    int32_t *index = app->img_history_index;
+    size_t i = img_history_hash(app, app->img_history_src[slot], app->img_history_cnt0[slot]);
+    while (index[i] >= 0 && (size_t)index[i] != slot) i = (i + 1) & mask;
+    if (index[i] < 0) return;
+
+    // Backward-shift deletion keeps probe chains intact without tombstones
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (index[j] < 0) break;
+        size_t home = img_history_hash(app, app->img_history_src[index[j]], app->img_history_cnt0[index[j]]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index[i] = index[j];
+            i = j;
+        }
+    }
+    index[i] = -1;
+}
+
+static void
+img_history_index_insert(ViewerApp *app, size_t slot) {
+    size_t mask = app->img_history_index_mask;
+    int32_t *index = app->img_history_index;
+    int src = app->img_history_src[slot];
+    uint64_t key = app->img_history_cnt0[slot];
+    size_t i = img_history_hash(app, src, key);
+    // A repeated key moves to the newest slot
+    while (index[i] >= 0 && !img_history_slot_is(app, (size_t)index[i], src, key)) i = (i + 1) & mask;
+    index[i] = (int32_t)slot;
+}
+
+// File-backed ring: frames go to a preallocated shared mapping in slot order.
+// Writeback is started every HIST_FILE_FLUSH_BYTES and the written pages are
+// dropped from our mapping, so resident memory stays small; replay faults
+// frames back in from the file.
+static void
+img_history_advise(ViewerApp *app, int advice) {
+    if (app->img_history_fd < 0 || !app->img_history_data || app->img_history_advice == advice) return;
+    madvise(app->img_history_data, app->img_history_map_len, advice);
+    app->img_history_advice = advice;
+}
+
+static void
+img_history_free_data(ViewerApp *app) {
+    if (!app->img_history_data) return;
+    hreplay_invalidate(app);
+    if (app->img_history_fd >= 0) munmap(app->img_history_data, app->img_history_map_len);
+    else big_free(app->img_history_data, app->img_history_map_len);
+    app->img_history_data = NULL;
+    app->img_history_map_len = 0;
+}
+
+static inline size_t
+img_history_track_size(const ViewerApp *app, int track) {
+    return track ? app->img_history_frame_size_sec : app->img_history_frame_size;
+}
+
+static inline char *
+img_history_slot_ptr(ViewerApp *app, int track, size_t slot) {
+    size_t base = track ? app->img_history_capacity * app->img_history_frame_size : 0;
+    return (char*)app->img_history_data + base + slot * img_history_track_size(app, track);
+}
+
+// Size the ring for the current track geometries. Runs once the first frame
+// (or a new frame size) is seen; on failure history stays off until the size
+// changes again.
+static gboolean
+img_history_alloc_data(ViewerApp *app) {
+    img_history_free_data(app);
+    size_t len = app->img_history_capacity * (app->img_history_frame_size + app->img_history_frame_size_sec);
+    if (app->img_history_fd < 0) {
+        app->img_history_data = big_alloc(len, TRUE);
+        app->img_history_map_len = app->img_history_data ? len : 0;
+        if (!app->img_history_data) fprintf(stderr, "Cannot allocate %zu MB of history, frame history is off\n", len >> 20);
+        return app->img_history_data != NULL;
+    }
+
+    int err = ftruncate(app->img_history_fd, (off_t)len) != 0 ? errno : posix_fallocate(app->img_history_fd, 0, (off_t)len);
+    if (err) {
+        fprintf(stderr, "Cannot reserve %zu MB in the history file (%s), frame history is off\n", len >> 20, strerror(err));
+        return FALSE;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, app->img_history_fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map the history file (%s), frame history is off\n", strerror(errno));
+        return FALSE;
+    }
+    app->img_history_data = map;
+    app->img_history_map_len = len;
+    app->img_history_flush_slot = 0;
+    app->img_history_advice = -1;
+    img_history_advise(app, MADV_SEQUENTIAL);
+    return TRUE;
+}
+
+// Called after writing slot; slots are written in order and flushed at the wrap
+static void
+img_history_writeback(ViewerApp *app, size_t slot) {
+    size_t first = app->img_history_flush_slot;
+    size_t n = slot + 1 - first;
+    size_t slot_bytes = app->img_history_frame_size + app->img_history_frame_size_sec;
+    if (n * slot_bytes < HIST_FILE_FLUSH_BYTES && slot + 1 < app->img_history_capacity) return;
+
+    // Unmapping keeps dirty pages in the page cache; fadvise starts their writeback.
+    // madvise needs whole pages: the span starts at the page holding slot first and
+    // ends at the last page this batch completed (the track end when wrapping), so
+    // a page shared with the next slot goes out with the next batch.
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    gboolean wrap = slot + 1 == app->img_history_capacity;
+    for (int t = 0; t < HIST_TRACKS; ++t) {
+        size_t fs = img_history_track_size(app, t);
+        if (fs == 0) continue;
+        uintptr_t start = (uintptr_t)img_history_slot_ptr(app, t, first) & ~(page - 1);
+        uintptr_t end = (uintptr_t)img_history_slot_ptr(app, t, first) + n * fs;
+        end = wrap ? (end + page - 1) & ~(page - 1) : end & ~(page - 1);
+        if (end <= start) continue;
+        if (madvise((void*)start, end - start, MADV_DONTNEED) != 0) {
+            static gboolean warned = FALSE;
+            if (!warned) fprintf(stderr, "History file writeback: madvise failed: %s\n", strerror(errno));
+            warned = TRUE;
+        }
+        posix_fadvise(app->img_history_fd, (off_t)(start - (uintptr_t)app->img_history_data),
+                      (off_t)(end - start), POSIX_FADV_DONTNEED);
+    }
+    app->img_history_flush_slot = (slot + 1) % app->img_history_capacity;
+}
+
+// frames[t] is the frame of streams[t] (NULL for an unused track); cnt0 is the
+// key of the displayed stream, pair_cnt0 that of the other one
+static void
+img_history_record(ViewerApp *app, const void *const *frames, uint64_t cnt0, uint64_t pair_cnt0) {
+    size_t slot = app->img_history_head;
+    if (app->hist_codec) {
+        // Encoder behind: skip this frame rather than stall the UI
+        if (!hist_codec_enqueue(app->hist_codec, slot, frames)) return;
+    } else {
+        img_history_advise(app, MADV_SEQUENTIAL);
+        for (int t = 0; t < HIST_TRACKS; ++t) {
+            size_t fs = img_history_track_size(app, t);
+            if (fs) memcpy(img_history_slot_ptr(app, t, slot), frames[t], fs);
+        }
+        if (app->img_history_fd >= 0) img_history_writeback(app, slot);
+    }
+
+    if (app->img_history_count == app->img_history_capacity) img_history_index_remove(app, slot);
+    else app->img_history_count++;
+
+    app->img_history_cnt0[slot] = cnt0;
+    app->img_history_pair_cnt0[slot] = pair_cnt0;
+    app->img_history_src[slot] = (uint8_t)app->active_stream;
+    struct timespec t = app->current_frame_time;
+    if (!app->current_frame_time_valid) clock_gettime(CLOCK_MONOTONIC, &t);
+    app->img_history_time[slot] = t.tv_sec + t.tv_nsec / 1e9;
+    img_history_index_insert(app, slot);
+    app->img_history_head = (slot + 1) % app->img_history_capacity;
+    __atomic_store_n(&app->img_history_total, app->img_history_total + 1, __ATOMIC_RELEASE);
+}
+
+// Slot keyed by frame cnt0 of streams[src], or -1
+static long
+img_history_find(ViewerApp *app, int src, uint64_t cnt0) {
+    size_t cap = app->img_history_capacity;
+    if (app->img_history_count == 0) return -1;
+
+    // Consecutive frames of one stream: the slot is d back from the newest
+    size_t newest = (app->img_history_head + cap - 1) % cap;
+    uint64_t d = app->img_history_cnt0[newest] - cnt0;
+    if (app->img_history_src[newest] == src && d < app->img_history_count) {
+        size_t slot = (newest + cap - d) % cap;
+        if (img_history_slot_is(app, slot, src, cnt0)) return (long)slot;
+    }
+
+    size_t mask = app->img_history_index_mask;
+    for (size_t i = img_history_hash(app, src, cnt0); app->img_history_index[i] >= 0; i = (i + 1) & mask) {
+        if (img_history_slot_is(app, (size_t)app->img_history_index[i], src, cnt0)) return app->img_history_index[i];
+    }
+    return -1;
+}
+
+// Copy the frame of streams[track] in slot to dst; FALSE unless it is size bytes.
+// Also called by the replay prefetch worker while the ring is not written.
+static gboolean
+img_history_copy(ViewerApp *app, int track, size_t slot, void *dst, size_t size) {
+    if (size == 0 || img_history_track_size(app, track) != size) return FALSE;
+    if (!app->hist_codec) {
+        if (!app->img_history_data) return FALSE;
+        memcpy(dst, img_history_slot_ptr(app, track, slot), size);
+        return TRUE;
+    }
+    size_t cap = app->img_history_capacity;
+    size_t oldest = (app->img_history_head + cap - app->img_history_count) % cap;
+    return hist_codec_decode(app->hist_codec, track, slot, (slot + cap - oldest) % cap, dst);
+}
+
+static gboolean
+img_history_fetch(ViewerApp *app, int track, size_t slot, void *dst, size_t size) {
+    // Scrubbing jumps around; stop sequential readahead while it does
+    if (!app->hist_codec && app->img_history_data) img_history_advise(app, MADV_RANDOM);
+    return img_history_copy(app, track, slot, dst, size);
+}
+
+// cnt0 of the frame of streams[track] in slot
+static uint64_t
+img_history_slot_cnt0(const ViewerApp *app, int track, size_t slot) {
+    return (app->img_history_src[slot] == track) ? app->img_history_cnt0[slot] : app->img_history_pair_cnt0[slot];
+}
+
+// History Replay
+// Transport through the ring in recording order: single steps, and playback
+// in either direction at a fraction of real time using the recorded frame
+// times. A worker fetches (decodes, or faults in from --history-file) the
+// frames the replay will show next.
+
+static HistReplayFrame *
+hreplay_lookup(HistReplay *hr, long slot, int track) {
+    for (int i = 0; i < HREPLAY_FRAMES; ++i)
+        if (hr->frames[i].slot == slot && hr->frames[i].track == track) return &hr->frames[i];
+    return NULL;
+}
+
+static gboolean
+hreplay_wanted(const HistReplay *hr, long slot, int track) {
+    if (slot < 0 || !(hr->want_tracks & (1 << track))) return FALSE;
+    for (int k = 0; k < HREPLAY_AHEAD && hr->want[k] >= 0; ++k)
+        if (hr->want[k] == slot) return TRUE;
+    return FALSE;
+}
+
+static gpointer
+hreplay_worker(gpointer data) {
+    ViewerApp *app = (ViewerApp *)data;
+    HistReplay *hr = &app->hreplay;
+
+    g_mutex_lock(&hr->lock);
+    while (hr->running) {
+        // Nearest wanted frame not fetched yet, and an entry nobody wants to hold it
+        long slot = -1;
+        int track = 0;
+        for (int k = 0; k < HREPLAY_AHEAD && slot < 0 && hr->want[k] >= 0; ++k)
+            for (int t = 0; t < HIST_TRACKS && slot < 0; ++t)
+                if ((hr->want_tracks & (1 << t)) && !hreplay_lookup(hr, hr->want[k], t)) {
+                    slot = hr->want[k];
+                    track = t;
+                }
+        HistReplayFrame *f = NULL;
+        for (int i = 0; i < HREPLAY_FRAMES && slot >= 0 && !f; ++i)
+            if (!hreplay_wanted(hr, hr->frames[i].slot, hr->frames[i].track)) f = &hr->frames[i];
+        if (!f) {
+            g_cond_wait(&hr->cond, &hr->lock);
+            continue;
+        }
+
+        size_t size = hr->want_size[track];
+        f->slot = -1;
+        hr->busy = TRUE;
+        g_mutex_unlock(&hr->lock);
+
+        if (f->capacity < size) {
+            free(f->buf);
+            f->buf = (uint8_t*)malloc(size);
+            f->capacity = f->buf ? size : 0;
+        }
+        gboolean ok = f->buf && img_history_copy(app, track, (size_t)slot, f->buf, size);
+
+        g_mutex_lock(&hr->lock);
+        f->slot = slot;
+        f->track = track;
+        f->size = size;
+        f->ok = ok;
+        hr->busy = FALSE;
+        g_cond_broadcast(&hr->cond);
+    }
+    g_mutex_unlock(&hr->lock);
+    return NULL;
+}
+
+// Copy a prefetched frame to dst; FALSE if the worker does not have it
+static gboolean
+hreplay_take(ViewerApp *app, int track, size_t slot, void *dst, size_t size) {
+    HistReplay *hr = &app->hreplay;
+    if (!hr->active || !hr->thread) return FALSE;
+    g_mutex_lock(&hr->lock);
+    HistReplayFrame *f = hreplay_lookup(hr, (long)slot, track);
+    gboolean ok = f && f->ok && f->size == size;
+    if (ok) memcpy(dst, f->buf, size);
+    g_mutex_unlock(&hr->lock);
+    return ok;
+}
+
+// Position of slot in recording order, 0 = oldest
+static inline size_t
+hreplay_pos(const ViewerApp *app, size_t slot) {
+    size_t cap = app->img_history_capacity;
+    return (slot + cap - app->img_history_head + app->img_history_count) % cap;
+}
+
+static inline size_t
+hreplay_slot_at(const ViewerApp *app, size_t pos) {
+    size_t cap = app->img_history_capacity;
+    return (app->img_history_head + cap - app->img_history_count + pos) % cap;
+}
+
+// Positions replay moves between: the A-B range when looping, else the whole ring
+static void
+hreplay_range(ViewerApp *app, size_t *lo, size_t *hi) {
+    HistReplay *hr = &app->hreplay;
+    *lo = 0;
+    *hi = app->img_history_count - 1;
+    if (!hr->loop) return;
+    size_t p[2] = { *lo, *hi };
+    for (int m = 0; m < 2; ++m) {
+        long slot = hr->mark_set[m] ? img_history_find(app, hr->mark_src[m], hr->mark[m]) : -1;
+        if (slot >= 0) p[m] = hreplay_pos(app, (size_t)slot);
+        else if (hr->mark_set[m]) p[m] = m ? *hi : *lo; // Overwritten since it was marked
+    }
+    *lo = p[0] < p[1] ? p[0] : p[1];
+    *hi = p[0] < p[1] ? p[1] : p[0];
+}
+
+// Slot step positions away from slot (negative: back), wrapping inside the
+// loop range; -1 past either end when not looping
+static long
+hreplay_neighbor(ViewerApp *app, size_t slot, long step) {
+    size_t lo, hi;
+    hreplay_range(app, &lo, &hi);
+    long p = (long)hreplay_pos(app, slot), q = p + step;
+    if (p < (long)lo || p > (long)hi) q = step > 0 ? (long)lo : (long)hi; // Enter the range
+    else if (q < (long)lo || q > (long)hi) {
+        if (!app->hreplay.loop) return -1;
+        q = step > 0 ? (long)lo : (long)hi;
+    }
+    return (long)hreplay_slot_at(app, (size_t)q);
+}
+
+// Tell the worker which frames come next: the shown one, then along the
+// playing direction at the current stride, or both ways when stopped
+static void
+hreplay_request(ViewerApp *app) {
+    HistReplay *hr = &app->hreplay;
+    if (!hr->thread) {
+        g_mutex_init(&hr->lock);
+        g_cond_init(&hr->cond);
+        for (int i = 0; i < HREPLAY_FRAMES; ++i) hr->frames[i].slot = -1;
+        hr->running = TRUE;
+        hr->thread = g_thread_new("hist-replay", hreplay_worker, app);
+    }
+
+    long want[HREPLAY_AHEAD];
+    want[0] = (long)hr->slot;
+    long fwd = want[0], back = want[0];
+    for (int k = 1; k < HREPLAY_AHEAD; ++k) {
+        if (hr->dir != 0) {
+            want[k] = want[k - 1] >= 0 ? hreplay_neighbor(app, (size_t)want[k - 1], hr->dir * hr->stride) : -1;
+        } else if (k % 2) {
+            want[k] = fwd = fwd >= 0 ? hreplay_neighbor(app, (size_t)fwd, 1) : -1;
+        } else {
+            want[k] = back = back >= 0 ? hreplay_neighbor(app, (size_t)back, -1) : -1;
+        }
+    }
+
+    int tracks = 1 << app->active_stream;
+    if ((app->mode_2d || app->mode_merge) && app->streams[1].image) tracks |= 1 << 1;
+
+    g_mutex_lock(&hr->lock);
+    // Keep the list dense: the worker stops at the first -1
+    int n = 0;
+    for (int k = 0; k < HREPLAY_AHEAD; ++k)
+        if (want[k] >= 0) hr->want[n++] = want[k];
+    while (n < HREPLAY_AHEAD) hr->want[n++] = -1;
+    hr->want_tracks = tracks;
+    for (int t = 0; t < HIST_TRACKS; ++t) hr->want_size[t] = img_history_track_size(app, t);
+    g_cond_signal(&hr->cond);
+    g_mutex_unlock(&hr->lock);
+}
+
+// Transport state, position and loop range in the history bar
+static void
+update_hreplay_ui(ViewerApp *app) {
+    HistReplay *hr = &app->hreplay;
+    if (!app->box_hreplay) return;
+
+    app->hreplay_ui_lock = TRUE;
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->btn_hreplay_back), hr->active && hr->dir < 0);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->btn_hreplay_fwd), hr->active && hr->dir > 0);
+    app->hreplay_ui_lock = FALSE;
+
+    char buf[160], mark[2][32];
+    for (int m = 0; m < 2; ++m) {
+        if (hr->mark_set[m]) snprintf(mark[m], sizeof(mark[m]), "%lu", (unsigned long)hr->mark[m]);
+        else snprintf(mark[m], sizeof(mark[m]), "-");
+    }
+    if (hr->active) {
+        snprintf(buf, sizeof(buf), "cnt0 %lu  %zu/%zu  A %s  B %s", (unsigned long)hr->cnt0,
+                 hreplay_pos(app, hr->slot) + 1, app->img_history_count, mark[0], mark[1]);
+    } else {
+        snprintf(buf, sizeof(buf), "live  %zu frames  A %s  B %s", app->img_history_count, mark[0], mark[1]);
+    }
+    gtk_label_set_text(GTK_LABEL(app->lbl_hreplay), buf);
+}
+
+// The ring is about to change: drop prefetched frames and leave replay
+static void
+hreplay_invalidate(ViewerApp *app) {
+    HistReplay *hr = &app->hreplay;
+    gboolean was_active = hr->active;
+    hr->active = FALSE;
+    hr->dir = 0;
+    if (hr->thread) {
+        g_mutex_lock(&hr->lock);
+        while (hr->busy) g_cond_wait(&hr->cond, &hr->lock);
+        for (int k = 0; k < HREPLAY_AHEAD; ++k) hr->want[k] = -1;
+        for (int i = 0; i < HREPLAY_FRAMES; ++i) hr->frames[i].slot = -1;
+        g_mutex_unlock(&hr->lock);
+    }
+    if (was_active) {
+        app->force_redraw = TRUE;
+        update_hreplay_ui(app);
+    }
+}
+
+static void
+hreplay_show(ViewerApp *app, size_t slot) {
+    HistReplay *hr = &app->hreplay;
+    hr->slot = slot;
+    hr->cnt0 = app->img_history_cnt0[slot];
+    hr->src = app->img_history_src[slot];
+    app->force_redraw = TRUE;
+    hreplay_request(app);
+    update_hreplay_ui(app);
+}
+
+// Pause and take over the display, starting at the frame shown; FALSE without history
+static gboolean
+hreplay_enter(ViewerApp *app) {
+    HistReplay *hr = &app->hreplay;
+    if (hr->active) return TRUE;
+    if (app->img_history_capacity == 0 || app->img_history_count == 0) return FALSE;
+    if (app->btn_pause) gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->btn_pause), TRUE);
+
+    long slot = img_history_find(app, app->active_stream, app->current_cnt0);
+    if (slot < 0) slot = (long)hreplay_slot_at(app, app->img_history_count - 1);
+    hr->active = TRUE;
+    hr->dir = 0;
+    hr->stride = 1;
+    hreplay_show(app, (size_t)slot);
+    return TRUE;
+}
+
+// Advance a playing replay by the time since the last tick
+static void
+hreplay_tick(ViewerApp *app) {
+    HistReplay *hr = &app->hreplay;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!hr->active || hr->dir == 0) {
+        hr->last = now;
+        hr->owed = 0;
+        return;
+    }
+
+    hr->owed += ((now.tv_sec - hr->last.tv_sec) + (now.tv_nsec - hr->last.tv_nsec) / 1e9) * hr->rate;
+    hr->last = now;
+
+    size_t slot = hr->slot;
+    long moved = 0;
+    for (size_t n = 0; n < app->img_history_count; ++n) {
+        long next = hreplay_neighbor(app, slot, hr->dir);
+        if (next < 0) {
+            hr->dir = 0;
+            break;
+        }
+        // A one-frame loop (A == B) has nowhere to go
+        if (next == (long)slot) {
+            hr->owed = 0;
+            break;
+        }
+        // Gaps in the recording are shortened; wrapping around the loop is free
+        double d = fabs(app->img_history_time[next] - app->img_history_time[slot]);
+        if (d > HREPLAY_MAX_GAP) d = HREPLAY_MAX_GAP;
+        if ((long)hreplay_pos(app, (size_t)next) - (long)hreplay_pos(app, slot) != hr->dir) d = 0;
+        if (hr->owed < d) break;
+        hr->owed -= d;
+        slot = (size_t)next;
+        moved++;
+    }
+    if (moved > 0) hr->stride = moved;
+    if (slot != hr->slot) hreplay_show(app, slot);
+    else if (hr->dir == 0) update_hreplay_ui(app);
+}
+
+static void
+hreplay_free(ViewerApp *app) {
+    HistReplay *hr = &app->hreplay;
+    if (!hr->thread) return;
+    g_mutex_lock(&hr->lock);
+    hr->running = FALSE;
+    g_cond_broadcast(&hr->cond);
+    g_mutex_unlock(&hr->lock);
+    g_thread_join(hr->thread);
+    hr->thread = NULL;
+    hr->active = FALSE;
+    for (int i = 0; i < HREPLAY_FRAMES; ++i) free(hr->frames[i].buf);
+    g_mutex_clear(&hr->lock);
+    g_cond_clear(&hr->cond);
+}
+
+// FITS Output
+// Single-HDU cubes (NAXIS3 = frames) with a one-block header. Unsigned and
+// int8 data use the standard BZERO offsets; complex and half types are not
+// supported.
+
+static gboolean
+fits_bitpix(uint8_t datatype, int *bitpix, const char **bzero) {
+    *bzero = NULL;
+    switch (datatype) {
+        case _DATATYPE_UINT8:  *bitpix = 8; break;
+        case _DATATYPE_INT8:   *bitpix = 8; *bzero = "-128"; break;
+        case _DATATYPE_UINT16: *bitpix = 16; *bzero = "32768"; break;
+        case _DATATYPE_INT16:  *bitpix = 16; break;
+        case _DATATYPE_UINT32: *bitpix = 32; *bzero = "2147483648"; break;
+        case _DATATYPE_INT32:  *bitpix = 32; break;
+        case _DATATYPE_UINT64: *bitpix = 64; *bzero = "9223372036854775808"; break;
+        case _DATATYPE_INT64:  *bitpix = 64; break;
+        case _DATATYPE_FLOAT:  *bitpix = -32; break;
+        case _DATATYPE_DOUBLE: *bitpix = -64; break;
+        default: return FALSE;
+    }
+    return TRUE;
+}
+
+// value is written as given; string values must carry their quotes
+static void
+fits_header_card(FitsHeader *h, const char *key, const char *value, const char *comment) {
+    if (h->ncards >= FITS_BLOCK / 80 - 1) return; // Keep room for END
+    char tmp[81];
+    if (value[0] == '\'') snprintf(tmp, sizeof(tmp), "%-8.8s= %-20s%s%s", key, value, comment ? " / " : "", comment ? comment : "");
+    else snprintf(tmp, sizeof(tmp), "%-8.8s= %20s%s%s", key, value, comment ? " / " : "", comment ? comment : "");
+    memcpy(h->block + h->ncards * 80, tmp, strlen(tmp));
+    h->ncards++;
+}
+
+static void
+fits_header_set_frames(FitsHeader *h, uint64_t nframes) {
+    char val[24], tmp[81];
+    snprintf(val, sizeof(val), "%lu", (unsigned long)nframes);
+    snprintf(tmp, sizeof(tmp), "%-8.8s= %20s", "NAXIS3", val);
+    memset(h->block + h->naxis3_card * 80, ' ', 80);
+    memcpy(h->block + h->naxis3_card * 80, tmp, strlen(tmp));
+}
+
+// Mandatory cards; add keywords with fits_header_card, then fits_header_end
+static gboolean
+fits_header_init(FitsHeader *h, uint8_t datatype, int width, int height, uint64_t nframes) {
+    int bitpix;
+    const char *bzero;
+    if (!fits_bitpix(datatype, &bitpix, &bzero)) return FALSE;
+
+    char val[24];
+    memset(h->block, ' ', FITS_BLOCK);
+    h->ncards = 0;
+    fits_header_card(h, "SIMPLE", "T", NULL);
+    snprintf(val, sizeof(val), "%d", bitpix);
+    fits_header_card(h, "BITPIX", val, NULL);
+    fits_header_card(h, "NAXIS", "3", NULL);
+    snprintf(val, sizeof(val), "%d", width);
+    fits_header_card(h, "NAXIS1", val, NULL);
+    snprintf(val, sizeof(val), "%d", height);
+    fits_header_card(h, "NAXIS2", val, NULL);
+    h->naxis3_card = h->ncards++;
+    fits_header_set_frames(h, nframes);
+    if (bzero) {
+        fits_header_card(h, "BZERO", bzero, NULL);
+        fits_header_card(h, "BSCALE", "1", NULL);
+    }
+    return TRUE;
+}
+
+static void
+fits_header_end(FitsHeader *h) {
+    memcpy(h->block + h->ncards * 80, "END", 3);
+}
+
+// Frame to FITS data: big-endian, unsigned types shifted to signed
+#define FITS_ENCODE(T, SWAP, FLIP) { \
+    const T *s = (const T*)src; T *d = (T*)dst; \
+    for (size_t i = 0; i < nelem; ++i) d[i] = SWAP((T)(s[i] ^ (T)(FLIP))); \
+    break; }
+#define FITS_NOSWAP(x) (x)
+
+static void
+fits_encode(void *dst, const void *src, uint8_t datatype, size_t nelem) {
+    switch (datatype) {
+        case _DATATYPE_UINT8:  memcpy(dst, src, nelem); break;
+        case _DATATYPE_INT8:   FITS_ENCODE(uint8_t, FITS_NOSWAP, 0x80)
+        case _DATATYPE_UINT16: FITS_ENCODE(uint16_t, GUINT16_TO_BE, 0x8000)
+        case _DATATYPE_INT16:  FITS_ENCODE(uint16_t, GUINT16_TO_BE, 0)
+        case _DATATYPE_UINT32: FITS_ENCODE(uint32_t, GUINT32_TO_BE, 0x80000000u)
+        case _DATATYPE_INT32:
+        case _DATATYPE_FLOAT:  FITS_ENCODE(uint32_t, GUINT32_TO_BE, 0)
+        case _DATATYPE_UINT64: FITS_ENCODE(uint64_t, GUINT64_TO_BE, 0x8000000000000000ULL)
+        case _DATATYPE_INT64:
+        case _DATATYPE_DOUBLE: FITS_ENCODE(uint64_t, GUINT64_TO_BE, 0)
+    }
+}
+
+// Inverse of fits_encode
+#define FITS_DECODE(T, SWAP, FLIP) { \
+    const T *s = (const T*)src; T *d = (T*)dst; \
+    for (size_t i = 0; i < nelem; ++i) d[i] = (T)(SWAP(s[i]) ^ (T)(FLIP)); \
+    break; }
+
+static void
+fits_decode(void *dst, const void *src, uint8_t datatype, size_t nelem) {
+    switch (datatype) {
+        case _DATATYPE_UINT8:  memcpy(dst, src, nelem); break;
+        case _DATATYPE_INT8:   FITS_DECODE(uint8_t, FITS_NOSWAP, 0x80)
+        case _DATATYPE_UINT16: FITS_DECODE(uint16_t, GUINT16_FROM_BE, 0x8000)
+        case _DATATYPE_INT16:  FITS_DECODE(uint16_t, GUINT16_FROM_BE, 0)
+        case _DATATYPE_UINT32: FITS_DECODE(uint32_t, GUINT32_FROM_BE, 0x80000000u)
+        case _DATATYPE_INT32:
+        case _DATATYPE_FLOAT:  FITS_DECODE(uint32_t, GUINT32_FROM_BE, 0)
+        case _DATATYPE_UINT64: FITS_DECODE(uint64_t, GUINT64_FROM_BE, 0x8000000000000000ULL)
+        case _DATATYPE_INT64:
+        case _DATATYPE_DOUBLE: FITS_DECODE(uint64_t, GUINT64_FROM_BE, 0)
+    }
+}
+
+// Event Trigger
+// A watcher thread checks the conditions on every frame of the primary stream
+// (catching up through circular buffer slices, or stepping through every frame
+// of a played file), on the selection (the full frame when none is drawn) or
+// ROI rectangles synced from the UI. When one fires, the trigger waits for
+// `post` more history frames, then a worker copies pre + 1 + post frames out
+// of the history ring into a FITS cube, with the matching trace samples as
+// CSV. The history holds displayed frames, so the cube is centered on the
+// newest one at or before the event. The ring keeps being written meanwhile;
+// the worker stops if it is about to be overtaken.
+
+static const char *trigger_stat_names[STATS_VEC_LEN] = { "min", "max", "mean", "median", "p10", "p90", "sum", "npix" };
+
+// [SOURCE:]STAT>V, STAT<V, or STAT~K (|x - mean| > K sigma over a running baseline)
+static gboolean
+trigger_parse(const char *text, TriggerCond *c) {
+    memset(c, 0, sizeof(*c));
+    snprintf(c->text, sizeof(c->text), "%s", text);
+    snprintf(c->source, sizeof(c->source), "sel");
+
+    const char *p = text;
+    const char *colon = strchr(text, ':');
+    if (colon) {
+        snprintf(c->source, sizeof(c->source), "%.*s", (int)(colon - text), text);
+        p = colon + 1;
+    }
+
+    size_t len = strcspn(p, "<>~");
+    if (!p[len]) return FALSE;
+    c->stat = -1;
+    for (int i = 0; i < STATS_VEC_LEN; ++i)
+        if (strlen(trigger_stat_names[i]) == len && strncmp(p, trigger_stat_names[i], len) == 0) c->stat = i;
+    if (c->stat < 0) return FALSE;
+
+    c->op = p[len];
+    char *end;
+    c->value = strtod(p + len + 1, &end);
+    return end != p + len + 1 && *end == '\0';
+}
+
+static Trigger *
+trigger_new(gchar **conds, int pre, int post, const char *dir) {
+    Trigger *tr = (Trigger*)calloc(1, sizeof(Trigger));
+    if (!tr) return NULL;
+    for (int i = 0; conds[i]; ++i) {
+        if (tr->ncond == TRIGGER_MAX_CONDS) {
+            fprintf(stderr, "At most %d trigger conditions\n", TRIGGER_MAX_CONDS);
+            free(tr);
+            return NULL;
+        }
+        if (!trigger_parse(conds[i], &tr->cond[tr->ncond])) {
+            fprintf(stderr, "Bad trigger condition '%s' (expected [SOURCE:]STAT>V, STAT<V or STAT~K)\n", conds[i]);
+            free(tr);
+            return NULL;
+        }
+        tr->ncond++;
+    }
+    tr->pre = pre > 0 ? pre : 0;
+    tr->post = post > 0 ? post : 0;
+    snprintf(tr->dir, sizeof(tr->dir), "%s", dir ? dir : ".");
+    g_mutex_init(&tr->lock);
+    return tr;
+}
+
+// Stop a running dump before the ring it reads changes; the job itself is freed
+// by trigger_dump_done
+static void
+trigger_dump_cancel(ViewerApp *app) {
+    TriggerJob *job = app->trigger ? app->trigger->job : NULL;
+    if (!job || !job->thread) return;
+    g_atomic_int_set(&job->cancel, 1);
+    g_thread_join(job->thread);
+    job->thread = NULL;
+}
+
+static void
+trigger_job_free(TriggerJob *job) {
+    free(job->slots);
+    free(job->max_back);
+    free(job->trace_rows);
+    free(job);
+}
+
+static gboolean
+trigger_dump_done(gpointer user_data) {
+    TriggerJob *job = (TriggerJob *)user_data;
+    ViewerApp *app = (ViewerApp *)job->app;
+
+    if (job->thread) g_thread_join(job->thread);
+    printf("%s\n", job->msg);
+    if (app->trigger) app->trigger->job = NULL;
+    trigger_job_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+static gpointer
+trigger_dump_worker(gpointer data) {
+    TriggerJob *job = (TriggerJob *)data;
+    ViewerApp *app = (ViewerApp *)job->app;
+    char path[sizeof(job->dir) + 64];
+    const char *err = NULL;
+
+    if (job->nframes > 0) {
+        snprintf(path, sizeof(path), "%s/trig_%lu.fits", job->dir, (unsigned long)job->trig_cnt0);
+        FitsHeader hdr;
+        char val[72];
+        fits_header_init(&hdr, job->datatype, job->width, job->height, job->nframes);
+        snprintf(val, sizeof(val), "%lu", (unsigned long)job->trig_cnt0);
+        fits_header_card(&hdr, "TRIGCNT0", val, "cnt0 of the triggering frame");
+        snprintf(val, sizeof(val), "%d", job->trig_index);
+        fits_header_card(&hdr, "TRIGIDX", val, "Cube index of the triggering frame");
+        snprintf(val, sizeof(val), "'%.60s'", job->cond);
+        fits_header_card(&hdr, "TRIGCOND", val, NULL);
+        fits_header_end(&hdr);
+
+        uint8_t *frame = (uint8_t*)malloc(job->frame_size);
+        uint8_t *enc = (uint8_t*)malloc(job->frame_size);
+        FILE *f = fopen(path, "wb");
+        if (!f || !frame || !enc) {
+            err = "cannot write";
+        } else {
+            fwrite(hdr.block, FITS_BLOCK, 1, f);
+            size_t nelem = job->frame_size / ImageStreamIO_typesize(job->datatype);
+            for (int i = 0; i < job->nframes && !err; ++i) {
+                if (g_atomic_int_get(&job->cancel)) {
+                    err = "cancelled";
+                } else if (app->hist_codec) {
+                    if (!hist_codec_decode(app->hist_codec, job->track, job->slots[i], job->max_back[i], frame)) err = "frame not decodable";
+                } else {
+                    memcpy(frame, img_history_slot_ptr(app, job->track, job->slots[i]), job->frame_size);
+                }
+                // Valid only if the ring had not reached the oldest slot we need
+                uint64_t total = __atomic_load_n(&app->img_history_total, __ATOMIC_ACQUIRE);
+                if (!err && total - job->total0 >= job->budget) err = "history overwritten";
+                if (err) break;
+                fits_encode(enc, frame, job->datatype, nelem);
+                fwrite(enc, job->frame_size, 1, f);
+                job->written++;
+            }
+
+            size_t data_bytes = (size_t)job->written * job->frame_size;
+            size_t pad = (FITS_BLOCK - data_bytes % FITS_BLOCK) % FITS_BLOCK;
+            for (size_t left = pad; left > 0;) {
+                static const uint8_t zeros[512];
+                size_t n = left < sizeof(zeros) ? left : sizeof(zeros);
+                fwrite(zeros, 1, n, f);
+                left -= n;
+            }
+            if (job->written != job->nframes) {
+                fits_header_set_frames(&hdr, job->written);
+                fseek(f, 0, SEEK_SET);
+                fwrite(hdr.block, FITS_BLOCK, 1, f);
+            }
+            if (ferror(f)) err = "write error";
+        }
+        if (f && fclose(f) != 0 && !err) err = "write error";
+        free(frame);
+        free(enc);
+    }
+
+    if (job->ntrace > 0) {
+        snprintf(path, sizeof(path), "%s/trig_%lu.csv", job->dir, (unsigned long)job->trig_cnt0);
+        FILE *f = fopen(path, "w");
+        if (f) {
+            fprintf(f, "time,cnt0,min,max,mean,median,p10,p90\n");
+            for (int i = 0; i < job->ntrace; ++i) {
+                const double *r = job->trace_rows + i * TRIGGER_TRACE_COLS;
+                fprintf(f, "%.9f,%lu,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", r[0], (unsigned long)r[1],
+                        r[2], r[3], r[4], r[5], r[6], r[7]);
+            }
+            fclose(f);
+        } else if (!err) {
+            err = "cannot write trace";
+        }
+    }
+
+    snprintf(job->msg, sizeof(job->msg), "Trigger %s at cnt0 %lu: %d/%d frames, %d trace samples in %s%s%s",
+             job->cond, (unsigned long)job->trig_cnt0, job->written, job->nframes, job->ntrace, job->dir,
+             err ? " - " : "", err ? err : "");
+    g_idle_add(trigger_dump_done, job);
+    return NULL;
+}
+
+// Hand the frames around the event to a dump worker
+static void
+trigger_schedule(ViewerApp *app) {
+    Trigger *tr = app->trigger;
+    if (tr->job) {
+        printf("Trigger %s at cnt0 %lu skipped: previous event still saving\n", tr->fired, (unsigned long)tr->fire_cnt0);
+        return;
+    }
+
+    TriggerJob *job = (TriggerJob*)calloc(1, sizeof(TriggerJob));
+    if (!job) return;
+    job->app = app;
+    job->trig_cnt0 = tr->fire_cnt0;
+    snprintf(job->cond, sizeof(job->cond), "%s", tr->fired);
+    snprintf(job->dir, sizeof(job->dir), "%s", tr->dir);
+
+    // Newest `post` (or more) slots follow the trigger frame; take up to `pre` before it.
+    // The frames come from the track of the watched (primary) stream.
+    size_t cap = app->img_history_capacity;
+    size_t count = app->img_history_count;
+    int track = 0;
+    size_t fs = cap ? img_history_track_size(app, track) : 0;
+    uint64_t after = app->img_history_total - tr->fire_total;
+    if (fs > 0 && fs == (size_t)tr->fire_width * tr->fire_height * ImageStreamIO_typesize(tr->fire_datatype) &&
+        after < count) {
+        size_t before = count - 1 - after;
+        if (before > (size_t)tr->pre) before = tr->pre;
+        int n = (int)(before + 1 + after);
+        job->slots = (size_t*)malloc(n * sizeof(size_t));
+        job->max_back = (size_t*)malloc(n * sizeof(size_t));
+        if (job->slots && job->max_back) {
+            size_t oldest = (app->img_history_head + cap - count) % cap;
+            for (int i = 0; i < n; ++i) {
+                size_t age = count - n + i; // Position from the oldest slot
+                job->slots[i] = (oldest + age) % cap;
+                job->max_back[i] = age;
+            }
+            // Records allowed before the oldest slot we read (or its keyframe) is reused
+            size_t a0 = count - n;
+            if (app->hist_codec) a0 -= (a0 < HIST_KEY_INTERVAL - 1) ? a0 : HIST_KEY_INTERVAL - 1;
+            job->budget = a0 + cap - count;
+            job->total0 = app->img_history_total;
+            job->nframes = n;
+            job->trig_index = (int)before;
+            job->track = track;
+            job->frame_size = fs;
+            job->width = tr->fire_width;
+            job->height = tr->fire_height;
+            job->datatype = tr->fire_datatype;
+        }
+    }
+
+    // Trace samples covering the same frames (or the pre/post window by cnt0)
+    uint64_t c_first = job->nframes ? img_history_slot_cnt0(app, track, job->slots[0]) : (tr->fire_cnt0 > (uint64_t)tr->pre ? tr->fire_cnt0 - tr->pre : 0);
+    uint64_t c_last = job->nframes ? img_history_slot_cnt0(app, track, job->slots[job->nframes - 1]) : app->current_cnt0;
+    if (app->trace_active && !app->trace_view && !app->trace_frozen && app->trace_count > 0) {
+        uint64_t a_end = app->trace_total, a = a_end;
+        uint64_t a_min = app->trace_total - app->trace_count;
+        while (a > a_min && TRACE_AT(app, cnt0, (int)((a - 1) % trace_ring_len)) >= c_first) a--;
+        int n = (int)(a_end - a);
+        job->trace_rows = n ? (double*)malloc((size_t)n * TRIGGER_TRACE_COLS * sizeof(double)) : NULL;
+        for (uint64_t s = a; job->trace_rows && s < a_end; ++s) {
+            int idx = (int)(s % trace_ring_len);
+            if (TRACE_AT(app, cnt0, idx) > c_last) continue;
+            double *r = job->trace_rows + job->ntrace++ * TRIGGER_TRACE_COLS;
+            r[0] = TRACE_AT(app, time, idx);
+            r[1] = (double)TRACE_AT(app, cnt0, idx);
+            r[2] = TRACE_AT(app, min, idx);
+            r[3] = TRACE_AT(app, max, idx);
+            r[4] = TRACE_AT(app, mean, idx);
+            r[5] = TRACE_AT(app, median, idx);
+            r[6] = TRACE_AT(app, p01, idx);
+            r[7] = TRACE_AT(app, p09, idx);
+        }
+    }
+
+    tr->job = job;
+    job->thread = g_thread_new("trigger-dump", trigger_dump_worker, job);
+}
+
+// Stats vector of a region: min, max, mean, sum and npix in one pass; the
+// percentiles from a histogram over [min, max] only when a condition reads them
+static void
+trigger_region_stats(const HistRegion *r, uint32_t *hist, gboolean percentiles, double *row) {
+    double sum = 0, vmin = INFINITY, vmax = -INFINITY;
+    #define TRIGGER_SCAN(type) \
+        for (int y = r->y1; y < r->y2; ++y) { \
+            const type *ptr = (const type*)r->data + (size_t)y * r->width; \
+            for (int x = r->x1; x < r->x2; ++x) { \
+                double v = (double)ptr[x]; \
+                sum += v; \
+                if (v < vmin) vmin = v; \
+                if (v > vmax) vmax = v; \
+            } \
+        } \
+        break;
+
+    switch (r->datatype) {
+        case _DATATYPE_FLOAT: TRIGGER_SCAN(float)
+        case _DATATYPE_DOUBLE: TRIGGER_SCAN(double)
+        case _DATATYPE_UINT8: TRIGGER_SCAN(uint8_t)
+        case _DATATYPE_INT16: TRIGGER_SCAN(int16_t)
+        case _DATATYPE_UINT16: TRIGGER_SCAN(uint16_t)
+        case _DATATYPE_INT32: TRIGGER_SCAN(int32_t)
+        case _DATATYPE_UINT32: TRIGGER_SCAN(uint32_t)
+        default: break;
+    }
+    #undef TRIGGER_SCAN
+
+    size_t n = (vmin <= vmax) ? hist_region_count(r) : 0;
+    double p[3] = { NAN, NAN, NAN }; // p10, median, p90
+    if (percentiles && n > 0) {
+        static const double q[3] = { 0.1, 0.5, 0.9 };
+        compute_histogram(r, vmin, vmax, HIST_CACHE_FINE_BINS, hist, NULL);
+        double range = vmax - vmin, cum = 0;
+        int k = 0;
+        for (int i = 0; i < HIST_CACHE_FINE_BINS && k < 3; ++i) {
+            cum += hist[i];
+            while (k < 3 && cum >= n * q[k]) p[k++] = vmin + (double)i / HIST_CACHE_FINE_BINS * range;
+        }
+    }
+    stats_row_fill(row, n ? vmin : NAN, n ? vmax : NAN, n ? sum / n : NAN, p[1], p[0], p[2], sum, n);
+}
+
+// Evaluate every condition on one frame (watcher thread)
+static void
+trigger_process_frame(Trigger *tr, void *data, uint8_t datatype, int width, int height, uint64_t cnt0) {
+    int region[TRIGGER_MAX_CONDS][4];
+    g_mutex_lock(&tr->lock);
+    memcpy(region, tr->region, sizeof(region));
+    g_mutex_unlock(&tr->lock);
+
+    double rows[TRIGGER_MAX_CONDS][STATS_VEC_LEN];
+    const char *fired = NULL;
+    tr->frames++;
+
+    for (int i = 0; i < tr->ncond; ++i) {
+        TriggerCond *c = &tr->cond[i];
+        int *rc = region[i];
+        HistRegion r = { NULL, cnt0, data, datatype, width, MAX(rc[0], 0), MAX(rc[1], 0),
+                         MIN(rc[2], width), MIN(rc[3], height) };
+        if (hist_region_count(&r) == 0) continue;
+
+        // Conditions on the same region share one pass
+        int same = -1;
+        for (int j = 0; j < i && same < 0; ++j)
+            if (memcmp(region[j], rc, sizeof(region[j])) == 0) same = j;
+        gboolean pct = FALSE;
+        for (int j = i; j < tr->ncond; ++j)
+            if (memcmp(region[j], rc, sizeof(region[j])) == 0 && tr->cond[j].stat >= 3 && tr->cond[j].stat <= 5) pct = TRUE;
+        if (same >= 0) memcpy(rows[i], rows[same], sizeof(rows[i]));
+        else trigger_region_stats(&r, tr->hist, pct, rows[i]);
+
+        double x = rows[i][c->stat];
+        if (isnan(x)) continue;
+
+        gboolean hit;
+        if (c->op == '>') hit = x > c->value;
+        else if (c->op == '<') hit = x < c->value;
+        else {
+            hit = c->nseen >= TRIGGER_WARMUP && fabs(x - c->mean) > c->value * sqrt(c->var);
+            // Exponential baseline; jumps are folded in too so a new level becomes the norm
+            double a = 1.0 / TRIGGER_BASELINE;
+            double d = x - c->mean;
+            if (c->nseen++ == 0) c->mean = x;
+            else {
+                c->mean += a * d;
+                c->var = (1.0 - a) * (c->var + a * d * d);
+            }
+        }
+        if (hit && !fired) fired = c->text;
+    }
+
+    if (!fired) return;
+    g_mutex_lock(&tr->lock);
+    if (!tr->pending) {
+        tr->pending = TRUE;
+        tr->fire_new = TRUE;
+        tr->fire_cnt0 = cnt0;
+        tr->fire_width = width;
+        tr->fire_height = height;
+        tr->fire_datatype = datatype;
+        snprintf(tr->fired, sizeof(tr->fired), "%s", fired);
+    }
+    g_mutex_unlock(&tr->lock);
+}
+
+// Frames of the played file up to the one it reached, read from the mapping
+static void
+trigger_watch_player(Trigger *tr) {
+    FilePlayer *p = (FilePlayer *)tr->player;
+    uint64_t target = __atomic_load_n(&tr->play_pos, __ATOMIC_ACQUIRE);
+    if (target == tr->play_done) {
+        g_usleep(1000);
+        return;
+    }
+    // A jump back (loop) or far ahead (seek) restarts at the frame shown
+    uint64_t i = tr->play_done + 1;
+    if (tr->play_done == (uint64_t)-1 || target < i || target - i >= TRIGGER_PLAY_GAP) i = target;
+    for (; i <= target && g_atomic_int_get(&tr->running); ++i) {
+        const uint8_t *src = p->map + p->data_off + i * p->frame_size;
+        void *data = (void*)src;
+        if (p->fits) {
+            fits_decode(tr->frame, src, p->md.datatype, p->md.nelement);
+            data = tr->frame;
+        }
+        trigger_process_frame(tr, data, p->md.datatype, p->md.size[0], p->md.size[1],
+                              p->cnt0_first + i * p->cnt0_step);
+    }
+    tr->play_done = target;
+}
+
+// Same wait/catch-up scheme as rec_capture
+static gpointer
+trigger_watch(gpointer data) {
+    Trigger *tr = (Trigger *)data;
+    IMAGE *src = &tr->source;
+    int semindex = -1;
+    if (!tr->player) {
+        semindex = (src->md->sem > 0) ? ImageStreamIO_getsemwaitindex(src, 0) : -1;
+        if (semindex >= 0) ImageStreamIO_semflush(src, semindex);
+    }
+    gboolean retry = FALSE;
+
+    while (g_atomic_int_get(&tr->running)) {
+        if (tr->player) {
+            trigger_watch_player(tr);
+            continue;
+        }
+        if (retry) {
+            g_usleep(20);
+        } else if (semindex >= 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += TRIGGER_SEM_TIMEOUT_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            ImageStreamIO_semtimedwait(src, semindex, &deadline);
+        } else {
+            g_usleep(200);
+        }
+
+        uint64_t cnt0 = src->md->cnt0;
+        retry = (cnt0 != tr->last_cnt0 && src->md->write);
+        if (cnt0 == tr->last_cnt0 || retry) continue;
+
+        int width = src->md->size[0], height = src->md->size[1];
+        uint8_t datatype = src->md->datatype;
+        size_t frame_size = (size_t)width * height * ImageStreamIO_typesize(datatype);
+        uint64_t missed = cnt0 > tr->last_cnt0 ? cnt0 - tr->last_cnt0 : 1;
+        uint64_t nread = 1;
+        if ((src->md->imagetype & CIRCULAR_BUFFER) && src->md->naxis == 3) {
+            // The slice after the newest one may already be under write
+            uint64_t nslices = src->md->size[2];
+            uint64_t cnt1 = src->md->cnt1;
+            nread = missed;
+            if (nread > nslices - 1) nread = (nslices > 1) ? nslices - 1 : 1;
+            if (nread > cnt0) nread = cnt0 ? cnt0 : 1;
+            for (uint64_t j = nread; j-- > 0;) {
+                uint64_t slice = (cnt1 + nslices - (j % nslices)) % nslices;
+                trigger_process_frame(tr, (uint8_t*)src->array.raw + slice * frame_size, datatype, width, height, cnt0 - j);
+            }
+        } else {
+            trigger_process_frame(tr, src->array.raw, datatype, width, height, cnt0);
+        }
+        if (tr->last_cnt0 && missed > nread) tr->missed += missed - nread;
+        tr->last_cnt0 = cnt0;
+    }
+    return NULL;
+}
+
+static void
+trigger_watch_stop(Trigger *tr) {
+    if (!tr || !tr->stream[0]) return;
+    g_atomic_int_set(&tr->running, 0);
+    if (tr->thread) g_thread_join(tr->thread);
+    tr->thread = NULL;
+    if (tr->frames) {
+        printf("Trigger watched %lu frames of %s, missed %lu\n", (unsigned long)tr->frames, tr->stream,
+               (unsigned long)tr->missed);
+    }
+    if (!tr->player && tr->source.md) ImageStreamIO_closeIm(&tr->source);
+    memset(&tr->source, 0, sizeof(tr->source));
+    tr->player = NULL;
+    free(tr->frame);
+    tr->frame = NULL;
+    tr->stream[0] = '\0';
+}
+
+// Watch the primary stream (or played file) under name; FALSE if it cannot be opened
+static gboolean
+trigger_watch_start(ViewerApp *app, const char *name) {
+    Trigger *tr = app->trigger;
+    FilePlayer *p = app->player;
+    if (p) {
+        if (p->fits && !(tr->frame = (uint8_t*)malloc(p->frame_size))) return FALSE;
+        tr->player = p;
+        tr->play_done = (uint64_t)-1;
+        __atomic_store_n(&tr->play_pos, p->pos, __ATOMIC_RELEASE);
+    } else if (ImageStreamIO_openIm(&tr->source, name) != IMAGESTREAMIO_SUCCESS) {
+        memset(&tr->source, 0, sizeof(tr->source));
+        return FALSE;
+    } else {
+        tr->last_cnt0 = tr->source.md->cnt0;
+    }
+    snprintf(tr->stream, sizeof(tr->stream), "%s", name);
+    tr->frames = tr->missed = 0;
+    g_atomic_int_set(&tr->running, 1);
+    tr->thread = g_thread_new("trigger-watch", trigger_watch, tr);
+    return TRUE;
+}
+
+// Once per display tick: follow the primary stream, pass the condition
+// regions to the watcher, and take up events
+static void
+trigger_poll(ViewerApp *app) {
+    Trigger *tr = app->trigger;
+
+    // Primary stream name (the live fields belong to the active stream)
+    const char *name = app->player ? ((FilePlayer *)app->player)->name
+                     : (app->active_stream == 0 ? app->image_name : app->streams[0].image_name);
+    if (tr->stream[0] && (!name || strcmp(name, tr->stream) != 0 || tr->player != app->player)) trigger_watch_stop(tr);
+    if (!tr->stream[0] && name && app->image) trigger_watch_start(app, name);
+    if (tr->player) __atomic_store_n(&tr->play_pos, ((FilePlayer *)tr->player)->pos, __ATOMIC_RELEASE);
+
+    g_mutex_lock(&tr->lock);
+    for (int i = 0; i < tr->ncond; ++i) {
+        int *rc = tr->region[i];
+        rc[0] = rc[1] = rc[2] = rc[3] = 0;
+        if (strcmp(tr->cond[i].source, "sel") == 0) {
+            if (app->selection_active) {
+                rc[0] = app->sel_x1;
+                rc[1] = app->sel_y1;
+                rc[2] = app->sel_x2 + 1;
+                rc[3] = app->sel_y2 + 1;
+            } else {
+                rc[2] = rc[3] = G_MAXINT; // Clipped to the frame by the watcher
+            }
+            continue;
+        }
+        for (int k = 0; k < app->roi_set.nrois; ++k) {
+            const Roi *r = &app->roi_set.rois[k];
+            if (strcmp(r->name, tr->cond[i].source) != 0) continue;
+            rc[0] = r->x1;
+            rc[1] = r->y1;
+            rc[2] = r->x2;
+            rc[3] = r->y2;
+        }
+    }
+
+    gboolean fire_new = tr->fire_new;
+    uint64_t fire_cnt0 = tr->fire_cnt0;
+    tr->fire_new = FALSE;
+    // Frozen history (paused or replaying) cannot hold the frames after the event
+    if (fire_new && (app->paused || app->hreplay.active)) {
+        printf("Trigger %s at cnt0 %lu skipped: display paused\n", tr->fired, (unsigned long)fire_cnt0);
+        tr->pending = fire_new = FALSE;
+    }
+    g_mutex_unlock(&tr->lock);
+
+    if (fire_new) {
+        // History records made at or before the event frame
+        size_t cap = app->img_history_capacity, newer = 0;
+        while (newer < app->img_history_count) {
+            size_t slot = (app->img_history_head + cap - 1 - newer) % cap;
+            if (img_history_slot_cnt0(app, 0, slot) <= fire_cnt0) break;
+            newer++;
+        }
+        tr->fire_total = app->img_history_total - newer;
+    } else if (!tr->pending) {
+        return;
+    }
+
+    // pending is only cleared here, so reading it unlocked is safe
+    if (app->img_history_total - tr->fire_total >= (uint64_t)tr->post) {
+        trigger_schedule(app);
+        g_mutex_lock(&tr->lock);
+        tr->pending = FALSE;
+        g_mutex_unlock(&tr->lock);
+    }
+}
+
+// Stop the watcher and any dump; a finished dump's pending idle handoff is
+// dropped with it
+static void
+trigger_free(ViewerApp *app) {
+    Trigger *tr = app->trigger;
+    if (!tr) return;
+    trigger_watch_stop(tr);
+    if (tr->job) {
+        trigger_dump_cancel(app);
+        g_idle_remove_by_data(tr->job);
+        trigger_job_free(tr->job);
+    }
+    g_mutex_clear(&tr->lock);
+    free(tr);
+    app->trigger = NULL;
+}
+
+// Memory Budget
+// --mem-budget caps the large allocations. The trace ring length is fixed at
+// startup from its share, and so is the room kept for the recorder queue. The
+// history depth gets what is left after those, the frame work buffers and the
+// caches, and is recomputed whenever a recorded frame size changes; -H then
+// only caps it. A file-backed history ring lives in the page cache and is not
+// charged.
+
+enum { MEM_FRAMES, MEM_HISTORY, MEM_TRACE, MEM_CACHES, MEM_RECORDER, MEM_NUM };
+static const char *mem_names[MEM_NUM] = { "Frames", "History", "Trace", "Caches", "Recorder" };
+
+static inline size_t
+mem_budget_bytes(void) {
+    return (size_t)opt_mem_budget << 20;
+}
+
+static inline size_t
+mem_trace_limit(void) {
+    return (size_t)((trace_ring_len + TRACE_CHUNK_SAMPLES - 1) / TRACE_CHUNK_SAMPLES) * sizeof(TraceChunk);
+}
+
+// Per-slot bookkeeping: cnt0, pair cnt0, source, time, two index entries, and
+// the compressed slot tables of both tracks
+static inline size_t
+mem_history_slot_overhead(const ViewerApp *app) {
+    size_t n = 2 * sizeof(uint64_t) + 1 + sizeof(double) + 2 * sizeof(int32_t);
+    if (app->hist_codec) n += HIST_TRACKS * (sizeof(uint8_t*) + sizeof(uint32_t) + 2);
+    return n;
+}
+
+// Codec work buffers for tracks of the given sizes: encoder queue, planes,
+// output, LZ stage scratch, and the previous, last decoded and re-keyed frame
+// per track
+static inline size_t
+mem_codec_buffers(size_t max_frame, size_t frame_total) {
+    return (HIST_QUEUE_LEN + 2) * max_frame + hc_frame_bound(max_frame) + 2 * hc_bound(max_frame) +
+           3 * frame_total;
+}
+
+static void
+mem_usage(ViewerApp *app, size_t *bytes) {
+    memset(bytes, 0, MEM_NUM * sizeof(size_t));
+
+    bytes[MEM_FRAMES] = app->display_buffer_size + app->raw_buffer_size + app->raw_buffer_sec_size +
+                        app->history_buffer_size + app->history_buffer_sec_size;
+    for (int s = 0; s < 2; ++s) {
+        TemporalStats *ts = app->streams[s].tstat;
+        if (ts) bytes[MEM_FRAMES] += ts->npix * (ts->sum ? sizeof(double) : 5 * sizeof(float));
+    }
+
+    if (app->img_history_capacity > 0) {
+        bytes[MEM_HISTORY] = app->img_history_capacity * mem_history_slot_overhead(app);
+        HistCodec *hc = app->hist_codec;
+        if (hc) {
+            g_mutex_lock(&hc->lock);
+            bytes[MEM_HISTORY] += hc->stored_bytes;
+            if (hc->max_frame) bytes[MEM_HISTORY] += mem_codec_buffers(hc->max_frame, hc->frame_size[0] + hc->frame_size[1]);
+            g_mutex_unlock(&hc->lock);
+        } else if (app->img_history_fd < 0) {
+            bytes[MEM_HISTORY] += app->img_history_map_len;
+        }
+    }
+
+    if (!app->trace_view) bytes[MEM_TRACE] = app->trace_bytes;
+
+    for (int i = 0; i < HIST_CACHE_SIZE; ++i)
+        bytes[MEM_CACHES] += (size_t)app->hist_cache.entries[i].hist_capacity * sizeof(uint32_t);
+    if (app->psd.fft.n) bytes[MEM_CACHES] += (size_t)PSD_MAX_SEGMENTS * (app->psd.fft.n / 2 + 1) * sizeof(float);
+    if (app->hreplay.thread) {
+        g_mutex_lock(&app->hreplay.lock);
+        for (int i = 0; i < HREPLAY_FRAMES; ++i) bytes[MEM_CACHES] += app->hreplay.frames[i].capacity;
+        g_mutex_unlock(&app->hreplay.lock);
+    }
+
+    Recorder *rec = app->recorder;
+    if (rec) bytes[MEM_RECORDER] = (size_t)rec->qlen * (rec->frame_size + sizeof(uint64_t)) + REC_WRITE_BYTES;
+}
+
+// Startup: trace ring length from its share of the budget
+static void
+mem_budget_init(void) {
+    if (opt_mem_budget <= 0) return;
+    size_t chunks = mem_budget_bytes() / MEM_TRACE_SHARE / sizeof(TraceChunk);
+    if (chunks < 1) chunks = 1;
+    if (chunks < TRACE_NUM_CHUNKS) trace_ring_len = (int)chunks * TRACE_CHUNK_SAMPLES;
+    printf("Memory budget %d MB: trace %d samples (%zu MB), recorder queue %zu MB\n", opt_mem_budget,
+           trace_ring_len, mem_trace_limit() >> 20, (mem_budget_bytes() / MEM_RECORDER_SHARE) >> 20);
+}
+
+// History slots for tracks of the given sizes: what the budget leaves after
+// the trace and recorder shares, the work buffers and the caches. 0 without a
+// budget (keep -H).
+static size_t
+mem_history_slots(ViewerApp *app, const size_t *sizes, const int *esizes) {
+    if (opt_mem_budget <= 0) return 0;
+    size_t bytes[MEM_NUM];
+    mem_usage(app, bytes);
+
+    // Work buffers may not be sized for the new geometry yet: a raw and a
+    // history copy per track, and the RGB display
+    size_t frame_total = sizes[0] + sizes[1], max_frame = sizes[0] > sizes[1] ? sizes[0] : sizes[1];
+    size_t npix = sizes[0] / esizes[0] > sizes[1] / esizes[1] ? sizes[0] / esizes[0] : sizes[1] / esizes[1];
+    size_t frames = 2 * frame_total + 4 * npix;
+    if (bytes[MEM_FRAMES] > frames) frames = bytes[MEM_FRAMES];
+
+    // Replay prefetch buffers are only filled later, so keep room for them
+    size_t reserved = frames + mem_trace_limit() + bytes[MEM_CACHES] + mem_budget_bytes() / MEM_RECORDER_SHARE +
+                      (HREPLAY_AHEAD + 1) * frame_total;
+    size_t slot = mem_history_slot_overhead(app);
+    if (app->hist_codec) reserved += mem_codec_buffers(max_frame, frame_total);
+    // Compressed slots are charged at full size, so the cap holds for any data
+    if (app->hist_codec || app->img_history_fd < 0) slot += frame_total;
+
+    size_t n = mem_budget_bytes() > reserved ? (mem_budget_bytes() - reserved) / slot : 0;
+    if (opt_history > 0 && n > (size_t)opt_history) n = opt_history;
+    if (n < 1) {
+        fprintf(stderr, "Memory budget of %d MB leaves no room for history at this frame size\n", opt_mem_budget);
+        n = 1;
+    }
+    return n;
+}
+
+// Resize the slot arrays (and the compressed store); contents are dropped
+static gboolean
+img_history_set_capacity(ViewerApp *app, size_t capacity) {
+    hreplay_invalidate(app);
+    img_history_free_data(app);
+    free(app->img_history_cnt0);
+    free(app->img_history_pair_cnt0);
+    free(app->img_history_src);
+    free(app->img_history_time);
+    free(app->img_history_index);
+    app->img_history_cnt0 = app->img_history_pair_cnt0 = NULL;
+    app->img_history_src = NULL;
+    app->img_history_time = NULL;
+    app->img_history_index = NULL;
+    if (app->hist_codec) {
+        hist_codec_free(app->hist_codec);
+        app->hist_codec = hist_codec_new(capacity);
+    }
+    if (img_history_init(app, capacity) && (!opt_history_compress || app->hist_codec)) return TRUE;
+
+    fprintf(stderr, "Cannot allocate a %zu frame history\n", capacity);
+    return FALSE;
+}
+
+// Recorder queue depth within its share of the budget
+static int
+mem_recorder_queue(size_t frame_size, int queue_frames) {
+    if (opt_mem_budget <= 0 || frame_size == 0) return queue_frames;
+    size_t share = mem_budget_bytes() / MEM_RECORDER_SHARE;
+    size_t n = share > REC_WRITE_BYTES ? (share - REC_WRITE_BYTES) / (frame_size + sizeof(uint64_t)) : 0;
+    if (n < 2) n = 2;
+    return (size_t)queue_frames > n ? (int)n : queue_frames;
+}
+
+// Per-subsystem usage, refreshed about once a second
+static void
+update_mem_label(ViewerApp *app) {
+    if (!app->lbl_mem) return;
+    size_t bytes[MEM_NUM], total = 0;
+    mem_usage(app, bytes);
+    char buf[64], tip[512];
+    int len = 0;
+    for (int i = 0; i < MEM_NUM; ++i) {
+        total += bytes[i];
+        len += snprintf(tip + len, sizeof(tip) - len, "%s%s: %.1f MB", i ? "\n" : "", mem_names[i], bytes[i] / (1024.0 * 1024.0));
+    }
+    if (app->img_history_capacity > 0)
+        len += snprintf(tip + len, sizeof(tip) - len, "\nHistory depth: %zu frames", app->img_history_capacity);
+    snprintf(tip + len, sizeof(tip) - len, "\nTrace length: %d samples", trace_ring_len);
+
+    if (opt_mem_budget > 0) snprintf(buf, sizeof(buf), "Mem %.0f / %d MB", total / (1024.0 * 1024.0), opt_mem_budget);
+    else snprintf(buf, sizeof(buf), "Mem %.0f MB", total / (1024.0 * 1024.0));
+    gtk_label_set_text(GTK_LABEL(app->lbl_mem), buf);
+    gtk_widget_set_tooltip_text(app->lbl_mem, tip);
+}
+
+// Frame Recorder
+// The writer fills REC_WRITE_BYTES staging blocks with the FITS stream (header
+// block, then big-endian frames) and writes each one with a single call at an
+// aligned offset, so the file can be opened O_DIRECT and bypass the page cache.
+// The header is rewritten with the final frame count when a file is closed.
+
+static void
+rec_header(Recorder *rec, FitsHeader *h) {
+    char val[72];
+    fits_header_init(h, rec->datatype, rec->width, rec->height, rec->file_frames);
+    snprintf(val, sizeof(val), "'%.60s'", rec->stream);
+    fits_header_card(h, "STREAM", val, NULL);
+    snprintf(val, sizeof(val), "%lu", (unsigned long)rec->file_first_cnt0);
+    fits_header_card(h, "CNT0FRST", val, "cnt0 of the first frame");
+    snprintf(val, sizeof(val), "%lu", (unsigned long)rec->file_last_cnt0);
+    fits_header_card(h, "CNT0LAST", val, "cnt0 of the last frame");
+    snprintf(val, sizeof(val), "%d", rec->every);
+    fits_header_card(h, "RECEVERY", val, "Frames with cnt0 % RECEVERY == 0 are kept");
+    snprintf(val, sizeof(val), "%lu", (unsigned long)rec->file_drops);
+    fits_header_card(h, "NDROP", val, "Frames missing between CNT0FRST and CNT0LAST");
+    fits_header_end(h);
+}
+
+static void
+rec_fail(Recorder *rec, const char *what) {
+    int err = errno;
+    g_mutex_lock(&rec->lock);
+    if (!rec->error[0]) {
+        snprintf(rec->error, sizeof(rec->error), "%s: %s", what, strerror(err));
+        fprintf(stderr, "Recorder: %s (%s)\n", rec->error, rec->file);
+    }
+    g_mutex_unlock(&rec->lock);
+}
+
+// Write len bytes of the staging buffer at the current file offset
+static gboolean
+rec_flush(Recorder *rec, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(rec->fd, rec->wbuf + done, len - done, rec->file_off + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+#ifdef O_DIRECT
+        if (n < 0 && errno == EINVAL && rec->direct) {
+            // Filesystem accepted the flag at open but not the I/O
+            fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+            rec->direct = FALSE;
+            continue;
+        }
+#endif
+        if (n <= 0) {
+            rec_fail(rec, "write");
+            return FALSE;
+        }
+        done += (size_t)n;
+    }
+    // Buffered fallback: drop the previous block, whose writeback has had time to finish
+    if (!rec->direct && rec->file_off >= (off_t)REC_WRITE_BYTES)
+        posix_fadvise(rec->fd, rec->file_off - (off_t)REC_WRITE_BYTES, REC_WRITE_BYTES, POSIX_FADV_DONTNEED);
+    rec->file_off += (off_t)len;
+    rec->wfill = 0;
+    return TRUE;
+}
+
+static gboolean
+rec_file_open(Recorder *rec) {
+    char path[sizeof(rec->file)];
+    snprintf(path, sizeof(path), "%s/%s_%s_%03d.fits", rec->dir, rec->stream, rec->stamp, rec->file_index++);
+    g_mutex_lock(&rec->lock);
+    snprintf(rec->file, sizeof(rec->file), "%s", path);
+    g_mutex_unlock(&rec->lock);
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    rec->direct = FALSE;
+#ifdef O_DIRECT
+    rec->fd = open(path, flags | O_DIRECT, 0644);
+    rec->direct = rec->fd >= 0;
+    if (rec->fd < 0 && errno == EINVAL)
+#endif
+    rec->fd = open(path, flags, 0644);
+    if (rec->fd < 0) {
+        rec_fail(rec, "open");
+        return FALSE;
+    }
+#ifdef __linux__
+    // Reserve the whole file up front for contiguous extents; truncated on close
+    fallocate(rec->fd, 0, 0, (off_t)rec->max_bytes);
+#endif
+
+    rec->file_off = 0;
+    rec->file_frames = 0;
+    rec->file_drops = 0;
+    FitsHeader h;
+    rec_header(rec, &h);
+    memcpy(rec->wbuf, h.block, FITS_BLOCK);
+    rec->wfill = FITS_BLOCK;
+    return TRUE;
+}
+
+// Pad the data to a FITS block, write the tail and the final header
+static gboolean
+rec_file_close(Recorder *rec) {
+    uint64_t end = FITS_BLOCK + rec->file_frames * rec->frame_size;
+    size_t pad = (FITS_BLOCK - end % FITS_BLOCK) % FITS_BLOCK;
+    gboolean ok = TRUE;
+    while (ok && pad > 0) {
+        size_t n = REC_WRITE_BYTES - rec->wfill;
+        if (n > pad) n = pad;
+        memset(rec->wbuf + rec->wfill, 0, n);
+        rec->wfill += n;
+        pad -= n;
+        if (rec->wfill == REC_WRITE_BYTES) ok = rec_flush(rec, REC_WRITE_BYTES);
+    }
+    if (ok && rec->wfill > 0) {
+        size_t len = rec->wfill;
+        if (rec->direct) {
+            // O_DIRECT needs a whole aligned length; the excess is truncated below
+            len = (len + REC_ALIGN - 1) / REC_ALIGN * REC_ALIGN;
+            memset(rec->wbuf + rec->wfill, 0, len - rec->wfill);
+        }
+        ok = rec_flush(rec, len);
+    }
+
+#ifdef O_DIRECT
+    if (rec->direct) fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+#endif
+    rec->direct = FALSE;
+    if (ok && ftruncate(rec->fd, (off_t)(end + (FITS_BLOCK - end % FITS_BLOCK) % FITS_BLOCK)) != 0) {
+        rec_fail(rec, "truncate");
+        ok = FALSE;
+    }
+    if (ok) {
+        FitsHeader h;
+        rec_header(rec, &h);
+        if (pwrite(rec->fd, h.block, FITS_BLOCK, 0) != FITS_BLOCK) {
+            rec_fail(rec, "write header");
+            ok = FALSE;
+        }
+    }
+    if (close(rec->fd) != 0 && ok) {
+        rec_fail(rec, "close");
+        ok = FALSE;
+    }
+    rec->fd = -1;
+    g_mutex_lock(&rec->lock);
+    rec->files++;
+    g_mutex_unlock(&rec->lock);
+    return ok;
+}
+
+static gboolean
+rec_write_frame(Recorder *rec, const uint8_t *frame, uint64_t cnt0) {
+    if (rec->fd >= 0 && FITS_BLOCK + (rec->file_frames + 1) * rec->frame_size > rec->max_bytes) {
+        if (!rec_file_close(rec)) return FALSE;
+    }
+    if (rec->fd < 0 && !rec_file_open(rec)) return FALSE;
+
+    if (rec->file_frames == 0) rec->file_first_cnt0 = cnt0;
+    else if (cnt0 > rec->file_last_cnt0) rec->file_drops += (cnt0 - rec->file_last_cnt0) / rec->every - 1;
+    rec->file_last_cnt0 = cnt0;
+
+    // Staging block and header sizes are multiples of 8 bytes, so elements never straddle blocks
+    size_t left = rec->frame_size / rec->esize;
+    while (left > 0) {
+        size_t n = (REC_WRITE_BYTES - rec->wfill) / rec->esize;
+        if (n > left) n = left;
+        fits_encode(rec->wbuf + rec->wfill, frame, rec->datatype, n);
+        rec->wfill += n * rec->esize;
+        frame += n * rec->esize;
+        left -= n;
+        if (rec->wfill == REC_WRITE_BYTES && !rec_flush(rec, REC_WRITE_BYTES)) return FALSE;
+    }
+    rec->file_frames++;
+    return TRUE;
+}
+
+static gpointer
+rec_writer(gpointer data) {
+    Recorder *rec = (Recorder *)data;
+    gboolean failed = FALSE;
+
+    for (;;) {
+        g_mutex_lock(&rec->lock);
+        while (rec->tail == rec->head && !rec->stopping) g_cond_wait(&rec->cond, &rec->lock);
+        if (rec->tail == rec->head) {
+            g_mutex_unlock(&rec->lock);
+            break;
+        }
+        size_t slot = rec->tail % rec->qlen;
+        g_mutex_unlock(&rec->lock);
+
+        // After an error the queue keeps draining so capture never blocks
+        if (!failed) failed = !rec_write_frame(rec, rec->queue + slot * rec->frame_size, rec->queue_cnt0[slot]);
+
+        g_mutex_lock(&rec->lock);
+        rec->tail++;
+        if (failed) rec->drop_error++;
+        else rec->written++;
+        g_mutex_unlock(&rec->lock);
+    }
+
+    if (rec->fd >= 0) rec_file_close(rec);
+    return NULL;
+}
+
+// Queue one frame; never waits for the writer
+static void
+rec_push(Recorder *rec, const void *frame, uint64_t cnt0) {
+    if (cnt0 % rec->every != 0) return;
+
+    g_mutex_lock(&rec->lock);
+    gboolean full = rec->head - rec->tail == (uint64_t)rec->qlen;
+    if (full) rec->drop_queue++;
+    g_mutex_unlock(&rec->lock);
+    if (full) return;
+
+    size_t slot = rec->head % rec->qlen;
+    memcpy(rec->queue + slot * rec->frame_size, frame, rec->frame_size);
+    rec->queue_cnt0[slot] = cnt0;
+
+    g_mutex_lock(&rec->lock);
+    rec->head++;
+    g_cond_signal(&rec->cond);
+    g_mutex_unlock(&rec->lock);
+}
+
+// Same wait/catch-up scheme as tstat_worker
+static gpointer
+rec_capture(gpointer data) {
+    Recorder *rec = (Recorder *)data;
+    IMAGE *src = &rec->source;
+    int semindex = (src->md->sem > 0) ? ImageStreamIO_getsemwaitindex(src, 0) : -1;
+    if (semindex >= 0) ImageStreamIO_semflush(src, semindex);
+    gboolean retry = FALSE;
+
+    while (g_atomic_int_get(&rec->capturing)) {
+        if (retry) {
+            g_usleep(20);
+        } else if (semindex >= 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += REC_SEM_TIMEOUT_NS;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            ImageStreamIO_semtimedwait(src, semindex, &deadline);
+        } else {
+            g_usleep(200);
+        }
+
+        uint64_t cnt0 = src->md->cnt0;
+        retry = (cnt0 != rec->last_cnt0 && src->md->write);
+        if (cnt0 == rec->last_cnt0 || retry) continue;
+
+        // A recreated stream restarts its counter
+        uint64_t missed = cnt0 > rec->last_cnt0 ? cnt0 - rec->last_cnt0 : 1;
+        uint64_t nread = 1;
+        if ((src->md->imagetype & CIRCULAR_BUFFER) && src->md->naxis == 3) {
+            // The slice after the newest one may already be under write
+            uint64_t nslices = src->md->size[2];
+            uint64_t cnt1 = src->md->cnt1;
+            nread = missed;
+            if (nread > nslices - 1) nread = (nslices > 1) ? nslices - 1 : 1;
+            if (nread > cnt0) nread = cnt0 ? cnt0 : 1;
+            for (uint64_t j = nread; j-- > 0;) {
+                uint64_t slice = (cnt1 + nslices - (j % nslices)) % nslices;
+                rec_push(rec, (const uint8_t*)src->array.raw + slice * rec->frame_size, cnt0 - j);
+            }
+        } else {
+            rec_push(rec, src->array.raw, cnt0);
+        }
+
+        // Frames we wanted but that were overwritten before we got to them
+        uint64_t lost_to = cnt0 - nread;
+        if (lost_to > rec->last_cnt0) {
+            g_mutex_lock(&rec->lock);
+            rec->drop_source += lost_to / rec->every - rec->last_cnt0 / rec->every;
+            g_mutex_unlock(&rec->lock);
+        }
+        rec->last_cnt0 = cnt0;
+    }
+    return NULL;
+}
+
+static void
+recorder_stop(Recorder *rec) {
+    if (!rec) return;
+
+    // Stop queueing, then let the writer drain what is already queued
+    g_atomic_int_set(&rec->capturing, 0);
+    if (rec->capture_thread) g_thread_join(rec->capture_thread);
+    g_mutex_lock(&rec->lock);
+    rec->stopping = TRUE;
+    g_cond_signal(&rec->cond);
+    g_mutex_unlock(&rec->lock);
+    if (rec->writer_thread) g_thread_join(rec->writer_thread);
+
+    if (rec->writer_thread) {
+        printf("Recorded %lu frames of %s in %d file(s) under %s; dropped %lu (queue full %lu, overrun at source %lu, write error %lu)\n",
+               (unsigned long)rec->written, rec->stream, rec->files, rec->dir,
+               (unsigned long)(rec->drop_queue + rec->drop_source + rec->drop_error),
+               (unsigned long)rec->drop_queue, (unsigned long)rec->drop_source, (unsigned long)rec->drop_error);
+    }
+
+    if (rec->source.md) ImageStreamIO_closeIm(&rec->source);
+    g_mutex_clear(&rec->lock);
+    g_cond_clear(&rec->cond);
+    free(rec->queue);
+    free(rec->queue_cnt0);
+    free(rec->wbuf);
+    free(rec->stream);
+    free(rec);
+}
+
+// Record frames of stream with cnt0 % every == 0 into DIR/<stream>_<start>_NNN.fits,
+// max_mb per file, with up to queue_frames frames waiting for the disk
+static Recorder *
+recorder_start(const char *stream, const char *dir, int every, int max_mb, int queue_frames) {
+    Recorder *rec = (Recorder*)calloc(1, sizeof(Recorder));
+    if (!rec) return NULL;
+    g_mutex_init(&rec->lock);
+    g_cond_init(&rec->cond);
+    rec->fd = -1;
+    rec->stream = strdup(stream);
+    snprintf(rec->dir, sizeof(rec->dir), "%s", dir && dir[0] ? dir : ".");
+    rec->every = every > 0 ? every : 1;
+    rec->qlen = queue_frames > 0 ? queue_frames : 1;
+
+    if (ImageStreamIO_openIm(&rec->source, stream) != IMAGESTREAMIO_SUCCESS) {
+        memset(&rec->source, 0, sizeof(IMAGE));
+        fprintf(stderr, "Recorder: cannot open stream %s\n", stream);
+        recorder_stop(rec);
+        return NULL;
+    }
+
+    int bitpix;
+    const char *bzero;
+    rec->width = rec->source.md->size[0];
+    rec->height = rec->source.md->naxis > 1 ? rec->source.md->size[1] : 1;
+    rec->datatype = rec->source.md->datatype;
+    rec->esize = ImageStreamIO_typesize(rec->datatype);
+    rec->frame_size = (size_t)rec->width * rec->height * rec->esize;
+    if (!fits_bitpix(rec->datatype, &bitpix, &bzero)) {
+        fprintf(stderr, "Recorder: %s data type not supported in FITS\n", get_datatype_string(rec->datatype));
+        recorder_stop(rec);
+        return NULL;
+    }
+
+    rec->max_bytes = (uint64_t)(max_mb > 0 ? max_mb : 1) << 20;
+    if (rec->max_bytes < FITS_BLOCK + rec->frame_size) rec->max_bytes = FITS_BLOCK + rec->frame_size;
+
+    rec->queue = (uint8_t*)malloc((size_t)rec->qlen * rec->frame_size);
+    rec->queue_cnt0 = (uint64_t*)malloc((size_t)rec->qlen * sizeof(uint64_t));
+    if (posix_memalign((void **)&rec->wbuf, REC_ALIGN, REC_WRITE_BYTES) != 0) rec->wbuf = NULL;
+    if (!rec->queue || !rec->queue_cnt0 || !rec->wbuf) {
+        fprintf(stderr, "Recorder: cannot allocate a %d frame queue\n", rec->qlen);
+        recorder_stop(rec);
+        return NULL;
+    }
+
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(rec->stamp, sizeof(rec->stamp), "%Y%m%dT%H%M%S", &tm);
+
+    // Start from the next frame
+    rec->last_cnt0 = rec->source.md->cnt0;
+    g_atomic_int_set(&rec->capturing, 1);
+    rec->writer_thread = g_thread_new("rec-writer", rec_writer, rec);
+    rec->capture_thread = g_thread_new("rec-capture", rec_capture, rec);
+    printf("Recording %s to %s (every %d frame(s), %d MB per file)\n", stream, rec->dir, rec->every, max_mb);
+    return rec;
+}
+
+// File Playback
+// Frames are paged in from the mapping as they are shown, with the next one
+// prefetched, so recordings larger than RAM play without being loaded.
+
+static const struct { const char *name; uint8_t datatype; } player_raw_types[] = {
+    { "u8", _DATATYPE_UINT8 }, { "i8", _DATATYPE_INT8 }, { "u16", _DATATYPE_UINT16 }, { "i16", _DATATYPE_INT16 },
+    { "u32", _DATATYPE_UINT32 }, { "i32", _DATATYPE_INT32 }, { "u64", _DATATYPE_UINT64 }, { "i64", _DATATYPE_INT64 },
+    { "f32", _DATATYPE_FLOAT }, { "f64", _DATATYPE_DOUBLE },
+};
+
+// WIDTHxHEIGHT:TYPE, e.g. 640x480:u16
+static gboolean
+player_parse_raw(const char *spec, int *width, int *height, uint8_t *datatype) {
+    char type[8];
+    if (sscanf(spec, "%dx%d:%7s", width, height, type) != 3 || *width <= 0 || *height <= 0) return FALSE;
+    for (size_t i = 0; i < G_N_ELEMENTS(player_raw_types); ++i) {
+        if (strcmp(type, player_raw_types[i].name) == 0) {
+            *datatype = player_raw_types[i].datatype;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// Primary HDU geometry and type; NULL on success, else what is unsupported
+static const char *
+player_parse_fits(FilePlayer *p, int *width, int *height, uint8_t *datatype) {
+    int bitpix = 0, naxis = -1;
+    uint64_t naxisn[3] = { 1, 1, 1 };
+    double bzero = 0, bscale = 1;
+    gboolean recorded = FALSE;
+    size_t off = 0;
+
+    for (;; off += 80) {
+        if (off + 80 > p->map_len) return "no END card";
+        const char *card = (const char*)p->map + off;
+        const char *val = card + 10;
+#define FITS_KEY(k) (strncmp(card, k "        ", 8) == 0 && card[8] == '=')
+        if (strncmp(card, "END     ", 8) == 0) break;
+        if (FITS_KEY("BITPIX")) bitpix = atoi(val);
+        else if (FITS_KEY("NAXIS")) naxis = atoi(val);
+        else if (FITS_KEY("NAXIS1")) naxisn[0] = strtoull(val, NULL, 10);
+        else if (FITS_KEY("NAXIS2")) naxisn[1] = strtoull(val, NULL, 10);
+        else if (FITS_KEY("NAXIS3")) naxisn[2] = strtoull(val, NULL, 10);
+        else if (FITS_KEY("BZERO")) bzero = strtod(val, NULL);
+        else if (FITS_KEY("BSCALE")) bscale = strtod(val, NULL);
+        else if (FITS_KEY("CNT0FRST")) { p->cnt0_first = strtoull(val, NULL, 10); recorded = TRUE; }
+        else if (FITS_KEY("RECEVERY")) p->cnt0_step = strtoull(val, NULL, 10);
+#undef FITS_KEY
+    }
+    p->data_off = (off + 80 + FITS_BLOCK - 1) / FITS_BLOCK * FITS_BLOCK;
+    if (!recorded) p->cnt0_first = 1;
+    if (!recorded || p->cnt0_step == 0) p->cnt0_step = 1;
+
+    if (naxis < 1 || naxis > 3) return "NAXIS must be 1 to 3";
+    double offset = 0;
+    switch (bitpix) {
+        case 8:   offset = -128; *datatype = bzero == offset ? _DATATYPE_INT8 : _DATATYPE_UINT8; break;
+        case 16:  offset = 32768; *datatype = bzero == offset ? _DATATYPE_UINT16 : _DATATYPE_INT16; break;
+        case 32:  offset = 2147483648.0; *datatype = bzero == offset ? _DATATYPE_UINT32 : _DATATYPE_INT32; break;
+        case 64:  offset = 9223372036854775808.0; *datatype = bzero == offset ? _DATATYPE_UINT64 : _DATATYPE_INT64; break;
+        case -32: *datatype = _DATATYPE_FLOAT; break;
+        case -64: *datatype = _DATATYPE_DOUBLE; break;
+        default:  return "unknown BITPIX";
+    }
+    if (bscale != 1 || (bzero != 0 && bzero != offset)) return "scaled data (BSCALE/BZERO)";
+
+    *width = (int)naxisn[0];
+    *height = naxis >= 2 ? (int)naxisn[1] : 1;
+    p->nframes = naxis >= 3 ? naxisn[2] : 1;
+    return NULL;
+}
+
+static void
+player_free(FilePlayer *p) {
+    if (!p) return;
+    if (p->map) munmap(p->map, p->map_len);
+    free(p->frame);
+    free(p);
+}
+
+// Make frame i the current one
+static void
+player_show(FilePlayer *p, uint64_t i) {
+    if (p->nframes == 0) return;
+    if (i >= p->nframes) i = p->nframes - 1;
+    p->pos = i;
+    const uint8_t *src = p->map + p->data_off + i * p->frame_size;
+    if (p->fits) fits_decode(p->frame, src, p->md.datatype, p->md.nelement);
+    else p->image.array.raw = (void*)src;
+
+    if (i + 1 < p->nframes) {
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t next = (uintptr_t)(src + p->frame_size);
+        uintptr_t start = next & ~(page - 1);
+        madvise((void*)start, next + p->frame_size - start, MADV_WILLNEED);
+    }
+
+    p->md.cnt0 = p->cnt0_first + i * p->cnt0_step;
+    p->md.cnt1 = 0;
+}
+
+// raw: NULL for FITS, else WIDTHxHEIGHT:TYPE of a headerless frame file
+static FilePlayer *
+player_open(const char *path, const char *raw, double fps, gboolean loop) {
+    FilePlayer *p = (FilePlayer*)calloc(1, sizeof(FilePlayer));
+    if (!p) return NULL;
+    const char *err = NULL;
+    int width = 0, height = 0;
+    uint8_t datatype = 0;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        err = "cannot open";
+    } else {
+        p->map_len = (size_t)st.st_size;
+        p->map = (uint8_t*)mmap(NULL, p->map_len, PROT_READ, MAP_SHARED, fd, 0);
+        if (p->map == MAP_FAILED) {
+            p->map = NULL;
+            err = "cannot map";
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    if (!err && raw) {
+        if (!player_parse_raw(raw, &width, &height, &datatype)) err = "bad --play-raw (expected WIDTHxHEIGHT:TYPE)";
+        p->cnt0_first = 1;
+        p->cnt0_step = 1;
+    } else if (!err) {
+        if (p->map_len < FITS_BLOCK || strncmp((const char*)p->map, "SIMPLE  =", 9) != 0) err = "not a FITS file (use --play-raw for raw frames)";
+        else err = player_parse_fits(p, &width, &height, &datatype);
+        p->fits = TRUE;
+    }
+
+    if (!err) {
+        p->frame_size = (size_t)width * height * ImageStreamIO_typesize(datatype);
+        if (p->frame_size == 0) {
+            err = "empty frames";
+        } else {
+            // Raw files hold whatever fits; a FITS cube cut short plays what was written
+            uint64_t avail = p->map_len > p->data_off ? (p->map_len - p->data_off) / p->frame_size : 0;
+            if (raw || avail < p->nframes) p->nframes = avail;
+            if (p->nframes == 0) err = "no complete frame";
+        }
+    }
+    if (!err && p->fits && !(p->frame = (uint8_t*)malloc(p->frame_size))) err = "out of memory";
+    if (err) {
+        fprintf(stderr, "Cannot play %s: %s\n", path, err);
+        player_free(p);
+        return NULL;
+    }
+    madvise(p->map, p->map_len, MADV_SEQUENTIAL);
+
+    const char *base = strrchr(path, '/');
+    snprintf(p->name, sizeof(p->name), "%s", base ? base + 1 : path);
+    snprintf(p->md.name, sizeof(p->md.name), "%s", p->name);
+    p->md.naxis = 2;
+    p->md.size[0] = width;
+    p->md.size[1] = height;
+    p->md.nelement = (uint64_t)width * height;
+    p->md.datatype = datatype;
+    p->image.md = &p->md;
+    p->image.array.raw = p->frame;
+    p->fps = fps > 0 ? fps : 25;
+    p->loop = loop;
+    player_show(p, 0);
+
+    printf("Playing %s: %lu frames %dx%d %s\n", path, (unsigned long)p->nframes, width, height, get_datatype_string(datatype));
+    return p;
+}
+
+// Advance by the frames due since the last tick; TRUE if the frame changed
+static gboolean
+player_tick(FilePlayer *p) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!p->playing) {
+        p->last = now;
+        p->owed = 0;
+        return FALSE;
+    }
+
+    p->owed += ((now.tv_sec - p->last.tv_sec) + (now.tv_nsec - p->last.tv_nsec) / 1e9) * p->fps;
+    p->last = now;
+    if (p->owed < 1) return FALSE;
+
+    uint64_t n = (uint64_t)p->owed;
+    p->owed -= (double)n;
+    uint64_t next = p->pos + n;
+    if (next >= p->nframes) {
+        if (p->loop) {
+            next %= p->nframes;
+        } else {
+            next = p->nframes - 1;
+            p->playing = FALSE;
+        }
+    }
+    if (next == p->pos) return !p->playing;
+    player_show(p, next);
+    return TRUE;
+}
+
+// Close an image of a stream context; closing the played file ends playback
+static void
+stream_image_close(ViewerApp *app, IMAGE *img) {
+    if (!img) return;
+    if (app->player && img == &app->player->image) {
+        if (app->trigger && app->trigger->player == app->player) trigger_watch_stop(app->trigger);
+        player_free(app->player);
+        app->player = NULL;
+        if (app->box_play) gtk_widget_set_visible(app->box_play, FALSE);
+        return;
+    }
+    ImageStreamIO_closeIm(img);
+    free(img);
+}
+
+// Point a stream context at a new stream name and reopen it
+static void
+reopen_stream_context(ViewerApp *app, int target) {
+    StreamContext *ctx = &app->streams[target];
+
+    // A played file has no stream to reopen under its own name
+    if (app->player && target == 0 && ctx->image_name && strcmp(ctx->image_name, app->player->name) == 0) {
+        hist_cache_invalidate(&app->hist_cache);
+        return;
+    }
+
+    if (target == app->active_stream) {
+        // Clear alias to avoid dangling pointer
+        if (ctx->image == app->image) ctx->image = NULL;
+
+        stream_image_close(app, app->image);
+        app->image = NULL;
+        if (app->image_name) free(app->image_name);
+        app->image_name = strdup(ctx->image_name);
+
+        // Reset history buffers as stream changed
+        if (app->img_history_capacity > 0) img_history_reset(app);
+    } else {
+        stream_image_close(app, ctx->image);
+        ctx->image = (IMAGE*)malloc(sizeof(IMAGE));
+        if (ImageStreamIO_openIm(ctx->image, ctx->image_name) != IMAGESTREAMIO_SUCCESS) {
+            free(ctx->image);
+            ctx->image = NULL;
+        }
+    }
+
+    hist_cache_invalidate(&app->hist_cache);
+}
+
+// Stop the temporal statistics of a stream whose source is going away
+static void
+clear_tstat(ViewerApp *app, int target) {
+    StreamContext *ctx = &app->streams[target];
+    if (!ctx->tstat) return;
+
+    tstat_stop(ctx->tstat);
+    ctx->tstat = NULL;
+
+    if (target == app->tbin_control_target && app->dropdown_tstat) {
+        app->tstat_ui_lock = TRUE;
+        gtk_drop_down_set_selected(GTK_DROP_DOWN(app->dropdown_tstat), TSTAT_OFF);
+        app->tstat_ui_lock = FALSE;
+    }
+}
+
+static const int tstat_windows[] = {2, 4, 8, 16, 32, 64, 128};
+
+static void
+apply_tstat_settings (ViewerApp *app)
+{
+    if (app->tstat_ui_lock) return;
+
+    int target = app->tbin_control_target;
+    StreamContext *ctx = &app->streams[target];
+    if (!ctx->base_image_name) return;
+
+    int stat = gtk_drop_down_get_selected(GTK_DROP_DOWN(app->dropdown_tstat));
+    guint w = gtk_drop_down_get_selected(GTK_DROP_DOWN(app->dropdown_tstat_window));
+    int window = tstat_windows[w < 7 ? w : 3];
+    gboolean exponential = gtk_check_button_get_active(GTK_CHECK_BUTTON(app->check_tstat_exp));
+
+    TemporalStats *old = ctx->tstat;
+    if ((!old || old->fallback) && stat == TSTAT_OFF) return;
+    if (old && old->stat == stat && old->window == window && old->exponential == exponential) return;
+
+    // Old output must be gone before a new one is created under the same name
+    tstat_stop(old);
+    ctx->tstat = NULL;
+
+    if (stat != TSTAT_OFF) {
+        ctx->tstat = tstat_start(ctx->base_image_name, stat, window, exponential);
+        if (!ctx->tstat) fprintf(stderr, "Failed to start temporal statistics on %s\n", ctx->base_image_name);
+    }
+
+    if (ctx->image_name) free(ctx->image_name);
+    ctx->image_name = strdup(ctx->tstat ? ctx->tstat->out_name : ctx->base_image_name);
+    ctx->current_tbin = 1;
+    ctx->current_rms_mode = FALSE;
+
+    reopen_stream_context(app, target);
+
+    update_tbin_menu_state(app);
+    update_rms_menu_state(app);
+    app->force_redraw = TRUE;
+}
+
+static void
+on_tstat_changed (GtkDropDown *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    apply_tstat_settings((ViewerApp *)user_data);
+}
+
+static void
+on_tstat_exp_toggled (GtkCheckButton *btn, gpointer user_data)
+{
+    apply_tstat_settings((ViewerApp *)user_data);
+}
+
+// Reflect the temporal statistics of the tbin target stream in the controls
+static void
+update_tstat_ui_state (ViewerApp *app)
+{
+    if (!app->dropdown_tstat) return;
+    TemporalStats *ts = app->streams[app->tbin_control_target].tstat;
+
+    app->tstat_ui_lock = TRUE;
+    if (ts && ts->fallback) ts = NULL;
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(app->dropdown_tstat), ts ? ts->stat : TSTAT_OFF);
+    if (ts) {
+        for (int i = 0; i < 7; ++i) {
+            if (tstat_windows[i] == ts->window) gtk_drop_down_set_selected(GTK_DROP_DOWN(app->dropdown_tstat_window), i);
+        }
+        gtk_check_button_set_active(GTK_CHECK_BUTTON(app->check_tstat_exp), ts->exponential);
+    }
+    app->tstat_ui_lock = FALSE;
+}
+
+// Producer timestamp of the latest frame: per-slice arrays for circular buffers,
+// else md->atime, else md->writetime. FALSE when the producer leaves them unset.
+static gboolean
+stream_frame_time(IMAGE *img, struct timespec *out) {
+    const struct timespec *ts = NULL;
+    if ((img->md->imagetype & CIRCULAR_BUFFER) && img->md->naxis == 3 && img->writetimearray) {
+        uint64_t slice = img->md->cnt1 % img->md->size[2];
+        if (img->atimearray && (img->atimearray[slice].tv_sec || img->atimearray[slice].tv_nsec))
+            ts = &img->atimearray[slice];
+        else
+            ts = &img->writetimearray[slice];
+    } else if (img->md->atime.tv_sec || img->md->atime.tv_nsec) {
+        ts = &img->md->atime;
+    } else {
+        ts = &img->md->writetime;
+    }
+    if (!ts->tv_sec && !ts->tv_nsec) return FALSE;
+    *out = *ts;
+    return TRUE;
+}
+
+// Frame of img to pair with a recorded frame: for a circular buffer, the
+// slice whose writetime is closest to t (or, without a time, whose cnt0 is
+// closest); otherwise the current frame. Walks back from the newest slice and
+// stops once the distance grows, so this is usually a few steps.
+static const void *
+stream_paired_frame(IMAGE *img, size_t frame_size, uint64_t cnt0, const struct timespec *t, uint64_t *out_cnt0) {
+    uint64_t n = img->md->size[2];
+    if (!(img->md->imagetype & CIRCULAR_BUFFER) || img->md->naxis != 3 || n < 2 || (!t && !img->cntarray)) {
+        *out_cnt0 = img->md->cnt0;
+        return img->array.raw;
+    }
+
+    uint64_t newest = img->md->cnt1 % n;
+    uint64_t best = newest;
+    double best_d = INFINITY;
+    // The slice after the newest one may be under write
+    for (uint64_t k = 0; k + 1 < n; ++k) {
+        uint64_t slice = (newest + n - k) % n;
+        double d;
+        if (t && img->writetimearray) {
+            const struct timespec *w = &img->writetimearray[slice];
+            if (!w->tv_sec && !w->tv_nsec) break;
+            d = fabs((double)(w->tv_sec - t->tv_sec) + (w->tv_nsec - t->tv_nsec) * 1e-9);
+        } else if (img->cntarray) {
+            d = fabs((double)(int64_t)(img->cntarray[slice] - cnt0));
+        } else {
+            break;
+        }
+        if (d > best_d) break;
+        best_d = d;
+        best = slice;
+    }
+    *out_cnt0 = img->cntarray ? img->cntarray[best] : img->md->cnt0;
+    return (const char*)img->array.raw + best * frame_size;
+}
+
+static gboolean
+stream_exists (const char *name)
+{
+    IMAGE test_img;
+    if (ImageStreamIO_openIm(&test_img, name) != 0) return FALSE;
+    ImageStreamIO_closeIm(&test_img);
+    return TRUE;
+}
+
+// Stream name for a tbin/rms selection. When no producer publishes it, start
+// in-viewer binning of the base stream and return its output instead.
+static char *
+select_tbin_stream (ViewerApp *app, int target, int tbin, gboolean rms)
+{
+    StreamContext *ctx = &app->streams[target];
+    if (tbin == 1 && !rms) return strdup(ctx->base_image_name);
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s.tbin%d%s", ctx->base_image_name, tbin, rms ? ".rms" : "");
+    if (stream_exists(buf)) return strdup(buf);
+
+    ctx->tstat = tstat_start(ctx->base_image_name, rms ? TSTAT_RMS : TSTAT_TBIN, tbin, FALSE);
+    if (!ctx->tstat) return strdup(buf);
+    ctx->tstat->fallback = TRUE;
+    return strdup(ctx->tstat->out_name);
+}
+
+static void
+on_tbin_clicked (GtkButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(btn), "tbin-val"));
+    int target = app->tbin_control_target;
+    StreamContext *ctx = &app->streams[target];
+
+    if (!ctx->base_image_name) return;
+
+    if (tbin == ctx->current_tbin && !ctx->current_rms_mode && (!ctx->tstat || ctx->tstat->fallback)) return;
+
+    ctx->current_tbin = tbin;
+    ctx->current_rms_mode = FALSE;
+
+    // Previous statistics output name may be reused below
+    clear_tstat(app, target);
+
+    if (ctx->image_name) free(ctx->image_name);
+    ctx->image_name = select_tbin_stream(app, target, tbin, FALSE);
+
+    // Reload, whether displayed or in the background
+    reopen_stream_context(app, target);
+
+    update_tbin_menu_state(app);
+    update_rms_menu_state(app);
+    app->force_redraw = TRUE;
+}
+
+static void
+on_rms_clicked (GtkButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(btn), "tbin-val"));
+    int target = app->tbin_control_target;
+    StreamContext *ctx = &app->streams[target];
+
+    if (!ctx->base_image_name) return;
+
+    if (tbin == ctx->current_tbin && ctx->current_rms_mode && (!ctx->tstat || ctx->tstat->fallback)) return;
+
+    ctx->current_tbin = tbin;
+    ctx->current_rms_mode = TRUE;
+
+    clear_tstat(app, target);
+
+    if (ctx->image_name) free(ctx->image_name);
+    ctx->image_name = select_tbin_stream(app, target, tbin, TRUE);
+
+    reopen_stream_context(app, target);
+
+    update_tbin_menu_state(app);
+    update_rms_menu_state(app);
+    app->force_redraw = TRUE;
+}
+
+static void
+update_tbin_menu_state (ViewerApp *app)
+{
+    int target = app->tbin_control_target;
+    StreamContext *ctx = &app->streams[target];
+
+    GtkWidget *child = gtk_widget_get_first_child(app->box_tbin_btns);
+    while (child) {
+        if (GTK_IS_BUTTON(child)) {
+            int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(child), "tbin-val"));
+
+            gboolean exists = FALSE;
+            if (ctx->base_image_name) {
+                if (tbin == 1) {
+                    exists = TRUE;
+                } else {
+                    char buf[256];
+                    snprintf(buf, sizeof(buf), "%s.tbin%d", ctx->base_image_name, tbin);
+                    exists = stream_exists(buf);
+                }
+            }
+
+            // Missing bins are computed in-viewer
+            gtk_widget_set_sensitive(child, ctx->base_image_name != NULL);
+
+            if (exists) {
+                gtk_widget_add_css_class(child, "tbin-exists");
+            } else {
+                gtk_widget_remove_css_class(child, "tbin-exists");
+            }
+
+            if (tbin == ctx->current_tbin && !ctx->current_rms_mode && (!ctx->tstat || ctx->tstat->fallback)) {
+                gtk_widget_add_css_class(child, "tbin-selected");
+            } else {
+                gtk_widget_remove_css_class(child, "tbin-selected");
+            }
+        }
+        child = gtk_widget_get_next_sibling(child);
+    }
+}
+
+static void
+update_rms_menu_state (ViewerApp *app)
+{
+    int target = app->tbin_control_target;
+    StreamContext *ctx = &app->streams[target];
+
+    GtkWidget *child = gtk_widget_get_first_child(app->box_rms_btns);
+    while (child) {
+        if (GTK_IS_BUTTON(child)) {
+            int tbin = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(child), "tbin-val"));
+
+            gboolean exists = FALSE;
+            if (ctx->base_image_name) {
+                char buf[256];
+                snprintf(buf, sizeof(buf), "%s.tbin%d.rms", ctx->base_image_name, tbin);
+                exists = stream_exists(buf);
+            }
+
+            gtk_widget_set_sensitive(child, ctx->base_image_name != NULL);
+
+            if (exists) {
+                gtk_widget_add_css_class(child, "tbin-exists");
+            } else {
+                gtk_widget_remove_css_class(child, "tbin-exists");
+            }
+
+            if (tbin == ctx->current_tbin && ctx->current_rms_mode && (!ctx->tstat || ctx->tstat->fallback)) {
+                gtk_widget_add_css_class(child, "tbin-selected");
+            } else {
+                gtk_widget_remove_css_class(child, "tbin-selected");
+            }
+        }
+        child = gtk_widget_get_next_sibling(child);
+    }
+}
+
+static void
+refresh_tbin_popover (GtkWidget *popover, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
     if (!gtk_widget_get_visible(popover)) return;
     update_tbin_menu_state(app);
 }
@@ -1484,6 +5513,19 @@ on_gain_changed (GtkDropDown *dropdown, GParamSpec *pspec, gpointer user_data)
     }
 }
 
+static void
+on_autoscale_sampling_changed (GtkDropDown *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    guint selected = gtk_drop_down_get_selected(dropdown);
+    // Tolerance on the percentile rank (fraction of pixels)
+    double tolerances[] = {0.0, 0.0005, 0.001, 0.002, 0.005};
+    if (selected < 5) {
+        app->autoscale_tolerance = tolerances[selected];
+        app->force_redraw = TRUE;
+    }
+}
+
 // Helper Functions for Color & Scale
 
 static const char* get_datatype_string(int type) {
@@ -1853,7 +5895,218 @@ on_pause_toggled (GtkToggleButton *btn, gpointer user_data)
     if (app->paused) {
         // Automatically disable Stats Update when paused
         gtk_check_button_set_active(GTK_CHECK_BUTTON(app->btn_stats_update), FALSE);
+    } else {
+        // Recording into the ring resumes; history replay ends
+        hreplay_invalidate(app);
+    }
+}
+
+static void
+on_record_toggled (GtkToggleButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    gboolean active = gtk_toggle_button_get_active(btn);
+
+    if (active && !app->recorder) {
+        size_t frame_size = app->image ? (size_t)app->image->md->size[0] * app->image->md->size[1] *
+                                         ImageStreamIO_typesize(app->image->md->datatype) : 0;
+        if (app->image_name)
+            app->recorder = recorder_start(app->image_name, opt_record_dir, opt_record_every, opt_record_max_mb,
+                                           mem_recorder_queue(frame_size, opt_record_queue));
+        // Bounces back through this handler with active == FALSE
+        if (!app->recorder) gtk_toggle_button_set_active(btn, FALSE);
+    } else if (!active && app->recorder) {
+        recorder_stop(app->recorder);
+        app->recorder = NULL;
+    }
+    app->record_shown = (uint64_t)-1;
+}
+
+// Frames written and dropped, refreshed from the display tick while recording
+static void
+update_record_label(ViewerApp *app) {
+    if (!app->lbl_record || app->record_shown == 0) return;
+    Recorder *rec = app->recorder;
+    if (!rec) {
+        gtk_label_set_text(GTK_LABEL(app->lbl_record), "");
+        gtk_widget_set_tooltip_text(app->lbl_record, NULL);
+        app->record_shown = 0;
+        return;
     }
+
+    char buf[64], tip[1024];
+    g_mutex_lock(&rec->lock);
+    uint64_t dropped = rec->drop_queue + rec->drop_source + rec->drop_error;
+    uint64_t shown = rec->written + dropped + 1;
+    if (shown != app->record_shown) {
+        snprintf(buf, sizeof(buf), "%lu%s%lu drop", (unsigned long)rec->written, rec->error[0] ? " ERR " : " / ", (unsigned long)dropped);
+        snprintf(tip, sizeof(tip), "%s\nqueue %lu/%d, dropped: %lu queue full, %lu overrun at source, %lu write error%s%s",
+                 rec->file, (unsigned long)(rec->head - rec->tail), rec->qlen, (unsigned long)rec->drop_queue,
+                 (unsigned long)rec->drop_source, (unsigned long)rec->drop_error, rec->error[0] ? "\n" : "", rec->error);
+    }
+    g_mutex_unlock(&rec->lock);
+    if (shown == app->record_shown) return;
+    gtk_label_set_text(GTK_LABEL(app->lbl_record), buf);
+    gtk_widget_set_tooltip_text(app->lbl_record, tip);
+    app->record_shown = shown;
+}
+
+// Reflect the playback position and state in the transport bar
+static void
+update_play_ui(ViewerApp *app) {
+    FilePlayer *p = app->player;
+    if (!p || !app->box_play) return;
+
+    app->play_ui_lock = TRUE;
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->btn_play), p->playing);
+    gtk_range_set_value(GTK_RANGE(app->scale_play), (double)p->pos);
+    app->play_ui_lock = FALSE;
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%lu/%lu  cnt0 %lu", (unsigned long)(p->pos + 1), (unsigned long)p->nframes,
+             (unsigned long)p->md.cnt0);
+    gtk_label_set_text(GTK_LABEL(app->lbl_play), buf);
+}
+
+static void
+on_play_toggled (GtkToggleButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    if (app->play_ui_lock || !app->player) return;
+    FilePlayer *p = app->player;
+    p->playing = gtk_toggle_button_get_active(btn);
+    // Play from the start again once the end was reached
+    if (p->playing && p->pos + 1 >= p->nframes && !p->loop) player_show(p, 0);
+    clock_gettime(CLOCK_MONOTONIC, &p->last);
+    p->owed = 0;
+    update_play_ui(app);
+}
+
+static void
+play_step(ViewerApp *app, int dir) {
+    FilePlayer *p = app->player;
+    if (!p) return;
+    p->playing = FALSE;
+    if (dir < 0) player_show(p, p->pos > 0 ? p->pos - 1 : (p->loop ? p->nframes - 1 : 0));
+    else player_show(p, p->pos + 1 < p->nframes ? p->pos + 1 : (p->loop ? 0 : p->pos));
+    update_play_ui(app);
+}
+
+static void
+on_play_back_clicked (GtkButton *btn, gpointer user_data)
+{
+    play_step((ViewerApp *)user_data, -1);
+}
+
+static void
+on_play_forward_clicked (GtkButton *btn, gpointer user_data)
+{
+    play_step((ViewerApp *)user_data, 1);
+}
+
+static void
+on_play_loop_toggled (GtkCheckButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    if (app->player) app->player->loop = gtk_check_button_get_active(btn);
+}
+
+static void
+on_play_fps_changed (GtkSpinButton *spin, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    if (app->player) app->player->fps = gtk_spin_button_get_value(spin);
+}
+
+static void
+on_play_seek_changed (GtkRange *range, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    if (app->play_ui_lock || !app->player) return;
+    app->player->playing = FALSE;
+    player_show(app->player, (uint64_t)gtk_range_get_value(range));
+    update_play_ui(app);
+}
+
+static void
+hreplay_step(ViewerApp *app, int dir) {
+    HistReplay *hr = &app->hreplay;
+    if (!hreplay_enter(app)) return;
+    hr->dir = 0;
+    long next = hreplay_neighbor(app, hr->slot, dir);
+    if (next >= 0) hreplay_show(app, (size_t)next);
+    else update_hreplay_ui(app);
+}
+
+static void
+on_hreplay_prev_clicked (GtkButton *btn, gpointer user_data)
+{
+    hreplay_step((ViewerApp *)user_data, -1);
+}
+
+static void
+on_hreplay_next_clicked (GtkButton *btn, gpointer user_data)
+{
+    hreplay_step((ViewerApp *)user_data, 1);
+}
+
+static void
+on_hreplay_play_toggled (GtkToggleButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    HistReplay *hr = &app->hreplay;
+    if (app->hreplay_ui_lock) return;
+    int dir = (GTK_WIDGET(btn) == app->btn_hreplay_fwd) ? 1 : -1;
+
+    if (gtk_toggle_button_get_active(btn) && hreplay_enter(app)) {
+        hr->dir = dir;
+        hr->stride = 1;
+        clock_gettime(CLOCK_MONOTONIC, &hr->last);
+        hr->owed = 0;
+        hreplay_request(app);
+    } else if (hr->dir == dir) {
+        hr->dir = 0;
+    }
+    update_hreplay_ui(app);
+}
+
+static void
+on_hreplay_live_clicked (GtkButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    // Unpausing ends the replay through on_pause_toggled
+    if (app->paused) gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->btn_pause), FALSE);
+    else hreplay_invalidate(app);
+}
+
+static void
+on_hreplay_rate_changed (GtkDropDown *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    app->hreplay.rate = 1.0 / (1 << gtk_drop_down_get_selected(dropdown));
+}
+
+static void
+on_hreplay_loop_toggled (GtkCheckButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    app->hreplay.loop = gtk_check_button_get_active(btn);
+    if (app->hreplay.active) hreplay_request(app);
+}
+
+// A and B mark the shown frame as a loop range end
+static void
+on_hreplay_mark_clicked (GtkButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    HistReplay *hr = &app->hreplay;
+    if (!hreplay_enter(app)) return;
+    int m = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(btn), "mark"));
+    hr->mark[m] = hr->cnt0;
+    hr->mark_src[m] = hr->src;
+    hr->mark_set[m] = TRUE;
+    hreplay_request(app);
+    update_hreplay_ui(app);
 }
 
 static void
@@ -2651,6 +6904,40 @@ draw_colorbar_func (GtkDrawingArea *area,
 }
 
 // Drawing function for Histogram
+// Trace histogram counts as 8-bit minifloats: exact below 32, then a 4-bit
+// mantissa (relative error <= 1/32, 3.1%) up to ~500k counts per bin. The
+// waterfall shows log brightness, so the quantization is invisible; the
+// histogram itself takes 4x less memory.
+static uint8_t
+trace_hist_encode(uint32_t c) {
+    if (c < 16) return (uint8_t)c;
+
+    int e = 0;
+    while ((c >> e) >= 32) e++;
+    // c ~ (16 + m) << e, rounded to nearest
+    uint32_t q = (e > 0) ? ((c + (1u << (e - 1))) >> e) : c;
+    if (q >= 32) { q >>= 1; e++; }
+    if (e + 1 > 15) return 0xFF;
+    return (uint8_t)(((e + 1) << 4) | (q - 16));
+}
+
+static uint32_t trace_hist_lut[256];
+static float trace_hist_log_lut[256]; // log10(count + 1) per code, for waterfall brightness
+
+static void
+trace_hist_init_lut(void) {
+    for (int code = 0; code < 256; ++code) {
+        int e = code >> 4, m = code & 15;
+        trace_hist_lut[code] = (e == 0) ? (uint32_t)m : (uint32_t)(16 + m) << (e - 1);
+        trace_hist_log_lut[code] = (float)log10(trace_hist_lut[code] + 1.0);
+    }
+}
+
+static void
+trace_hist_decode(const uint8_t *codes, uint32_t *out) {
+    for (int b = 0; b < TRACE_HIST_BINS; ++b) out[b] = trace_hist_lut[codes[b]];
+}
+
 static void
 draw_histogram_func (GtkDrawingArea *area,
                      cairo_t        *cr,
@@ -2662,6 +6949,7 @@ draw_histogram_func (GtkDrawingArea *area,
 
     // Determine Data Source (Live vs Historical)
     uint32_t *data_source = app->hist_data;
+    uint32_t decoded[TRACE_HIST_BINS];
     uint32_t max_cnt = app->hist_max_count;
     double range_min = app->current_min;
     double range_max = app->current_max;
@@ -2672,10 +6960,11 @@ draw_histogram_func (GtkDrawingArea *area,
 
     if (use_history) {
         int idx = app->trace_cursor_idx;
-        if (idx >= 0 && idx < TRACE_MAX_SAMPLES) {
-            data_source = app->trace_hist_data + idx * TRACE_HIST_BINS;
-            range_min = app->trace_hist_min[idx];
-            range_max = app->trace_hist_max[idx];
+        if (idx >= 0 && idx < trace_ring_len) {
+            trace_hist_decode(TRACE_HIST_AT(app, idx), decoded);
+            data_source = decoded;
+            range_min = TRACE_AT(app, hist_min, idx);
+            range_max = TRACE_AT(app, hist_max, idx);
 
             // Recompute max_cnt for this slice
             max_cnt = 0;
@@ -2799,13 +7088,13 @@ draw_histogram_func (GtkDrawingArea *area,
     // Using simple colors: Min(Dark Blue), Max(Dark Red), Mean(Green), Median(Yellow), P10(Cyan), P90(Magenta)
     if (range > 0) {
         double val, norm, x;
-        int trace_idx = (app->trace_head - 1 + TRACE_MAX_SAMPLES) % TRACE_MAX_SAMPLES;
+        int trace_idx = (app->trace_head - 1 + trace_ring_len) % trace_ring_len;
         if (use_history) trace_idx = app->trace_cursor_idx;
 
         if (app->trace_count > 0) {
             // Min (Dark Blue)
             if (app->show_trace_min) {
-                val = app->trace_min[trace_idx];
+                val = TRACE_AT(app, min, trace_idx);
                 norm = (val - range_min) / range;
                 if (norm >= 0 && norm <= 1.0) {
                     cairo_set_source_rgb(cr, 0, 0, 0.5);
@@ -2815,7 +7104,7 @@ draw_histogram_func (GtkDrawingArea *area,
             }
             // Max (Dark Red)
             if (app->show_trace_max) {
-                val = app->trace_max[trace_idx];
+                val = TRACE_AT(app, max, trace_idx);
                 norm = (val - range_min) / range;
                 if (norm >= 0 && norm <= 1.0) {
                     cairo_set_source_rgb(cr, 0.5, 0, 0);
@@ -2825,7 +7114,7 @@ draw_histogram_func (GtkDrawingArea *area,
             }
             // P10 (Cyan)
             if (app->show_trace_p01) {
-                val = app->trace_p01[trace_idx];
+                val = TRACE_AT(app, p01, trace_idx);
                 norm = (val - range_min) / range;
                 if (norm >= 0 && norm <= 1.0) {
                     cairo_set_source_rgb(cr, 0, 1, 1);
@@ -2835,7 +7124,7 @@ draw_histogram_func (GtkDrawingArea *area,
             }
             // P90 (Magenta)
             if (app->show_trace_p09) {
-                val = app->trace_p09[trace_idx];
+                val = TRACE_AT(app, p09, trace_idx);
                 norm = (val - range_min) / range;
                 if (norm >= 0 && norm <= 1.0) {
                     cairo_set_source_rgb(cr, 1, 0, 1);
@@ -2845,7 +7134,7 @@ draw_histogram_func (GtkDrawingArea *area,
             }
             // Mean (Green)
             if (app->show_trace_mean) {
-                val = use_history ? app->trace_mean[trace_idx] : app->stats_mean;
+                val = use_history ? TRACE_AT(app, mean, trace_idx) : app->stats_mean;
                 norm = (val - range_min) / range;
                 if (norm >= 0 && norm <= 1.0) {
                     cairo_set_source_rgb(cr, 0, 1, 0);
@@ -2855,7 +7144,7 @@ draw_histogram_func (GtkDrawingArea *area,
             }
             // Median (Yellow)
             if (app->show_trace_median) {
-                val = use_history ? app->trace_median[trace_idx] : app->stats_median;
+                val = use_history ? TRACE_AT(app, median, trace_idx) : app->stats_median;
                 norm = (val - range_min) / range;
                 if (norm >= 0 && norm <= 1.0) {
                     cairo_set_source_rgb(cr, 1, 1, 0);
@@ -2913,33 +7202,40 @@ draw_histogram_func (GtkDrawingArea *area,
 
 }
 
+// Logical trace index (0 = oldest) of the first sample with time >= t, or
+// trace_count if none. Sample times are monotonic in logical order.
+static int
+trace_lower_bound(ViewerApp *app, double t) {
+    int tail = (app->trace_head - app->trace_count + trace_ring_len) % trace_ring_len;
+    int lo = 0, hi = app->trace_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (TRACE_AT(app, time, (tail + mid) % trace_ring_len) < t) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
 static int
 get_trace_index_at_x(ViewerApp *app, double x, int width) {
     if (app->trace_count == 0 || width <= 0) return -1;
 
     int head = app->trace_head;
-    int tail_idx = (head - 1 + TRACE_MAX_SAMPLES) % TRACE_MAX_SAMPLES;
-    double t_end = app->trace_time[tail_idx];
+    int count = app->trace_count;
+    int tail = (head - count + trace_ring_len) % trace_ring_len;
+    double t_end = TRACE_AT(app, time, (head - 1 + trace_ring_len) % trace_ring_len);
 
     double t_target = (x / (double)width) * app->trace_duration + (t_end - app->trace_duration);
 
-    int best_idx = -1;
-    double min_diff = 1e30;
-
-    for (int i = 0; i < app->trace_count; ++i) {
-        int idx = (head - 1 - i + TRACE_MAX_SAMPLES) % TRACE_MAX_SAMPLES;
-        double diff = fabs(app->trace_time[idx] - t_target);
-        if (diff < min_diff) {
-            min_diff = diff;
-            best_idx = idx;
-        } else {
-             // Heuristic optimization
-            if (app->trace_time[idx] < t_target - app->trace_duration * 0.1) {
-                break;
-            }
-        }
+    // Nearest of the two samples around t_target
+    int i = trace_lower_bound(app, t_target);
+    if (i == count) return (tail + count - 1) % trace_ring_len;
+    if (i > 0) {
+        double t_prev = TRACE_AT(app, time, (tail + i - 1) % trace_ring_len);
+        double t_next = TRACE_AT(app, time, (tail + i) % trace_ring_len);
+        if (t_target - t_prev <= t_next - t_target) i--;
     }
-    return best_idx;
+    return (tail + i) % trace_ring_len;
 }
 
 static void
@@ -3008,47 +7304,895 @@ on_click_trace_pressed (GtkGestureClick *gesture,
          }
     }
 
-    gtk_widget_queue_draw(app->trace_area);
-    if (app->paused) app->force_redraw = TRUE;
+    gtk_widget_queue_draw(app->trace_area);
+    if (app->paused) app->force_redraw = TRUE;
+}
+
+static void
+update_trace_mem_label(ViewerApp *app) {
+    if (!app->lbl_trace_mem) return;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.1f MB", app->trace_bytes / (1024.0 * 1024.0));
+    gtk_label_set_text(GTK_LABEL(app->lbl_trace_mem), buf);
+}
+
+static void
+trace_wf_reset(ViewerApp *app) {
+    if (app->trace_wf.surf) cairo_surface_destroy(app->trace_wf.surf);
+    memset(&app->trace_wf, 0, sizeof(app->trace_wf));
+}
+
+// Stop a running export before the ring it reads goes away; the job itself is freed
+// by trace_io_done
+static void
+trace_io_cancel(ViewerApp *app) {
+    TraceIoJob *job = app->trace_io;
+    if (!job || !job->thread) return;
+    g_atomic_int_set(&job->cancel, 1);
+    g_thread_join(job->thread);
+    job->thread = NULL;
+}
+
+// Free the trace ring without touching widgets, so it is also safe at exit
+// (file chunks are only unmapped from the ring)
+static void
+trace_free_chunks(ViewerApp *app) {
+    for (int c = 0; c < TRACE_NUM_CHUNKS; ++c) {
+        if (!app->trace_view) big_free(app->trace_chunks[c], sizeof(TraceChunk));
+        app->trace_chunks[c] = NULL;
+    }
+    app->trace_bytes = 0;
+    trace_wf_reset(app);
+}
+
+// Drop all trace samples and their memory
+static void
+trace_release(ViewerApp *app) {
+    if (app->trace_io && !app->trace_io->import) trace_io_cancel(app);
+    trace_free_chunks(app);
+    memset(app->psd.seg_key, 0, sizeof(app->psd.seg_key));
+    app->trace_head = 0;
+    app->trace_count = 0;
+    app->trace_total = 0;
+    app->trace_frozen = FALSE;
+    app->trace_cursor_active = FALSE;
+    app->trace_cursor_frozen = FALSE;
+    app->trace_cursor_idx = 0;
+    update_trace_mem_label(app);
+}
+
+static double *
+trace_curve_raw(TraceChunk *chunk, int curve) {
+    switch (curve) {
+        case TRACE_CURVE_MIN: return chunk->min;
+        case TRACE_CURVE_MAX: return chunk->max;
+        case TRACE_CURVE_MEAN: return chunk->mean;
+        case TRACE_CURVE_MEDIAN: return chunk->median;
+        case TRACE_CURVE_P01: return chunk->p01;
+        default: return chunk->p09;
+    }
+}
+
+// Fold sample off of chunk into every pyramid level; a block restarts on its first sample
+static void
+trace_pyr_update(TraceChunk *chunk, int off) {
+    for (int c = 0; c < TRACE_NUM_CURVES; ++c) {
+        float v = (float)trace_curve_raw(chunk, c)[off];
+        float *lo = chunk->pyr_lo[c];
+        float *hi = chunk->pyr_hi[c];
+        for (int l = 1; l <= TRACE_PYR_LEVELS; ++l) {
+            int node = trace_pyr_offset[l] + (off >> (2 * l));
+            if ((off & ((1 << (2 * l)) - 1)) == 0) {
+                lo[node] = v;
+                hi[node] = v;
+            } else {
+                if (v < lo[node]) lo[node] = v;
+                if (v > hi[node]) hi[node] = v;
+            }
+        }
+    }
+}
+
+// Trace Files
+
+static size_t
+trace_file_page_round(size_t n) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+static void
+trace_file_close(TraceFile *tf) {
+    if (!tf) return;
+    if (tf->wchunk) munmap(tf->wchunk, tf->chunk_bytes);
+    if (tf->map) munmap(tf->map, tf->map_len);
+    if (tf->hdr) munmap(tf->hdr, tf->header_bytes);
+    if (tf->fd >= 0) close(tf->fd);
+    free(tf);
+}
+
+// Open a trace file for appending (created if empty) or for browsing
+static TraceFile *
+trace_file_open(const char *path, gboolean writable) {
+    TraceFile *tf = (TraceFile*)calloc(1, sizeof(TraceFile));
+    if (!tf) return NULL;
+    tf->writable = writable;
+    tf->wchunk_idx = -1;
+    tf->header_bytes = trace_file_page_round(sizeof(TraceFileHeader));
+    tf->chunk_bytes = trace_file_page_round(sizeof(TraceChunk));
+
+    tf->fd = open(path, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    struct stat st;
+    if (tf->fd < 0 || fstat(tf->fd, &st) != 0) {
+        fprintf(stderr, "Cannot open trace file %s\n", path);
+        trace_file_close(tf);
+        return NULL;
+    }
+
+    gboolean fresh = writable && st.st_size == 0;
+    if (fresh && ftruncate(tf->fd, (off_t)tf->header_bytes) != 0) {
+        fprintf(stderr, "Cannot size trace file %s\n", path);
+        trace_file_close(tf);
+        return NULL;
+    }
+    if (!fresh && (size_t)st.st_size < tf->header_bytes) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        trace_file_close(tf);
+        return NULL;
+    }
+
+    void *hdr = mmap(NULL, tf->header_bytes, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                     MAP_SHARED, tf->fd, 0);
+    if (hdr == MAP_FAILED) {
+        fprintf(stderr, "Cannot map trace file %s\n", path);
+        trace_file_close(tf);
+        return NULL;
+    }
+    tf->hdr = (TraceFileHeader*)hdr;
+
+    if (fresh) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        memcpy(tf->hdr->magic, "IMTRACE1", 8);
+        tf->hdr->chunk_samples = TRACE_CHUNK_SAMPLES;
+        tf->hdr->hist_bins = TRACE_HIST_BINS;
+        tf->hdr->chunk_bytes = tf->chunk_bytes;
+        tf->hdr->header_bytes = tf->header_bytes;
+        tf->hdr->epoch = now.tv_sec + now.tv_nsec / 1e9;
+        tf->hdr->nsamples = 0;
+    } else if (memcmp(tf->hdr->magic, "IMTRACE1", 8) != 0 ||
+               tf->hdr->chunk_samples != TRACE_CHUNK_SAMPLES ||
+               tf->hdr->hist_bins != TRACE_HIST_BINS ||
+               tf->hdr->chunk_bytes != tf->chunk_bytes ||
+               tf->hdr->header_bytes != tf->header_bytes) {
+        fprintf(stderr, "%s is not a compatible trace file\n", path);
+        trace_file_close(tf);
+        return NULL;
+    }
+
+    if (!writable) {
+        uint64_t nchunks = (tf->hdr->nsamples + TRACE_CHUNK_SAMPLES - 1) / TRACE_CHUNK_SAMPLES;
+        tf->map_len = tf->header_bytes + nchunks * tf->chunk_bytes;
+        if ((size_t)st.st_size < tf->map_len) {
+            fprintf(stderr, "Trace file %s is truncated\n", path);
+            trace_file_close(tf);
+            return NULL;
+        }
+        tf->map = (uint8_t*)mmap(NULL, tf->map_len, PROT_READ, MAP_SHARED, tf->fd, 0);
+        if (tf->map == MAP_FAILED) {
+            tf->map = NULL;
+            fprintf(stderr, "Cannot map trace file %s\n", path);
+            trace_file_close(tf);
+            return NULL;
+        }
+    }
+    return tf;
+}
+
+// Chunk c of a file opened for browsing
+static TraceChunk *
+trace_file_chunk(TraceFile *tf, uint64_t c) {
+    return (TraceChunk*)(tf->map + tf->header_bytes + c * tf->chunk_bytes);
+}
+
+// Anchor trace time 0 (now) to the file time base
+static void
+trace_file_begin_session(TraceFile *tf) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    tf->time_offset = now.tv_sec + now.tv_nsec / 1e9 - tf->hdr->epoch;
+}
+
+// Append sample src_off of a ring chunk
+static void
+trace_file_append(TraceFile *tf, const TraceChunk *src, int src_off) {
+    if (tf->full) return;
+    uint64_t n = tf->hdr->nsamples;
+    uint64_t c = n / TRACE_CHUNK_SAMPLES;
+    int d = (int)(n % TRACE_CHUNK_SAMPLES);
+
+    if (c >= TRACE_FILE_MAX_CHUNKS) {
+        fprintf(stderr, "Trace file full, recording stopped\n");
+        tf->full = TRUE;
+        return;
+    }
+
+    if ((int64_t)c != tf->wchunk_idx) {
+        if (tf->wchunk) munmap(tf->wchunk, tf->chunk_bytes);
+        tf->wchunk = NULL;
+        off_t offset = (off_t)(tf->header_bytes + c * tf->chunk_bytes);
+        void *p = MAP_FAILED;
+        if (ftruncate(tf->fd, offset + (off_t)tf->chunk_bytes) == 0)
+            p = mmap(NULL, tf->chunk_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, tf->fd, offset);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Cannot extend trace file, recording stopped\n");
+            tf->full = TRUE;
+            return;
+        }
+        tf->wchunk = (TraceChunk*)p;
+        tf->wchunk_idx = (int64_t)c;
+    }
+
+    TraceChunk *dst = tf->wchunk;
+    dst->time[d] = src->time[src_off] + tf->time_offset;
+    dst->cnt0[d] = src->cnt0[src_off];
+    dst->min[d] = src->min[src_off];
+    dst->max[d] = src->max[src_off];
+    dst->mean[d] = src->mean[src_off];
+    dst->median[d] = src->median[src_off];
+    dst->p01[d] = src->p01[src_off];
+    dst->p09[d] = src->p09[src_off];
+    dst->hist_min[d] = src->hist_min[src_off];
+    dst->hist_max[d] = src->hist_max[src_off];
+    memcpy(dst->hist + (size_t)d * TRACE_HIST_BINS, src->hist + (size_t)src_off * TRACE_HIST_BINS, TRACE_HIST_BINS);
+    trace_pyr_update(dst, d);
+
+    TraceFileIndex *ix = &tf->hdr->index[c];
+    if (d == 0) {
+        ix->t_first = dst->time[d];
+        ix->cnt0_first = dst->cnt0[d];
+    }
+    ix->t_last = dst->time[d];
+    ix->cnt0_last = dst->cnt0[d];
+    tf->hdr->nsamples = n + 1;
+}
+
+static void
+update_trace_view_label(ViewerApp *app) {
+    if (!app->lbl_trace_view || app->trace_count == 0) return;
+    double t = TRACE_AT(app, time, (app->trace_head - 1 + trace_ring_len) % trace_ring_len);
+    time_t secs = (time_t)(app->trace_view->hdr->epoch + t);
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    char buf[64];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    gtk_label_set_text(GTK_LABEL(app->lbl_trace_view), buf);
+}
+
+// Number of recorded samples at or before file time t: the chunk index narrows the
+// search to one chunk, so only that chunk's time column is paged in.
+static uint64_t
+trace_file_sample_at(TraceFile *tf, double t) {
+    uint64_t n = tf->hdr->nsamples;
+    if (n == 0) return 0;
+    uint64_t nchunks = (n + TRACE_CHUNK_SAMPLES - 1) / TRACE_CHUNK_SAMPLES;
+    if (t < tf->hdr->index[0].t_first) return 0;
+    if (t >= tf->hdr->index[nchunks - 1].t_last) return n;
+
+    // Last chunk starting at or before t
+    uint64_t lo = 0, hi = nchunks - 1;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi + 1) / 2;
+        if (tf->hdr->index[mid].t_first <= t) lo = mid;
+        else hi = mid - 1;
+    }
+    if (t >= tf->hdr->index[lo].t_last) return (lo + 1) * TRACE_CHUNK_SAMPLES;
+
+    // Within the chunk: first sample later than t
+    const TraceChunk *chunk = trace_file_chunk(tf, lo);
+    int a = 0, b = (int)MIN((uint64_t)TRACE_CHUNK_SAMPLES, n - lo * TRACE_CHUNK_SAMPLES);
+    while (a < b) {
+        int mid = (a + b) / 2;
+        if (chunk->time[mid] <= t) a = mid + 1;
+        else b = mid;
+    }
+    return lo * TRACE_CHUNK_SAMPLES + (uint64_t)a;
+}
+
+// Map the file chunks ending at sample end into the trace ring (tail at ring index 0)
+static void
+trace_view_seek(ViewerApp *app, uint64_t end) {
+    TraceFile *tf = app->trace_view;
+    if (end > tf->hdr->nsamples) end = tf->hdr->nsamples;
+    uint64_t end_chunk = (end + TRACE_CHUNK_SAMPLES - 1) / TRACE_CHUNK_SAMPLES;
+    uint64_t base = end_chunk > (uint64_t)(trace_ring_len / TRACE_CHUNK_SAMPLES) ? end_chunk - (uint64_t)(trace_ring_len / TRACE_CHUNK_SAMPLES) : 0;
+
+    for (int c = 0; c < TRACE_NUM_CHUNKS; ++c)
+        app->trace_chunks[c] = (base + c < end_chunk) ? trace_file_chunk(tf, base + c) : NULL;
+
+    trace_wf_reset(app);
+    app->trace_count = (int)(end - base * TRACE_CHUNK_SAMPLES);
+    app->trace_head = app->trace_count % trace_ring_len;
+    app->trace_total = end;
+    app->trace_cursor_active = FALSE;
+    app->trace_cursor_frozen = FALSE;
+    update_trace_view_label(app);
+
+    if (app->trace_area) gtk_widget_queue_draw(app->trace_area);
+}
+
+static void
+on_trace_view_changed(GtkRange *range, gpointer user_data) {
+    ViewerApp *app = (ViewerApp *)user_data;
+    if (app->trace_active)
+        trace_view_seek(app, trace_file_sample_at(app->trace_view, gtk_range_get_value(range)));
+}
+
+// Trace Export / Import
+
+static const struct {
+    const char *name;
+    size_t offset;        // Column array inside TraceChunk
+    uint32_t type;
+    uint32_t width;
+} trace_columns[TRACE_EXPORT_COLS] = {
+    { "time",     offsetof(TraceChunk, time),     TRACE_COL_F64, 8 },
+    { "cnt0",     offsetof(TraceChunk, cnt0),     TRACE_COL_U64, 8 },
+    { "min",      offsetof(TraceChunk, min),      TRACE_COL_F64, 8 },
+    { "max",      offsetof(TraceChunk, max),      TRACE_COL_F64, 8 },
+    { "mean",     offsetof(TraceChunk, mean),     TRACE_COL_F64, 8 },
+    { "median",   offsetof(TraceChunk, median),   TRACE_COL_F64, 8 },
+    { "p10",      offsetof(TraceChunk, p01),      TRACE_COL_F64, 8 },
+    { "p90",      offsetof(TraceChunk, p09),      TRACE_COL_F64, 8 },
+    { "hist_min", offsetof(TraceChunk, hist_min), TRACE_COL_F64, 8 },
+    { "hist_max", offsetof(TraceChunk, hist_max), TRACE_COL_F64, 8 },
+    { "hist",     offsetof(TraceChunk, hist),     TRACE_COL_U8V, TRACE_HIST_BINS },
+};
+
+// Row `off` of column c in a chunk
+static inline char *
+trace_column_at(TraceChunk *chunk, int c, int off) {
+    return (char*)chunk + trace_columns[c].offset + (size_t)off * trace_columns[c].width;
+}
+
+// Live ring samples are overwritten while the export reads them. A row is intact
+// if, after it was copied, the writer had not yet started on its slot.
+static inline gboolean
+trace_row_intact(ViewerApp *app, uint64_t a) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t total = __atomic_load_n(&app->trace_total, __ATOMIC_ACQUIRE);
+    return a + trace_ring_len > total;
+}
+
+static void
+trace_export_csv(TraceIoJob *job, FILE *f) {
+    ViewerApp *app = (ViewerApp *)job->app;
+    uint64_t written = 0;
+
+    fprintf(f, "time,cnt0,min,max,mean,median,p10,p90\n");
+    for (uint64_t a = job->a_start; a < job->a_end; ++a) {
+        if ((a & 4095) == 0 && g_atomic_int_get(&job->cancel)) break;
+        int idx = (int)(a % trace_ring_len);
+        TraceChunk *chunk = TRACE_CHUNK(app, idx);
+        int off = idx % TRACE_CHUNK_SAMPLES;
+        double t = chunk->time[off];
+        uint64_t cnt0 = chunk->cnt0[off];
+        double v[6] = { chunk->min[off], chunk->max[off], chunk->mean[off],
+                        chunk->median[off], chunk->p01[off], chunk->p09[off] };
+        if (!trace_row_intact(app, a)) continue;
+        fprintf(f, "%.9f,%lu,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n", t, (unsigned long)cnt0,
+                v[0], v[1], v[2], v[3], v[4], v[5]);
+        written++;
+    }
+    job->nrows = written;
+}
+
+static void
+trace_export_binary(TraceIoJob *job, FILE *f) {
+    ViewerApp *app = (ViewerApp *)job->app;
+    uint64_t nrows = job->a_end - job->a_start;
+
+    TraceExportHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "IMTRCOL1", 8);
+    hdr.ncols = TRACE_EXPORT_COLS;
+    hdr.hist_bins = TRACE_HIST_BINS;
+    hdr.nrows = nrows;
+    uint64_t offset = sizeof(hdr);
+    for (int c = 0; c < TRACE_EXPORT_COLS; ++c) {
+        snprintf(hdr.cols[c].name, sizeof(hdr.cols[c].name), "%s", trace_columns[c].name);
+        hdr.cols[c].type = trace_columns[c].type;
+        hdr.cols[c].width = trace_columns[c].width;
+        hdr.cols[c].offset = offset;
+        offset += nrows * trace_columns[c].width;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    // Each column straight from the ring, one contiguous run per chunk
+    for (int c = 0; c < TRACE_EXPORT_COLS; ++c) {
+        uint64_t a = job->a_start;
+        while (a < job->a_end) {
+            if (g_atomic_int_get(&job->cancel)) return;
+            int idx = (int)(a % trace_ring_len);
+            int off = idx % TRACE_CHUNK_SAMPLES;
+            uint64_t run = TRACE_CHUNK_SAMPLES - off;
+            if (run > (uint64_t)(trace_ring_len - idx)) run = trace_ring_len - idx;
+            if (run > job->a_end - a) run = job->a_end - a;
+            fwrite(trace_column_at(TRACE_CHUNK(app, idx), c, off), trace_columns[c].width, run, f);
+            a += run;
+        }
+    }
+
+    // Rows whose slot was reused before the last column pass are flagged, not rewritten
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t total = __atomic_load_n(&app->trace_total, __ATOMIC_ACQUIRE);
+    uint64_t first_valid = total >= trace_ring_len ? total - trace_ring_len + 1 : 0;
+    if (first_valid > job->a_start) {
+        hdr.first_row = first_valid - job->a_start;
+        if (hdr.first_row > nrows) hdr.first_row = nrows;
+        fseek(f, 0, SEEK_SET);
+        fwrite(&hdr, sizeof(hdr), 1, f);
+    }
+    job->nrows = nrows - hdr.first_row;
+}
+
+// Read an export back into freshly allocated ring chunks (newest trace_ring_len rows)
+static void
+trace_import_binary(TraceIoJob *job, FILE *f) {
+    TraceExportHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, "IMTRCOL1", 8) != 0 ||
+        hdr.hist_bins != TRACE_HIST_BINS || hdr.ncols > TRACE_EXPORT_COLS || hdr.first_row > hdr.nrows) {
+        snprintf(job->msg, sizeof(job->msg), "Not a trace export");
+        return;
+    }
+
+    uint64_t first = hdr.first_row;
+    uint64_t n = hdr.nrows - first;
+    if (n > trace_ring_len) {
+        first += n - trace_ring_len;
+        n = trace_ring_len;
+    }
+    if (n == 0) {
+        snprintf(job->msg, sizeof(job->msg), "Trace export is empty");
+        return;
+    }
+
+    job->chunks = (TraceChunk**)calloc(TRACE_NUM_CHUNKS, sizeof(TraceChunk*));
+    if (!job->chunks) return;
+    for (uint64_t c = 0; c * TRACE_CHUNK_SAMPLES < n; ++c) {
+        job->chunks[c] = (TraceChunk*)big_alloc(sizeof(TraceChunk), FALSE);
+        if (!job->chunks[c]) {
+            snprintf(job->msg, sizeof(job->msg), "Out of memory");
+            return;
+        }
+    }
+
+    // Columns are matched by name; unknown ones are skipped, missing ones stay zero
+    for (uint32_t fc = 0; fc < hdr.ncols; ++fc) {
+        int c = -1;
+        for (int k = 0; k < TRACE_EXPORT_COLS; ++k) {
+            if (strncmp(hdr.cols[fc].name, trace_columns[k].name, sizeof(hdr.cols[fc].name)) == 0 &&
+                hdr.cols[fc].width == trace_columns[k].width) c = k;
+        }
+        if (c < 0) continue;
+
+        if (fseek(f, (long)(hdr.cols[fc].offset + first * hdr.cols[fc].width), SEEK_SET) != 0) return;
+        for (uint64_t r = 0; r < n;) {
+            if (g_atomic_int_get(&job->cancel)) return;
+            int off = (int)(r % TRACE_CHUNK_SAMPLES);
+            uint64_t run = TRACE_CHUNK_SAMPLES - off;
+            if (run > n - r) run = n - r;
+            if (fread(trace_column_at(job->chunks[r / TRACE_CHUNK_SAMPLES], c, off), trace_columns[c].width, run, f) != run) {
+                snprintf(job->msg, sizeof(job->msg), "Trace export is truncated");
+                return;
+            }
+            r += run;
+        }
+    }
+
+    for (uint64_t r = 0; r < n; ++r)
+        trace_pyr_update(job->chunks[r / TRACE_CHUNK_SAMPLES], (int)(r % TRACE_CHUNK_SAMPLES));
+
+    job->nrows = n;
+    job->ok = TRUE;
+}
+
+static void
+trace_io_free(TraceIoJob *job) {
+    if (job->chunks) {
+        for (int c = 0; c < TRACE_NUM_CHUNKS; ++c) big_free(job->chunks[c], sizeof(TraceChunk));
+        free(job->chunks);
+    }
+    free(job->path);
+    free(job);
+}
+
+static gboolean
+trace_io_done(gpointer user_data) {
+    TraceIoJob *job = (TraceIoJob *)user_data;
+    ViewerApp *app = (ViewerApp *)job->app;
+    if (job->thread) g_thread_join(job->thread);
+
+    if (job->import && job->ok) {
+        // Replace the ring with the imported samples and stop appending live ones
+        trace_release(app);
+        memcpy(app->trace_chunks, job->chunks, TRACE_NUM_CHUNKS * sizeof(TraceChunk*));
+        for (int c = 0; c < TRACE_NUM_CHUNKS; ++c)
+            if (app->trace_chunks[c]) app->trace_bytes += sizeof(TraceChunk);
+        free(job->chunks);
+        job->chunks = NULL;
+
+        app->trace_count = (int)job->nrows;
+        app->trace_head = app->trace_count % trace_ring_len;
+        app->trace_total = job->nrows;
+        app->trace_frozen = TRUE;
+        update_trace_mem_label(app);
+        gtk_check_button_set_active(GTK_CHECK_BUTTON(app->check_trace), TRUE);
+        gtk_widget_queue_draw(app->trace_area);
+    }
+
+    if (app->lbl_trace_io) gtk_label_set_text(GTK_LABEL(app->lbl_trace_io), job->msg);
+    app->trace_io = NULL;
+    trace_io_free(job);
+    return G_SOURCE_REMOVE;
+}
+
+// At exit the main loop no longer runs trace_io_done: stop the worker, drop the
+// handoff it queued and free the job with any chunks it imported
+static void
+trace_io_shutdown(ViewerApp *app) {
+    TraceIoJob *job = app->trace_io;
+    if (!job) return;
+    trace_io_cancel(app);
+    g_idle_remove_by_data(job);
+    app->trace_io = NULL;
+    trace_io_free(job);
+}
+
+static gpointer
+trace_io_worker(gpointer data) {
+    TraceIoJob *job = (TraceIoJob *)data;
+    FILE *f = fopen(job->path, job->import ? "rb" : "wb");
+
+    if (!f) {
+        snprintf(job->msg, sizeof(job->msg), "Cannot open %s", job->path);
+    } else {
+        if (job->import) trace_import_binary(job, f);
+        else if (job->csv) trace_export_csv(job, f);
+        else trace_export_binary(job, f);
+
+        if (!job->import) job->ok = !ferror(f);
+        if (fclose(f) != 0 && !job->import) job->ok = FALSE;
+
+        if (g_atomic_int_get(&job->cancel)) {
+            job->ok = FALSE;
+            snprintf(job->msg, sizeof(job->msg), "Cancelled");
+        } else if (job->ok) {
+            snprintf(job->msg, sizeof(job->msg), "%s %lu samples", job->import ? "Imported" : "Exported",
+                     (unsigned long)job->nrows);
+        } else if (!job->msg[0]) {
+            snprintf(job->msg, sizeof(job->msg), "%s failed", job->import ? "Import" : "Export");
+        }
+    }
+
+    g_idle_add(trace_io_done, job);
+    return NULL;
+}
+
+static void
+trace_io_start(ViewerApp *app, gboolean import) {
+    const char *msg = NULL;
+    if (app->trace_io) msg = "Busy";
+    else if (app->trace_view) msg = "Not available while browsing a trace file";
+    else if (!import && app->trace_count == 0) msg = "Trace is empty";
+    if (msg) {
+        gtk_label_set_text(GTK_LABEL(app->lbl_trace_io), msg);
+        return;
+    }
+
+    const char *path = gtk_editable_get_text(GTK_EDITABLE(app->entry_trace_file));
+    if (!path || !path[0]) return;
+
+    TraceIoJob *job = (TraceIoJob*)calloc(1, sizeof(TraceIoJob));
+    if (!job) return;
+    job->app = app;
+    job->path = strdup(path);
+    job->import = import;
+    job->csv = gtk_check_button_get_active(GTK_CHECK_BUTTON(app->check_trace_csv));
+    job->a_end = app->trace_total;
+    job->a_start = app->trace_total - app->trace_count;
+
+    app->trace_io = job;
+    gtk_label_set_text(GTK_LABEL(app->lbl_trace_io), import ? "Importing..." : "Exporting...");
+    job->thread = g_thread_new("trace-io", trace_io_worker, job);
+}
+
+static void
+on_trace_export_clicked (GtkButton *btn, gpointer user_data)
+{
+    trace_io_start((ViewerApp *)user_data, FALSE);
+}
+
+static void
+on_trace_import_clicked (GtkButton *btn, gpointer user_data)
+{
+    trace_io_start((ViewerApp *)user_data, TRUE);
+}
+
+static void
+update_trace_clock_label(ViewerApp *app) {
+    if (!app->lbl_trace_clock) return;
+    gtk_label_set_text(GTK_LABEL(app->lbl_trace_clock), app->trace_time_producer ? "producer clock" : "local clock");
 }
 
 static void
 update_trace_data(ViewerApp *app, uint64_t cnt0, double min, double max, double mean, double median, double p01, double p09,
                   uint32_t *hist, double hist_min, double hist_max) {
-    if (!app->trace_active) return;
+    if (!app->trace_active || app->trace_view || app->trace_frozen) return;
 
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    gboolean producer = app->current_frame_time_valid;
+    double abs_t;
+    if (producer) {
+        abs_t = app->current_frame_time.tv_sec + app->current_frame_time.tv_nsec / 1e9;
+    } else {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        abs_t = now.tv_sec + now.tv_nsec / 1e9;
+    }
+
+    // Anchor time 0 on the first sample; on a base switch, continue from the last sample
+    if (app->trace_count == 0 || producer != app->trace_time_producer) {
+        app->trace_t0 = abs_t - (app->trace_count > 0 ? app->trace_last_t : 0.0);
+        app->trace_time_producer = producer;
+        update_trace_clock_label(app);
+    }
 
-    double t = (now.tv_sec - app->trace_start_time.tv_sec) +
-               (now.tv_nsec - app->trace_start_time.tv_nsec) / 1e9;
+    // Keep the ring monotonic for the binary searches
+    double t = abs_t - app->trace_t0;
+    if (app->trace_count > 0 && t < app->trace_last_t) t = app->trace_last_t;
+    app->trace_last_t = t;
 
     int idx = app->trace_head;
-    app->trace_time[idx] = t;
-    app->trace_cnt0[idx] = cnt0;
-    app->trace_min[idx] = min;
-    app->trace_max[idx] = max;
-    app->trace_mean[idx] = mean;
-    app->trace_median[idx] = median;
-    app->trace_p01[idx] = p01;
-    app->trace_p09[idx] = p09;
+    if (!TRACE_CHUNK(app, idx)) {
+        TRACE_CHUNK(app, idx) = (TraceChunk*)big_alloc(sizeof(TraceChunk), FALSE);
+        if (!TRACE_CHUNK(app, idx)) return;
+        app->trace_bytes += sizeof(TraceChunk);
+        update_trace_mem_label(app);
+    }
+
+    TRACE_AT(app, time, idx) = t;
+    TRACE_AT(app, cnt0, idx) = cnt0;
+    TRACE_AT(app, min, idx) = min;
+    TRACE_AT(app, max, idx) = max;
+    TRACE_AT(app, mean, idx) = mean;
+    TRACE_AT(app, median, idx) = median;
+    TRACE_AT(app, p01, idx) = p01;
+    TRACE_AT(app, p09, idx) = p09;
 
     if (hist) {
-        memcpy(app->trace_hist_data + idx * TRACE_HIST_BINS, hist, TRACE_HIST_BINS * sizeof(uint32_t));
-        app->trace_hist_min[idx] = hist_min;
-        app->trace_hist_max[idx] = hist_max;
+        uint8_t *codes = TRACE_HIST_AT(app, idx);
+        for (int b = 0; b < TRACE_HIST_BINS; ++b) codes[b] = trace_hist_encode(hist[b]);
+        TRACE_AT(app, hist_min, idx) = hist_min;
+        TRACE_AT(app, hist_max, idx) = hist_max;
     } else {
-        memset(app->trace_hist_data + idx * TRACE_HIST_BINS, 0, TRACE_HIST_BINS * sizeof(uint32_t));
-        app->trace_hist_min[idx] = 0;
-        app->trace_hist_max[idx] = 1;
+        memset(TRACE_HIST_AT(app, idx), 0, TRACE_HIST_BINS);
+        TRACE_AT(app, hist_min, idx) = 0;
+        TRACE_AT(app, hist_max, idx) = 1;
     }
 
-    app->trace_head = (app->trace_head + 1) % TRACE_MAX_SAMPLES;
-    if (app->trace_count < TRACE_MAX_SAMPLES) app->trace_count++;
+    trace_pyr_update(TRACE_CHUNK(app, idx), idx % TRACE_CHUNK_SAMPLES);
+
+    if (app->trace_rec) trace_file_append(app->trace_rec, TRACE_CHUNK(app, idx), idx % TRACE_CHUNK_SAMPLES);
+
+    app->trace_head = (app->trace_head + 1) % trace_ring_len;
+    if (app->trace_count < trace_ring_len) app->trace_count++;
+    // Published after the sample so an export can tell which rows it may have lost
+    __atomic_store_n(&app->trace_total, app->trace_total + 1, __ATOMIC_RELEASE);
 
     if (app->trace_area && gtk_widget_get_visible(app->trace_area)) {
         gtk_widget_queue_draw(app->trace_area);
     }
+    if (app->psd_area && gtk_widget_get_visible(app->psd_area)) {
+        gtk_widget_queue_draw(app->psd_area);
+    }
+}
+
+static inline int
+trace_wf_ring_x(const TraceWaterfall *wf, long col) {
+    long x = col % wf->w;
+    return (int)(x < 0 ? x + wf->w : x);
+}
+
+// Render n samples from ring index first into waterfall columns [col_lo, col_hi).
+// Each sample spans up to the next one; the last sample given ends at col_hi.
+static void
+trace_wf_render(ViewerApp *app, int first, int n, long col_lo, long col_hi) {
+    TraceWaterfall *wf = &app->trace_wf;
+    if (col_hi - col_lo > wf->w) col_lo = col_hi - wf->w;
+    if (col_lo >= col_hi) return;
+
+    cairo_surface_flush(wf->surf);
+    uint32_t *pixels = (uint32_t*)cairo_image_surface_get_data(wf->surf);
+    int stride = cairo_image_surface_get_stride(wf->surf) / 4;
+    int h = wf->h;
+    double scale = wf->w / wf->duration;
+    double min_y = wf->min_y, max_y = wf->max_y;
+
+    for (long c = col_lo; c < col_hi; ++c) {
+        int x = trace_wf_ring_x(wf, c);
+        for (int y = 0; y < h; ++y) pixels[y * stride + x] = 0;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        int idx = (first + i) % trace_ring_len;
+        long c0 = (long)floor(TRACE_AT(app, time, idx) * scale);
+        long c1 = col_hi;
+        if (i < n - 1) c1 = (long)floor(TRACE_AT(app, time, (idx + 1) % trace_ring_len) * scale);
+        if (c1 < c0 + 1) c1 = c0 + 1; // Ensure at least 1 pixel
+        if (c0 < col_lo) c0 = col_lo;
+        if (c1 > col_hi) c1 = col_hi;
+        if (c0 >= c1) continue;
+
+        double h_min = TRACE_AT(app, hist_min, idx);
+        double h_max = TRACE_AT(app, hist_max, idx);
+        double h_range = h_max - h_min;
+        if (h_range <= 0) h_range = 1.0;
+
+        // Codes are monotonic in count, so the largest code is the column max
+        const uint8_t *codes = TRACE_HIST_AT(app, idx);
+        uint8_t code_max = 0;
+        for (int b = 0; b < TRACE_HIST_BINS; b++) if (codes[b] > code_max) code_max = codes[b];
+        float inv_log_max = code_max ? 1.0f / trace_hist_log_lut[code_max] : 0.0f;
+
+        for (int y = 0; y < h; ++y) {
+            // Map Y to Value, then Value to Bin
+            double val = max_y - (double)y / h * (max_y - min_y);
+            int bin = (int)((val - h_min) / h_range * TRACE_HIST_BINS);
+            if (bin == TRACE_HIST_BINS && val <= h_max) bin = TRACE_HIST_BINS - 1;
+            if (bin < 0 || bin >= TRACE_HIST_BINS || codes[bin] == 0) continue;
+
+            double brightness = trace_hist_log_lut[codes[bin]] * inv_log_max;
+
+            uint8_t br, bg, bb;
+            if (wf->highlight_active) {
+                if (val < wf->highlight_val) {
+                    // Blueish
+                    br = (uint8_t)(brightness * 50);
+                    bg = (uint8_t)(brightness * 50);
+                    bb = (uint8_t)(brightness * 255);
+                } else {
+                    // Reddish
+                    br = (uint8_t)(brightness * 255);
+                    bg = (uint8_t)(brightness * 50);
+                    bb = (uint8_t)(brightness * 50);
+                }
+            } else {
+                // Grey scale
+                uint8_t v = (uint8_t)(brightness * 255.0);
+                br = v; bg = v; bb = v;
+            }
+
+            // Apply Thresholds Override
+            if (wf->thresholds_enabled) {
+                if (val > wf->thresh_max_val) {
+                    br = 255; bg = 0; bb = 0; // Bright Red
+                } else if (val < wf->thresh_min_val) {
+                    br = 0; bg = 0; bb = 255; // Bright Blue
+                }
+            }
+
+            uint32_t px = (255u << 24) | (br << 16) | (bg << 8) | bb;
+            for (long c = c0; c < c1; ++c) pixels[y * stride + trace_wf_ring_x(wf, c)] = px;
+        }
+    }
+
+    cairo_surface_mark_dirty(wf->surf);
+}
+
+// Bring the waterfall up to date: render only columns for samples appended since
+// the last call, or rebuild it when the size, span, coloring changed or the value
+// range moved by at least one pixel row.
+static void
+trace_wf_update(ViewerApp *app, int width, int height, int start_idx, int visible_count,
+                double min_y, double max_y) {
+    TraceWaterfall *wf = &app->trace_wf;
+    int head = app->trace_head;
+    int newest = (head - 1 + trace_ring_len) % trace_ring_len;
+    long col = (long)floor(TRACE_AT(app, time, newest) * width / app->trace_duration);
+    int n_new = (head - wf->head + trace_ring_len) % trace_ring_len;
+
+    // Autoscale smooths the range every frame; only a shift of a full pixel row
+    // at either end is visible, so smaller drift keeps the stored range.
+    double rows_per_unit = max_y > min_y ? height / (max_y - min_y) : 0;
+    gboolean range_moved = fabs(wf->min_y - min_y) * rows_per_unit >= 1.0 ||
+                           fabs(wf->max_y - max_y) * rows_per_unit >= 1.0 ||
+                           (max_y > min_y) != (wf->max_y > wf->min_y);
+
+    gboolean rebuild = !wf->surf || wf->w != width || wf->h != height ||
+                       wf->duration != app->trace_duration || range_moved ||
+                       wf->highlight_active != app->highlight_active ||
+                       (app->highlight_active && wf->highlight_val != app->highlight_val) ||
+                       wf->thresholds_enabled != app->thresholds_enabled ||
+                       (app->thresholds_enabled && (wf->thresh_min_val != app->thresh_min_val ||
+                                                    wf->thresh_max_val != app->thresh_max_val)) ||
+                       app->trace_count < wf->count || col < wf->col || col - wf->col >= width;
+
+    if (rebuild) {
+        if (!wf->surf || wf->w != width || wf->h != height) {
+            if (wf->surf) cairo_surface_destroy(wf->surf);
+            wf->surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+            wf->w = width;
+            wf->h = height;
+        }
+        wf->duration = app->trace_duration;
+        wf->min_y = min_y;
+        wf->max_y = max_y;
+        wf->highlight_active = app->highlight_active;
+        wf->highlight_val = app->highlight_val;
+        wf->thresholds_enabled = app->thresholds_enabled;
+        wf->thresh_min_val = app->thresh_min_val;
+        wf->thresh_max_val = app->thresh_max_val;
+        trace_wf_render(app, start_idx, visible_count, col - width, col);
+    } else if (n_new > 0) {
+        // The previous newest sample now extends up to its successor
+        int prev = (wf->head - 1 + trace_ring_len) % trace_ring_len;
+        trace_wf_render(app, prev, n_new + 1, wf->col, col);
+    }
+
+    wf->col = col;
+    wf->head = head;
+    wf->count = app->trace_count;
+}
+
+// Draw one curve over count samples from ring index start. Uses the coarsest
+// pyramid blocks no wider than samples_per_px, so the path has ~2 points per pixel.
+static void
+draw_trace_curve(cairo_t *cr, ViewerApp *app, int curve, int start, int count,
+                 double samples_per_px, double t0, double x_scale,
+                 double min_y, double y_scale, int plot_height) {
+    int level = 0;
+    while (level < TRACE_PYR_LEVELS && (double)(4 << (2 * level)) <= samples_per_px) level++;
+
+    int pos = start;
+    int remaining = count;
+    gboolean first = TRUE;
+
+    while (remaining > 0) {
+        TraceChunk *chunk = TRACE_CHUNK(app, pos);
+        int off = pos % TRACE_CHUNK_SAMPLES;
+        int chunk_len = trace_ring_len - (pos - off);
+        if (chunk_len > TRACE_CHUNK_SAMPLES) chunk_len = TRACE_CHUNK_SAMPLES;
+
+        int l = level;
+        int span = 1;
+        while (l > 0) {
+            int bs = 1 << (2 * l);
+            span = chunk_len - off < bs ? chunk_len - off : bs;
+            if ((off & (bs - 1)) == 0 && span <= remaining) break;
+            l--;
+        }
+
+        double x = (chunk->time[off] - t0) * x_scale;
+        if (l == 0) {
+            span = 1;
+            double y = plot_height - (trace_curve_raw(chunk, curve)[off] - min_y) * y_scale;
+            if (first) cairo_move_to(cr, x, y);
+            else cairo_line_to(cr, x, y);
+        } else {
+            int node = trace_pyr_offset[l] + (off >> (2 * l));
+            double x_end = (chunk->time[off + span - 1] - t0) * x_scale;
+            double y_lo = plot_height - (chunk->pyr_lo[curve][node] - min_y) * y_scale;
+            double y_hi = plot_height - (chunk->pyr_hi[curve][node] - min_y) * y_scale;
+            if (first) cairo_move_to(cr, x, y_lo);
+            else cairo_line_to(cr, x, y_lo);
+            cairo_line_to(cr, x_end, y_hi);
+        }
+        first = FALSE;
+
+        remaining -= span;
+        pos = (pos + span) % trace_ring_len;
+    }
+    cairo_stroke(cr);
 }
 
 static void
@@ -3072,125 +8216,44 @@ draw_trace_func (GtkDrawingArea *area,
     // Determine Time Range
     int head = app->trace_head;
     int count = app->trace_count;
-    int tail = (head - count + TRACE_MAX_SAMPLES) % TRACE_MAX_SAMPLES;
+    int tail = (head - count + trace_ring_len) % trace_ring_len;
 
-    double t_end = app->trace_time[(head - 1 + TRACE_MAX_SAMPLES) % TRACE_MAX_SAMPLES];
+    double t_end = TRACE_AT(app, time, (head - 1 + trace_ring_len) % trace_ring_len);
     double t_start_req = t_end - app->trace_duration;
 
     // Determine Value Range (Y axis) - Match Histogram Display Range
     double min_y = app->current_min;
     double max_y = app->current_max;
 
-    // Iterating to find start index
-    int start_idx = tail;
-    int visible_count = 0;
-
-    for (int i = 0; i < count; ++i) {
-        int idx = (tail + i) % TRACE_MAX_SAMPLES;
-        if (app->trace_time[idx] >= t_start_req) {
-            if (visible_count == 0) start_idx = idx;
-            visible_count++;
-        }
-    }
+    // First visible sample
+    int first = trace_lower_bound(app, t_start_req);
+    int start_idx = (tail + first) % trace_ring_len;
+    int visible_count = count - first;
 
     if (visible_count < 2) return;
 
-    // Draw Heatmap
-    cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, plot_height);
-    uint32_t *pixels = (uint32_t*)cairo_image_surface_get_data(surf);
-    int stride = cairo_image_surface_get_stride(surf) / 4;
-
-    // Clear surface
-    memset(pixels, 0, plot_height * stride * 4);
-
-    double time_scale = width / app->trace_duration;
-    double t_start_disp = t_end - app->trace_duration;
-
-    // Iterate visible samples
-    for (int i = 0; i < visible_count; ++i) {
-        int idx = (start_idx + i) % TRACE_MAX_SAMPLES;
-        double t = app->trace_time[idx];
-        int x0 = (int)((t - t_start_disp) * time_scale);
-
-        // Calculate width to next sample
-        int x1 = width;
-        if (i < visible_count - 1) {
-            int next_idx = (idx + 1) % TRACE_MAX_SAMPLES;
-            double t_next = app->trace_time[next_idx];
-            x1 = (int)((t_next - t_start_disp) * time_scale);
-        }
-
-        int w = x1 - x0;
-        if (w < 1) w = 1; // Ensure at least 1 pixel
-        if (x0 >= width) continue;
-        if (x0 + w > width) w = width - x0;
-
-        double h_min = app->trace_hist_min[idx];
-        double h_max = app->trace_hist_max[idx];
-        double h_range = h_max - h_min;
-        if (h_range <= 0) h_range = 1.0;
-
-        uint32_t *hist = app->trace_hist_data + idx * TRACE_HIST_BINS;
-
-        uint32_t col_max = 0;
-        for (int b=0; b<TRACE_HIST_BINS; b++) if (hist[b] > col_max) col_max = hist[b];
-        if (col_max == 0) col_max = 1;
-
-        // Draw column(s)
-        for (int dx = 0; dx < w; dx++) {
-            int x = x0 + dx;
-            if (x < 0 || x >= width) continue;
-
-            for (int y = 0; y < plot_height; ++y) {
-                // Map Y to Value
-                double val = max_y - (double)y / plot_height * (max_y - min_y);
-
-                // Map Value to Bin
-                int bin = (int)((val - h_min) / h_range * (TRACE_HIST_BINS - 1));
-
-                if (bin >= 0 && bin < TRACE_HIST_BINS) {
-                    uint32_t c = hist[bin];
-                    if (c > 0) {
-                        double brightness = log10(c + 1) / log10(col_max + 1);
-
-                        uint8_t br, bg, bb;
-                        if (app->highlight_active) {
-                            if (val < app->highlight_val) {
-                                // Blueish
-                                br = (uint8_t)(brightness * 50);
-                                bg = (uint8_t)(brightness * 50);
-                                bb = (uint8_t)(brightness * 255);
-                            } else {
-                                // Reddish
-                                br = (uint8_t)(brightness * 255);
-                                bg = (uint8_t)(brightness * 50);
-                                bb = (uint8_t)(brightness * 50);
-                            }
-                        } else {
-                            // Grey scale
-                            uint8_t v = (uint8_t)(brightness * 255.0);
-                            br = v; bg = v; bb = v;
-                        }
-
-                        // Apply Thresholds Override
-                        if (app->thresholds_enabled) {
-                            if (val > app->thresh_max_val) {
-                                br = 255; bg = 0; bb = 0; // Bright Red
-                            } else if (val < app->thresh_min_val) {
-                                br = 0; bg = 0; bb = 255; // Bright Blue
-                            }
-                        }
-
-                        pixels[y * stride + x] = (255 << 24) | (br << 16) | (bg << 8) | bb;
-                    }
-                }
-            }
+    // Draw Heatmap (ring surface, oldest visible column first)
+    trace_wf_update(app, width, plot_height, start_idx, visible_count, min_y, max_y);
+    if (app->trace_wf.surf) {
+        int split = trace_wf_ring_x(&app->trace_wf, app->trace_wf.col);
+        cairo_save(cr);
+        cairo_rectangle(cr, 0, 0, width - split, plot_height);
+        cairo_clip(cr);
+        cairo_set_source_surface(cr, app->trace_wf.surf, -split, 0);
+        cairo_paint(cr);
+        cairo_restore(cr);
+        if (split > 0) {
+            cairo_save(cr);
+            cairo_rectangle(cr, width - split, 0, split, plot_height);
+            cairo_clip(cr);
+            cairo_set_source_surface(cr, app->trace_wf.surf, width - split, 0);
+            cairo_paint(cr);
+            cairo_restore(cr);
         }
     }
 
-    cairo_set_source_surface(cr, surf, 0, 0);
-    cairo_paint(cr);
-    cairo_surface_destroy(surf);
+    double time_scale = width / app->trace_duration;
+    double t_start_disp = t_end - app->trace_duration;
 
     // Draw X-Axis Time Labels
     cairo_set_source_rgb(cr, 1, 1, 1);
@@ -3201,6 +8264,7 @@ draw_trace_func (GtkDrawingArea *area,
     if (app->trace_duration > 60) label_step = 30.0;
     if (app->trace_duration > 300) label_step = 60.0;
     if (app->trace_duration > 1800) label_step = 300.0;
+    if (app->trace_duration > 14400) label_step = 3600.0;
 
     // Labels are relative to now (t_end), moving backwards
     // 0, -10, -20 ... down to -duration
@@ -3245,88 +8309,56 @@ draw_trace_func (GtkDrawingArea *area,
         }
     }
 
+    double samples_per_px = (double)visible_count / width;
+    double x_scale = width / app->trace_duration;
+    double y_scale = plot_height / (max_y - min_y);
+
     // Max - Dark Red
     if (app->show_trace_max) {
         cairo_set_source_rgb(cr, 0.5, 0, 0);
-        for (int i = 0; i < visible_count; ++i) {
-            int idx = (start_idx + i) % TRACE_MAX_SAMPLES;
-            double x = MAP_X(app->trace_time[idx]);
-            double y = MAP_Y(app->trace_max[idx]);
-            if (i==0) cairo_move_to(cr, x, y);
-            else cairo_line_to(cr, x, y);
-        }
-        cairo_stroke(cr);
+        draw_trace_curve(cr, app, TRACE_CURVE_MAX, start_idx, visible_count, samples_per_px,
+                         t_start_disp, x_scale, min_y, y_scale, plot_height);
     }
 
     // Min - Dark Blue
     if (app->show_trace_min) {
         cairo_set_source_rgb(cr, 0, 0, 0.5);
-        for (int i = 0; i < visible_count; ++i) {
-            int idx = (start_idx + i) % TRACE_MAX_SAMPLES;
-            double x = MAP_X(app->trace_time[idx]);
-            double y = MAP_Y(app->trace_min[idx]);
-            if (i==0) cairo_move_to(cr, x, y);
-            else cairo_line_to(cr, x, y);
-        }
-        cairo_stroke(cr);
+        draw_trace_curve(cr, app, TRACE_CURVE_MIN, start_idx, visible_count, samples_per_px,
+                         t_start_disp, x_scale, min_y, y_scale, plot_height);
     }
 
     // Mean - Green
     if (app->show_trace_mean) {
         cairo_set_source_rgb(cr, 0, 1, 0);
-        for (int i = 0; i < visible_count; ++i) {
-            int idx = (start_idx + i) % TRACE_MAX_SAMPLES;
-            double x = MAP_X(app->trace_time[idx]);
-            double y = MAP_Y(app->trace_mean[idx]);
-            if (i==0) cairo_move_to(cr, x, y);
-            else cairo_line_to(cr, x, y);
-        }
-        cairo_stroke(cr);
+        draw_trace_curve(cr, app, TRACE_CURVE_MEAN, start_idx, visible_count, samples_per_px,
+                         t_start_disp, x_scale, min_y, y_scale, plot_height);
     }
 
     // Median - Yellow
     if (app->show_trace_median) {
         cairo_set_source_rgb(cr, 1, 1, 0);
-        for (int i = 0; i < visible_count; ++i) {
-            int idx = (start_idx + i) % TRACE_MAX_SAMPLES;
-            double x = MAP_X(app->trace_time[idx]);
-            double y = MAP_Y(app->trace_median[idx]);
-            if (i==0) cairo_move_to(cr, x, y);
-            else cairo_line_to(cr, x, y);
-        }
-        cairo_stroke(cr);
+        draw_trace_curve(cr, app, TRACE_CURVE_MEDIAN, start_idx, visible_count, samples_per_px,
+                         t_start_disp, x_scale, min_y, y_scale, plot_height);
     }
 
     // p10 - Cyan
     if (app->show_trace_p01) {
         cairo_set_source_rgb(cr, 0, 1, 1);
-        for (int i = 0; i < visible_count; ++i) {
-            int idx = (start_idx + i) % TRACE_MAX_SAMPLES;
-            double x = MAP_X(app->trace_time[idx]);
-            double y = MAP_Y(app->trace_p01[idx]);
-            if (i==0) cairo_move_to(cr, x, y);
-            else cairo_line_to(cr, x, y);
-        }
-        cairo_stroke(cr);
+        draw_trace_curve(cr, app, TRACE_CURVE_P01, start_idx, visible_count, samples_per_px,
+                         t_start_disp, x_scale, min_y, y_scale, plot_height);
     }
 
     // p90 - Magenta
     if (app->show_trace_p09) {
         cairo_set_source_rgb(cr, 1, 0, 1);
-        for (int i = 0; i < visible_count; ++i) {
-            int idx = (start_idx + i) % TRACE_MAX_SAMPLES;
-            double x = MAP_X(app->trace_time[idx]);
-            double y = MAP_Y(app->trace_p09[idx]);
-            if (i==0) cairo_move_to(cr, x, y);
-            else cairo_line_to(cr, x, y);
-        }
-        cairo_stroke(cr);
+        draw_trace_curve(cr, app, TRACE_CURVE_P09, start_idx, visible_count, samples_per_px,
+                         t_start_disp, x_scale, min_y, y_scale, plot_height);
     }
 
     // Draw Cursor Line (Vertical) when Update is OFF
     if (app->trace_cursor_active && !gtk_check_button_get_active(GTK_CHECK_BUTTON(app->btn_stats_update))) {
         int idx = app->trace_cursor_idx;
-        double t = app->trace_time[idx];
+        double t = TRACE_AT(app, time, idx);
         double x = MAP_X(t);
 
         if (x >= 0 && x <= width) {
@@ -3364,6 +8396,300 @@ draw_trace_func (GtkDrawingArea *area,
     }
 }
 
+// Trace PSD
+
+static void
+real_fft_free(RealFft *f) {
+    free(f->rev);
+    free(f->tw_re);
+    free(f->tw_im);
+    free(f->window);
+    free(f->z_re);
+    free(f->z_im);
+    memset(f, 0, sizeof(*f));
+}
+
+static gboolean
+real_fft_init(RealFft *f, int n) {
+    if (f->n == n) return TRUE;
+    real_fft_free(f);
+
+    int m = n / 2;
+    f->rev = (int*)malloc(m * sizeof(int));
+    f->tw_re = (float*)malloc(m * sizeof(float));
+    f->tw_im = (float*)malloc(m * sizeof(float));
+    f->window = (float*)malloc(n * sizeof(float));
+    f->z_re = (float*)malloc(m * sizeof(float));
+    f->z_im = (float*)malloc(m * sizeof(float));
+    if (!f->rev || !f->tw_re || !f->tw_im || !f->window || !f->z_re || !f->z_im) {
+        real_fft_free(f);
+        return FALSE;
+    }
+
+    int bits = 0;
+    while ((1 << bits) < m) bits++;
+    for (int i = 0; i < m; ++i) {
+        int r = 0;
+        for (int b = 0; b < bits; ++b) if (i & (1 << b)) r |= 1 << (bits - 1 - b);
+        f->rev[i] = r;
+    }
+    for (int k = 0; k < m; ++k) {
+        f->tw_re[k] = (float)cos(-2.0 * M_PI * k / n);
+        f->tw_im[k] = (float)sin(-2.0 * M_PI * k / n);
+    }
+    f->window_pow = 0;
+    for (int i = 0; i < n; ++i) {
+        f->window[i] = (float)(0.5 - 0.5 * cos(2.0 * M_PI * i / n));
+        f->window_pow += (double)f->window[i] * f->window[i];
+    }
+    f->n = n;
+    return TRUE;
+}
+
+// Power |X[k]|^2, k = 0..n/2, of the windowed real signal x[0..n)
+static void
+real_fft_power(RealFft *f, const float *x, float *pow_out) {
+    int n = f->n, m = n / 2;
+    float *re = f->z_re, *im = f->z_im;
+
+    // Pack even/odd samples as one complex sequence, bit-reversed
+    for (int i = 0; i < m; ++i) {
+        int r = f->rev[i];
+        re[r] = x[2 * i] * f->window[2 * i];
+        im[r] = x[2 * i + 1] * f->window[2 * i + 1];
+    }
+
+    // Iterative radix-2; stage twiddle exp(-2 pi i j / len) = tw[j * n / len]
+    for (int len = 2; len <= m; len <<= 1) {
+        int half = len / 2, step = n / len;
+        for (int base = 0; base < m; base += len) {
+            for (int j = 0; j < half; ++j) {
+                float wr = f->tw_re[j * step], wi = f->tw_im[j * step];
+                int a = base + j, b = a + half;
+                float tr = re[b] * wr - im[b] * wi;
+                float ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr; im[b] = im[a] - ti;
+                re[a] += tr; im[a] += ti;
+            }
+        }
+    }
+
+    // Split into the spectrum of the real signal
+    pow_out[0] = (re[0] + im[0]) * (re[0] + im[0]);
+    pow_out[m] = (re[0] - im[0]) * (re[0] - im[0]);
+    for (int k = 1; k < m; ++k) {
+        float zr = re[k], zi = im[k];
+        float cr = re[m - k], ci = -im[m - k];
+        float er = 0.5f * (zr + cr), ei = 0.5f * (zi + ci);
+        float or_ = 0.5f * (zi - ci), oi = -0.5f * (zr - cr);
+        float xr = er + f->tw_re[k] * or_ - f->tw_im[k] * oi;
+        float xi = ei + f->tw_re[k] * oi + f->tw_im[k] * or_;
+        pow_out[k] = xr * xr + xi * xi;
+    }
+}
+
+static const int psd_lengths[] = {256, 512, 1024, 2048, 4096};
+
+static void
+psd_reset(ViewerApp *app) {
+    PsdState *psd = &app->psd;
+    psd->curve = app->dropdown_psd_curve ? (int)gtk_drop_down_get_selected(GTK_DROP_DOWN(app->dropdown_psd_curve)) : TRACE_CURVE_MEAN;
+    int n = app->dropdown_psd_len ? psd_lengths[gtk_drop_down_get_selected(GTK_DROP_DOWN(app->dropdown_psd_len))] : 1024;
+
+    memset(psd->seg_key, 0, sizeof(psd->seg_key));
+    if (psd->fft.n != n) {
+        free(psd->seg_pow);
+        free(psd->avg);
+        psd->seg_pow = NULL;
+        psd->avg = NULL;
+        if (!real_fft_init(&psd->fft, n)) return;
+        psd->seg_pow = (float*)malloc((size_t)PSD_MAX_SEGMENTS * (n / 2 + 1) * sizeof(float));
+        psd->avg = (double*)malloc((n / 2 + 1) * sizeof(double));
+        if (!psd->seg_pow || !psd->avg) real_fft_free(&psd->fft);
+    }
+}
+
+static void
+psd_free(PsdState *psd) {
+    real_fft_free(&psd->fft);
+    free(psd->seg_pow);
+    free(psd->avg);
+    psd->seg_pow = NULL;
+    psd->avg = NULL;
+}
+
+// Welch average over the segments inside the displayed duration; returns the
+// sample rate of those segments (0 if there are none) and the segment count
+static double
+psd_update(ViewerApp *app, int *out_nseg) {
+    PsdState *psd = &app->psd;
+    int n = psd->fft.n;
+    *out_nseg = 0;
+    if (n == 0 || app->trace_count < n) return 0;
+
+    int hop = n / 2, nbins = n / 2 + 1;
+    int head = app->trace_head, count = app->trace_count;
+    int tail = (head - count + trace_ring_len) % trace_ring_len;
+    uint64_t abs_tail = app->trace_total - count;
+
+    double t_end = TRACE_AT(app, time, (head - 1 + trace_ring_len) % trace_ring_len);
+    uint64_t abs_first = abs_tail + trace_lower_bound(app, t_end - app->trace_duration);
+    if (app->trace_total - abs_first < (uint64_t)n) return 0;
+
+    uint64_t q_first = (abs_first + hop - 1) / hop;
+    uint64_t q_last = (app->trace_total - n) / hop;
+    if (q_last < q_first) return 0;
+    if (q_last - q_first + 1 > PSD_MAX_SEGMENTS) q_first = q_last - PSD_MAX_SEGMENTS + 1;
+
+    float seg[4096];
+    for (int k = 0; k < nbins; ++k) psd->avg[k] = 0;
+
+    for (uint64_t q = q_first; q <= q_last; ++q) {
+        int slot = (int)(q % PSD_MAX_SEGMENTS);
+        float *pow_row = psd->seg_pow + (size_t)slot * nbins;
+        if (psd->seg_key[slot] != q + 1) {
+            // Transform a newly completed segment, mean removed
+            int first = (int)(q * hop - abs_tail);
+            double mean = 0;
+            for (int i = 0; i < n; ++i) {
+                int idx = (tail + first + i) % trace_ring_len;
+                seg[i] = (float)trace_curve_raw(TRACE_CHUNK(app, idx), psd->curve)[idx % TRACE_CHUNK_SAMPLES];
+                mean += seg[i];
+            }
+            mean /= n;
+            for (int i = 0; i < n; ++i) seg[i] -= (float)mean;
+
+            real_fft_power(&psd->fft, seg, pow_row);
+            for (int k = 0; k < nbins; ++k) pow_row[k] /= (float)psd->fft.window_pow;
+            psd->seg_key[slot] = q + 1;
+        }
+        for (int k = 0; k < nbins; ++k) psd->avg[k] += pow_row[k];
+    }
+
+    int nseg = (int)(q_last - q_first + 1);
+    for (int k = 0; k < nbins; ++k) psd->avg[k] /= nseg;
+    *out_nseg = nseg;
+
+    // Mean sample rate over the averaged samples
+    int i0 = (int)(q_first * hop - abs_tail);
+    int i1 = (int)(q_last * hop + n - 1 - abs_tail);
+    double span = TRACE_AT(app, time, (tail + i1) % trace_ring_len) -
+                  TRACE_AT(app, time, (tail + i0) % trace_ring_len);
+    return span > 0 ? (i1 - i0) / span : 0;
+}
+
+static void
+draw_psd_func (GtkDrawingArea *area,
+               cairo_t        *cr,
+               int             width,
+               int             height,
+               gpointer        user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+
+    cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+    cairo_paint(cr);
+
+    int nseg = 0;
+    double fs = psd_update(app, &nseg);
+    int margin_bottom = 20, margin_left = 40;
+    int plot_w = width - margin_left, plot_h = height - margin_bottom;
+
+    cairo_set_font_size(cr, 10);
+    cairo_select_font_face(cr, "Sans", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+
+    if (nseg == 0 || fs <= 0 || plot_w <= 0 || plot_h <= 0) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "PSD: need %d samples in range", app->psd.fft.n);
+        cairo_set_source_rgb(cr, 0.7, 0.7, 0.7);
+        cairo_move_to(cr, 5, 15);
+        cairo_show_text(cr, buf);
+        return;
+    }
+
+    // One-sided density (units^2 / Hz), shown on a log axis; DC bin skipped
+    int nbins = app->psd.fft.n / 2 + 1;
+    double lmin = 1e300, lmax = -1e300;
+    for (int k = 1; k < nbins; ++k) {
+        double d = app->psd.avg[k] * (k < nbins - 1 ? 2.0 : 1.0) / fs;
+        double l = log10(d > 1e-30 ? d : 1e-30);
+        app->psd.avg[k] = l;
+        if (l < lmin) lmin = l;
+        if (l > lmax) lmax = l;
+    }
+    lmin = floor(lmin);
+    lmax = ceil(lmax);
+    if (lmax <= lmin) lmax = lmin + 1;
+
+    #define PSD_X(k) (margin_left + (double)(k) / (nbins - 1) * plot_w)
+    #define PSD_Y(l) ((lmax - (l)) / (lmax - lmin) * plot_h)
+
+    // Decade grid
+    cairo_set_line_width(cr, 1);
+    for (double l = lmin; l <= lmax; l += 1.0) {
+        double y = PSD_Y(l);
+        cairo_set_source_rgb(cr, 0.25, 0.25, 0.25);
+        cairo_move_to(cr, margin_left, y);
+        cairo_line_to(cr, width, y);
+        cairo_stroke(cr);
+
+        char buf[16];
+        snprintf(buf, sizeof(buf), "1e%.0f", l);
+        cairo_set_source_rgb(cr, 1, 1, 1);
+        cairo_move_to(cr, 2, y + (l == lmax ? 10 : 0));
+        cairo_show_text(cr, buf);
+    }
+
+    cairo_set_source_rgb(cr, 0, 1, 0);
+    for (int k = 1; k < nbins; ++k) {
+        if (k == 1) cairo_move_to(cr, PSD_X(k), PSD_Y(app->psd.avg[k]));
+        else cairo_line_to(cr, PSD_X(k), PSD_Y(app->psd.avg[k]));
+    }
+    cairo_stroke(cr);
+
+    // Frequency axis
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    for (int i = 0; i <= 4; ++i) {
+        double f = fs / 2 * i / 4;
+        double x = margin_left + (double)i / 4 * plot_w;
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.3g Hz", f);
+        cairo_text_extents_t extents;
+        cairo_text_extents(cr, buf, &extents);
+        double tx = x - extents.width / 2;
+        if (tx + extents.width > width) tx = width - extents.width;
+        cairo_move_to(cr, tx, height - 5);
+        cairo_show_text(cr, buf);
+    }
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "fs %.4g Hz, %d segments", fs, nseg);
+    cairo_text_extents_t extents;
+    cairo_text_extents(cr, buf, &extents);
+    cairo_move_to(cr, width - extents.width - 5, 12);
+    cairo_show_text(cr, buf);
+
+    #undef PSD_X
+    #undef PSD_Y
+}
+
+static void
+on_psd_toggled (GtkCheckButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    gboolean on = gtk_check_button_get_active(btn);
+    if (on) psd_reset(app);
+    gtk_widget_set_visible(app->psd_area, on);
+}
+
+static void
+on_psd_settings_changed (GtkDropDown *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    psd_reset(app);
+    gtk_widget_queue_draw(app->psd_area);
+}
+
 static void
 on_trace_toggled (GtkCheckButton *btn, gpointer user_data)
 {
@@ -3371,8 +8697,13 @@ on_trace_toggled (GtkCheckButton *btn, gpointer user_data)
     app->trace_active = gtk_check_button_get_active(btn);
     gtk_widget_set_visible(app->trace_area, app->trace_active);
 
-    if (app->trace_active && app->trace_count == 0) {
-        clock_gettime(CLOCK_MONOTONIC, &app->trace_start_time);
+    if (!app->trace_active) trace_release(app);
+
+    if (app->trace_active && app->trace_view) {
+        trace_view_seek(app, trace_file_sample_at(app->trace_view,
+                                                  gtk_range_get_value(GTK_RANGE(app->scale_trace_view))));
+    } else if (app->trace_active && app->trace_count == 0) {
+        if (app->trace_rec) trace_file_begin_session(app->trace_rec);
     }
 }
 
@@ -3390,6 +8721,7 @@ on_trace_dur_entry_activate (GtkEntry *entry, gpointer user_data)
     gtk_editable_set_text(GTK_EDITABLE(entry), buf);
 
     if (app->trace_area) gtk_widget_queue_draw(app->trace_area);
+    if (app->psd_area) gtk_widget_queue_draw(app->psd_area);
 }
 
 static void
@@ -3401,6 +8733,7 @@ on_trace_dur_increase (GtkButton *btn, gpointer user_data)
     snprintf(buf, sizeof(buf), "%.1fs", app->trace_duration);
     gtk_editable_set_text(GTK_EDITABLE(app->entry_trace_dur), buf);
     gtk_widget_queue_draw(app->trace_area);
+    if (app->psd_area) gtk_widget_queue_draw(app->psd_area);
 }
 
 static void
@@ -3413,6 +8746,7 @@ on_trace_dur_decrease (GtkButton *btn, gpointer user_data)
     snprintf(buf, sizeof(buf), "%.1fs", app->trace_duration);
     gtk_editable_set_text(GTK_EDITABLE(app->entry_trace_dur), buf);
     gtk_widget_queue_draw(app->trace_area);
+    if (app->psd_area) gtk_widget_queue_draw(app->psd_area);
 }
 
 static void
@@ -3752,6 +9086,27 @@ draw_selection_func (GtkDrawingArea *area,
         cairo_restore(cr);
     }
 
+    // Draw Named ROIs
+    if (app->roi_set.nrois > 0) {
+        cairo_save(cr);
+        cairo_translate(cr, cx, cy);
+        cairo_scale(cr, scale, scale);
+        cairo_rotate(cr, app->rot_angle * (M_PI / 2.0));
+        cairo_scale(cr, app->flip_x ? -1.0 : 1.0, app->flip_y ? 1.0 : -1.0);
+        cairo_translate(cr, -app->img_width / 2.0, -app->img_height / 2.0);
+
+        cairo_set_line_width(cr, 1.5 / scale);
+        for (int r = 0; r < app->roi_set.nrois; ++r) {
+            Roi *roi = &app->roi_set.rois[r];
+            const double *c = roi_colors[r % 8];
+            cairo_set_source_rgb(cr, c[0], c[1], c[2]);
+            cairo_rectangle(cr, roi->x1, roi->y1, roi->x2 - roi->x1, roi->y2 - roi->y1);
+            cairo_stroke(cr);
+        }
+
+        cairo_restore(cr);
+    }
+
     // Draw Overlay Info (Stream Name + Frame Counter + FPS) always visible
     if (app->image) {
         char buf[512];
@@ -4066,25 +9421,30 @@ static int compare_uint32(const void *a, const void *b) {
     return (da > db) - (da < db);
 }
 
-// Helper to compute histogram
-static void compute_histogram(void *data, size_t count, int datatype, double min_val, double max_val, int bins, uint32_t *out_hist, uint32_t *out_max_count) {
+// Helper to compute histogram over a frame region.
+// Bin i covers [min + i*w, min + (i+1)*w) with w = range/bins; out-of-range
+// values are clamped to the first/last bin. Coarser histograms with a bin count
+// dividing `bins` can be derived exactly by summing adjacent bins.
+static void compute_histogram(const HistRegion *r, double min_val, double max_val, int bins, uint32_t *out_hist, uint32_t *out_max_count) {
     memset(out_hist, 0, bins * sizeof(uint32_t));
-    *out_max_count = 0;
 
     double range = max_val - min_val;
     if (range <= 0) range = 1.0;
+    double scale = bins / range;
 
     #define FILL_HIST_GENERIC(type) \
         { \
-            type *ptr = (type*)data; \
-            for(size_t i=0; i<count; ++i) { \
-                int bin = (int)(((double)ptr[i] - min_val) / range * (bins - 1)); \
-                if(bin < 0) bin = 0; if(bin >= bins) bin = bins-1; \
-                out_hist[bin]++; \
+            for (int y = r->y1; y < r->y2; ++y) { \
+                const type *ptr = (const type*)r->data + (size_t)y * r->width; \
+                for (int x = r->x1; x < r->x2; ++x) { \
+                    int bin = (int)(((double)ptr[x] - min_val) * scale); \
+                    if(bin < 0) bin = 0; if(bin >= bins) bin = bins-1; \
+                    out_hist[bin]++; \
+                } \
             } \
         }
 
-    switch(datatype) {
+    switch(r->datatype) {
         case _DATATYPE_FLOAT: FILL_HIST_GENERIC(float); break;
         case _DATATYPE_DOUBLE: FILL_HIST_GENERIC(double); break;
         case _DATATYPE_UINT8: FILL_HIST_GENERIC(uint8_t); break;
@@ -4094,33 +9454,32 @@ static void compute_histogram(void *data, size_t count, int datatype, double min
         case _DATATYPE_UINT32: FILL_HIST_GENERIC(uint32_t); break;
     }
 
-    for(int i=0; i<bins; ++i) {
-        if(out_hist[i] > *out_max_count) *out_max_count = out_hist[i];
+    if (out_max_count) {
+        *out_max_count = 0;
+        for(int i=0; i<bins; ++i) {
+            if(out_hist[i] > *out_max_count) *out_max_count = out_hist[i];
+        }
     }
 }
 
-// Refactored Helper for calculating limits from a buffer
-static void
-calculate_limits_from_buffer(void *data, size_t count, int datatype,
-                             int mode_min, int mode_max,
-                             double *out_min, double *out_max) {
-
-    if (mode_min == AUTO_MANUAL && mode_max == AUTO_MAX_MANUAL) return;
-
+static gboolean
+compute_region_extrema(const HistRegion *r, double *out_min, double *out_max) {
     double g_min = 1e30, g_max = -1e30;
 
     // Type-specific scan
     #define SCAN_MINMAX(type) \
         { \
-            type *ptr = (type*)data; \
-            for(size_t i=0; i<count; ++i) { \
-                double v = (double)ptr[i]; \
-                if(v < g_min) g_min = v; \
-                if(v > g_max) g_max = v; \
+            for (int y = r->y1; y < r->y2; ++y) { \
+                const type *ptr = (const type*)r->data + (size_t)y * r->width; \
+                for (int x = r->x1; x < r->x2; ++x) { \
+                    double v = (double)ptr[x]; \
+                    if(v < g_min) g_min = v; \
+                    if(v > g_max) g_max = v; \
+                } \
             } \
         }
 
-    switch(datatype) {
+    switch(r->datatype) {
         case _DATATYPE_FLOAT: SCAN_MINMAX(float); break;
         case _DATATYPE_DOUBLE: SCAN_MINMAX(double); break;
         case _DATATYPE_UINT8: SCAN_MINMAX(uint8_t); break;
@@ -4128,10 +9487,164 @@ calculate_limits_from_buffer(void *data, size_t count, int datatype,
         case _DATATYPE_UINT16: SCAN_MINMAX(uint16_t); break;
         case _DATATYPE_INT32: SCAN_MINMAX(int32_t); break;
         case _DATATYPE_UINT32: SCAN_MINMAX(uint32_t); break;
-        default: return;
+        default: return FALSE;
+    }
+
+    if (g_min > g_max) { g_min = 0; g_max = 1; }
+    *out_min = g_min;
+    *out_max = g_max;
+    return TRUE;
+}
+
+static HistRegion
+hist_region_sub(const HistRegion *frame, int x1, int y1, int x2, int y2) {
+    HistRegion r = *frame;
+    r.x1 = x1; r.y1 = y1;
+    r.x2 = x2; r.y2 = y2;
+    return r;
+}
+
+static size_t
+hist_region_count(const HistRegion *r) {
+    if (r->x2 <= r->x1 || r->y2 <= r->y1) return 0;
+    return (size_t)(r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static gboolean
+hist_region_equal(const HistRegion *a, const HistRegion *b) {
+    return a->source == b->source && a->cnt0 == b->cnt0 && a->data == b->data &&
+           a->datatype == b->datatype && a->width == b->width &&
+           a->x1 == b->x1 && a->y1 == b->y1 && a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+static void
+hist_cache_invalidate(HistCache *cache) {
+    for (int i = 0; i < HIST_CACHE_SIZE; ++i) cache->entries[i].valid = FALSE;
+}
+
+static void
+hist_cache_free(HistCache *cache) {
+    for (int i = 0; i < HIST_CACHE_SIZE; ++i) {
+        if (cache->entries[i].hist) free(cache->entries[i].hist);
+        cache->entries[i].hist = NULL;
+        cache->entries[i].hist_capacity = 0;
+        cache->entries[i].valid = FALSE;
+    }
+}
+
+static HistCacheEntry *
+hist_cache_find(HistCache *cache, const HistRegion *r, double min_val, double max_val, int bins) {
+    for (int i = 0; i < HIST_CACHE_SIZE; ++i) {
+        HistCacheEntry *e = &cache->entries[i];
+        if (e->valid && e->bins == bins && hist_region_equal(&e->region, r) &&
+            (bins == 0 || (e->min == min_val && e->max == max_val))) {
+            e->last_used = ++cache->tick;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Least recently used slot, with room for `bins` counts
+static HistCacheEntry *
+hist_cache_alloc(HistCache *cache, const HistRegion *r, int bins) {
+    HistCacheEntry *e = &cache->entries[0];
+    for (int i = 0; i < HIST_CACHE_SIZE; ++i) {
+        HistCacheEntry *c = &cache->entries[i];
+        if (!c->valid) { e = c; break; }
+        if (c->last_used < e->last_used) e = c;
+    }
+
+    if (bins > e->hist_capacity) {
+        uint32_t *hist = (uint32_t*)realloc(e->hist, bins * sizeof(uint32_t));
+        if (!hist) return NULL;
+        e->hist = hist;
+        e->hist_capacity = bins;
+    }
+
+    e->valid = FALSE;
+    e->region = *r;
+    e->bins = bins;
+    e->last_used = ++cache->tick;
+    return e;
+}
+
+// Data extrema of a region, scanned at most once per frame
+static gboolean
+hist_cache_extrema(HistCache *cache, const HistRegion *r, double *out_min, double *out_max) {
+    if (!cache || !r->source) return compute_region_extrema(r, out_min, out_max);
+
+    HistCacheEntry *e = hist_cache_find(cache, r, 0, 0, 0);
+    if (!e) {
+        double g_min, g_max;
+        if (!compute_region_extrema(r, &g_min, &g_max)) return FALSE;
+        e = hist_cache_alloc(cache, r, 0);
+        if (!e) { *out_min = g_min; *out_max = g_max; return TRUE; }
+        e->min = g_min;
+        e->max = g_max;
+        e->valid = TRUE;
+    }
+    *out_min = e->min;
+    *out_max = e->max;
+    return TRUE;
+}
+
+// Histogram of a region over [min_val, max_val]. Served from the cache when the
+// same frame was already binned, rebinned from a finer cached histogram over the
+// same range when one exists, and scanned otherwise. The returned buffer belongs
+// to the cache and stays valid until the next hist_cache_* call.
+static const uint32_t *
+hist_cache_get(HistCache *cache, const HistRegion *r, double min_val, double max_val, int bins, uint32_t *out_max_count) {
+    HistCacheEntry *e = hist_cache_find(cache, r, min_val, max_val, bins);
+    if (e) {
+        if (out_max_count) *out_max_count = e->max_count;
+        return e->hist;
+    }
+
+    // Finest compatible histogram (same frame, region and range)
+    HistCacheEntry *fine = NULL;
+    for (int i = 0; i < HIST_CACHE_SIZE; ++i) {
+        HistCacheEntry *c = &cache->entries[i];
+        if (c->valid && c->bins > bins && c->bins % bins == 0 &&
+            c->min == min_val && c->max == max_val && hist_region_equal(&c->region, r)) {
+            if (!fine || c->bins > fine->bins) fine = c;
+        }
+    }
+
+    e = hist_cache_alloc(cache, r, bins);
+    if (!e) return NULL;
+    e->min = min_val;
+    e->max = max_val;
+
+    if (fine && fine != e) {
+        int factor = fine->bins / bins;
+        e->max_count = 0;
+        for (int i = 0; i < bins; ++i) {
+            uint32_t sum = 0;
+            for (int k = 0; k < factor; ++k) sum += fine->hist[i * factor + k];
+            e->hist[i] = sum;
+            if (sum > e->max_count) e->max_count = sum;
+        }
+    } else {
+        compute_histogram(r, min_val, max_val, bins, e->hist, &e->max_count);
     }
 
-    if (g_min > g_max) { g_min = 0; g_max = 1; }
+    e->valid = TRUE;
+    if (out_max_count) *out_max_count = e->max_count;
+    return e->hist;
+}
+
+// Refactored Helper for calculating limits from a frame region.
+// cache may be NULL for transient buffers (e.g. autoscale samples).
+static void
+calculate_limits_from_buffer(HistCache *cache, const HistRegion *r,
+                             int mode_min, int mode_max,
+                             double *out_min, double *out_max) {
+
+    if (mode_min == AUTO_MANUAL && mode_max == AUTO_MAX_MANUAL) return;
+
+    double g_min, g_max;
+    if (!hist_cache_extrema(cache, r, &g_min, &g_max)) return;
 
     // Set targets based on Min
     if (mode_min == AUTO_DATA) *out_min = g_min;
@@ -4142,34 +9655,23 @@ calculate_limits_from_buffer(void *data, size_t count, int datatype,
     // If percentiles needed
     gboolean need_hist = (mode_min > AUTO_DATA) || (mode_max > AUTO_MAX_DATA);
     if (need_hist) {
-        // Build temporary histogram
-        #define HIST_BINS 4096
-        static uint32_t hist[HIST_BINS]; // static to avoid stack overflow, safe if single threaded drawing
-        memset(hist, 0, sizeof(hist));
+        const uint32_t *hist = NULL;
+        uint32_t *scratch = NULL;
+
+        if (cache && r->source) {
+            hist = hist_cache_get(cache, r, g_min, g_max, HIST_CACHE_FINE_BINS, NULL);
+        }
+        if (!hist) {
+            scratch = (uint32_t*)malloc(HIST_CACHE_FINE_BINS * sizeof(uint32_t));
+            if (!scratch) return;
+            compute_histogram(r, g_min, g_max, HIST_CACHE_FINE_BINS, scratch, NULL);
+            hist = scratch;
+        }
 
+        size_t count = hist_region_count(r);
         double range = g_max - g_min;
         if (range <= 0) range = 1.0;
 
-        #define FILL_HIST(type) \
-            { \
-                type *ptr = (type*)data; \
-                for(size_t i=0; i<count; ++i) { \
-                    int bin = (int)(((double)ptr[i] - g_min) / range * (HIST_BINS - 1)); \
-                    if(bin < 0) bin = 0; if(bin >= HIST_BINS) bin = HIST_BINS-1; \
-                    hist[bin]++; \
-                } \
-            }
-
-        switch(datatype) {
-            case _DATATYPE_FLOAT: FILL_HIST(float); break;
-            case _DATATYPE_DOUBLE: FILL_HIST(double); break;
-            case _DATATYPE_UINT8: FILL_HIST(uint8_t); break;
-            case _DATATYPE_INT16: FILL_HIST(int16_t); break;
-            case _DATATYPE_UINT16: FILL_HIST(uint16_t); break;
-            case _DATATYPE_INT32: FILL_HIST(int32_t); break;
-            case _DATATYPE_UINT32: FILL_HIST(uint32_t); break;
-        }
-
         // Find percentiles from CDF
         double target_cdf = 0;
         if (mode_min == AUTO_P01) target_cdf = 0.01;
@@ -4180,10 +9682,10 @@ calculate_limits_from_buffer(void *data, size_t count, int datatype,
         if (target_cdf > 0) {
             double threshold = count * target_cdf;
             double cum = 0;
-            for (int i=0; i<HIST_BINS; ++i) {
+            for (int i=0; i<HIST_CACHE_FINE_BINS; ++i) {
                 cum += hist[i];
                 if (cum >= threshold) {
-                    *out_min = g_min + ((double)i / (HIST_BINS-1)) * range;
+                    *out_min = g_min + ((double)i / HIST_CACHE_FINE_BINS) * range;
                     break;
                 }
             }
@@ -4198,48 +9700,152 @@ calculate_limits_from_buffer(void *data, size_t count, int datatype,
         if (target_cdf > 0) {
             double threshold = count * target_cdf;
             double cum = 0;
-            for (int i=0; i<HIST_BINS; ++i) {
+            for (int i=0; i<HIST_CACHE_FINE_BINS; ++i) {
                 cum += hist[i];
                 if (cum >= threshold) {
-                    *out_max = g_min + ((double)i / (HIST_BINS-1)) * range;
+                    *out_max = g_min + ((double)i / HIST_CACHE_FINE_BINS) * range;
                     break;
                 }
             }
         }
+
+        if (scratch) free(scratch);
+    }
+}
+
+// Largest p*(1-p) over the percentile modes in use (0 if none)
+static double
+autoscale_percentile_variance(int mode_min, int mode_max) {
+    double p_min = 0, p_max = 0;
+    if (mode_min == AUTO_P01) p_min = 0.01;
+    else if (mode_min == AUTO_P02) p_min = 0.02;
+    else if (mode_min == AUTO_P05) p_min = 0.05;
+    else if (mode_min == AUTO_P10) p_min = 0.10;
+
+    if (mode_max == AUTO_MAX_P99) p_max = 0.01;
+    else if (mode_max == AUTO_MAX_P98) p_max = 0.02;
+    else if (mode_max == AUTO_MAX_P95) p_max = 0.05;
+    else if (mode_max == AUTO_MAX_P90) p_max = 0.10;
+
+    double pq_min = p_min * (1.0 - p_min);
+    double pq_max = p_max * (1.0 - p_max);
+    return (pq_min > pq_max) ? pq_min : pq_max;
+}
+
+// Number of samples needed so that the percentile rank error stays below
+// tolerance at AUTOSCALE_SAMPLE_SIGMA. Returns count for exact computation.
+static size_t
+autoscale_sample_size(size_t count, double tolerance, int mode_min, int mode_max) {
+    if (tolerance <= 0) return count;
+
+    double pq = autoscale_percentile_variance(mode_min, mode_max);
+    if (pq <= 0) return count;
+
+    double n = AUTOSCALE_SAMPLE_SIGMA * AUTOSCALE_SAMPLE_SIGMA * pq / (tolerance * tolerance);
+    if (n < AUTOSCALE_SAMPLE_MIN) n = AUTOSCALE_SAMPLE_MIN;
+    if (n > AUTOSCALE_SAMPLE_MAX) n = AUTOSCALE_SAMPLE_MAX;
+
+    // Small frames: sampling would not save enough to be worth the error
+    if ((double)count <= 2.0 * n) return count;
+    return (size_t)n;
+}
+
+// Deterministic offset in [0, 1) within stratum i (splitmix64 finalizer)
+static double
+sample_jitter(uint64_t i) {
+    uint64_t z = i + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (double)(z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Stratified subsample: one pixel per stratum of count/n pixels, jittered
+// so that periodic image structure does not alias with the stride.
+static gboolean
+gather_autoscale_samples(void *raw_data, int width, uint8_t datatype,
+                         int rx, int ry, int rw, int rh,
+                         size_t n, void *out) {
+    size_t count = (size_t)rw * rh;
+    double stratum = (double)count / n;
+
+    #define GATHER_SAMPLES(type) \
+        { \
+            type *src = (type*)raw_data; \
+            type *dst = (type*)out; \
+            for (size_t i = 0; i < n; ++i) { \
+                size_t k = (size_t)((i + sample_jitter(i)) * stratum); \
+                if (k >= count) k = count - 1; \
+                dst[i] = src[(size_t)(ry + k / rw) * width + rx + k % rw]; \
+            } \
+        }
+
+    switch (datatype) {
+        case _DATATYPE_FLOAT: GATHER_SAMPLES(float); break;
+        case _DATATYPE_DOUBLE: GATHER_SAMPLES(double); break;
+        case _DATATYPE_UINT8: GATHER_SAMPLES(uint8_t); break;
+        case _DATATYPE_INT16: GATHER_SAMPLES(int16_t); break;
+        case _DATATYPE_UINT16: GATHER_SAMPLES(uint16_t); break;
+        case _DATATYPE_INT32: GATHER_SAMPLES(int32_t); break;
+        case _DATATYPE_UINT32: GATHER_SAMPLES(uint32_t); break;
+        default: return FALSE;
     }
+    return TRUE;
 }
 
 static void
 autoscale_process(double *current_min, double *current_max,
-                  int min_mode, int max_mode, double gain,
+                  int min_mode, int max_mode, double gain, double tolerance,
                   double app_min_val, double app_max_val,
-                  void *raw_data, int width, int height, uint8_t datatype,
-                  gboolean use_roi, int rx, int ry, int rw, int rh) {
+                  HistCache *cache, const HistRegion *frame,
+                  gboolean use_roi, int rx, int ry, int rw, int rh,
+                  size_t *out_samples) {
     if (min_mode == AUTO_MANUAL && max_mode == AUTO_MAX_MANUAL) return;
 
-    gboolean roi_calculated = FALSE;
+    uint8_t datatype = frame->datatype;
+    HistRegion region = use_roi ? hist_region_sub(frame, rx, ry, rx + rw, ry + rh) : *frame;
+
     double new_min = *current_min;
     double new_max = *current_max;
 
-    if (use_roi) {
-        size_t roi_count = rw * rh;
+    // Modes still requiring a full pass (all of them unless sampled below)
+    int exact_min = min_mode;
+    int exact_max = max_mode;
+
+    size_t count = hist_region_count(&region);
+    size_t nsamples = autoscale_sample_size(count, tolerance, min_mode, max_mode);
+
+    if (nsamples < count) {
         size_t type_size = ImageStreamIO_typesize(datatype);
+        void *sample_buf = malloc(nsamples * type_size);
+        gboolean sampled = FALSE;
+
+        if (sample_buf) {
+            sampled = gather_autoscale_samples(frame->data, frame->width, datatype,
+                                               region.x1, region.y1,
+                                               region.x2 - region.x1, region.y2 - region.y1,
+                                               nsamples, sample_buf);
+        }
 
-        void *roi_buf = malloc(roi_count * type_size);
-        if (roi_buf) {
-            for(int y=0; y<rh; ++y) {
-                void *src = (char*)raw_data + ((ry + y) * width + rx) * type_size;
-                void *dst = (char*)roi_buf + (y * rw) * type_size;
-                memcpy(dst, src, rw * type_size);
-            }
-            calculate_limits_from_buffer(roi_buf, roi_count, datatype, min_mode, max_mode, &new_min, &new_max);
-            free(roi_buf);
-            roi_calculated = TRUE;
+        if (sampled) {
+            int pct_min = (min_mode > AUTO_DATA) ? min_mode : AUTO_MANUAL;
+            int pct_max = (max_mode > AUTO_MAX_DATA) ? max_mode : AUTO_MAX_MANUAL;
+            HistRegion sample = { NULL, 0, sample_buf, datatype, (int)nsamples, 0, 0, (int)nsamples, 1 };
+            calculate_limits_from_buffer(NULL, &sample, pct_min, pct_max, &new_min, &new_max);
+
+            // Min Val / Max Val cannot be sampled: extremes are rare by definition
+            exact_min = (min_mode == AUTO_DATA) ? AUTO_DATA : AUTO_MANUAL;
+            exact_max = (max_mode == AUTO_MAX_DATA) ? AUTO_MAX_DATA : AUTO_MAX_MANUAL;
+        } else {
+            nsamples = count;
         }
+        if (sample_buf) free(sample_buf);
     }
 
-    if (!roi_calculated) {
-        calculate_limits_from_buffer(raw_data, (size_t)width * height, datatype, min_mode, max_mode, &new_min, &new_max);
+    if (out_samples) *out_samples = nsamples;
+
+    if (exact_min != AUTO_MANUAL || exact_max != AUTO_MAX_MANUAL) {
+        calculate_limits_from_buffer(cache, &region, exact_min, exact_max, &new_min, &new_max);
     }
 
     // Apply Gain
@@ -4252,7 +9858,9 @@ autoscale_process(double *current_min, double *current_max,
 }
 
 static void
-calculate_autoscale_limits(ViewerApp *app, double *new_min, double *new_max, int width, int height, uint8_t datatype, void *raw_data) {
+calculate_autoscale_limits(ViewerApp *app, double *new_min, double *new_max, const HistRegion *frame) {
+    int width = frame->x2;
+    int height = frame->y2;
     int mode_min = gtk_drop_down_get_selected(GTK_DROP_DOWN(app->dropdown_min_mode));
     int mode_max = gtk_drop_down_get_selected(GTK_DROP_DOWN(app->dropdown_max_mode));
 
@@ -4271,10 +9879,400 @@ calculate_autoscale_limits(ViewerApp *app, double *new_min, double *new_max, int
         if (rw <= 0 || rh <= 0) use_roi = FALSE;
     }
 
-    autoscale_process(new_min, new_max, mode_min, mode_max, app->auto_gain,
+    size_t nsamples = 0;
+    autoscale_process(new_min, new_max, mode_min, mode_max, app->auto_gain, app->autoscale_tolerance,
                       app->min_val, app->max_val,
-                      raw_data, width, height, datatype,
-                      use_roi, rx, ry, rw, rh);
+                      &app->hist_cache, frame,
+                      use_roi, rx, ry, rw, rh, &nsamples);
+
+    // Report effective sample count; the error also moves with the modes at a fixed N
+    if (app->lbl_autoscale_samples) {
+        size_t count = use_roi ? (size_t)rw * rh : (size_t)width * height;
+        char buf[64];
+        if (nsamples < count) {
+            double err = AUTOSCALE_SAMPLE_SIGMA * sqrt(autoscale_percentile_variance(mode_min, mode_max) / nsamples);
+            snprintf(buf, sizeof(buf), "N: %zu (%.2f%%)", nsamples, err * 100.0);
+        } else {
+            snprintf(buf, sizeof(buf), "N: %zu (exact)", count);
+        }
+        if (strcmp(buf, app->autoscale_label) != 0) {
+            snprintf(app->autoscale_label, sizeof(app->autoscale_label), "%s", buf);
+            gtk_label_set_text(GTK_LABEL(app->lbl_autoscale_samples), buf);
+        }
+    }
+}
+
+// Multi-ROI Statistics
+
+// Sorted unique values, in place; returns the new count
+static int
+sort_unique_ints(int *v, int n) {
+    for (int i = 1; i < n; ++i) {
+        int key = v[i], j = i - 1;
+        while (j >= 0 && v[j] > key) { v[j + 1] = v[j]; j--; }
+        v[j + 1] = key;
+    }
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+        if (m == 0 || v[i] != v[m - 1]) v[m++] = v[i];
+    }
+    return m;
+}
+
+static void
+roi_set_plan(RoiSet *set, int width, int height) {
+    int ys[2 * MAX_ROIS];
+    int ny = 0;
+
+    // Clip copies: the drawn rectangles survive a temporarily smaller frame
+    for (int r = 0; r < set->nrois; ++r) {
+        Roi *roi = &set->rois[r];
+        roi->cx1 = roi->x1 > 0 ? roi->x1 : 0;
+        roi->cy1 = roi->y1 > 0 ? roi->y1 : 0;
+        roi->cx2 = roi->x2 < width ? roi->x2 : width;
+        roi->cy2 = roi->y2 < height ? roi->y2 : height;
+        if (roi->cx2 <= roi->cx1 || roi->cy2 <= roi->cy1) continue;
+        ys[ny++] = roi->cy1;
+        ys[ny++] = roi->cy2;
+    }
+    ny = sort_unique_ints(ys, ny);
+
+    set->nbands = 0;
+    for (int k = 0; k + 1 < ny; ++k) {
+        RoiBand *band = &set->bands[set->nbands];
+        band->y1 = ys[k];
+        band->y2 = ys[k + 1];
+
+        int nx = 0;
+        for (int r = 0; r < set->nrois; ++r) {
+            Roi *roi = &set->rois[r];
+            if (roi->cx2 <= roi->cx1 || roi->cy1 > band->y1 || roi->cy2 < band->y2) continue;
+            band->seg_x[nx++] = roi->cx1;
+            band->seg_x[nx++] = roi->cx2;
+        }
+        if (nx == 0) continue;
+
+        nx = sort_unique_ints(band->seg_x, nx);
+        band->nseg = nx - 1;
+        memset(band->seg_used, 0, sizeof(band->seg_used));
+
+        band->nspans = 0;
+        for (int r = 0; r < set->nrois; ++r) {
+            Roi *roi = &set->rois[r];
+            if (roi->cx2 <= roi->cx1 || roi->cy1 > band->y1 || roi->cy2 < band->y2) continue;
+
+            RoiSpan *span = &band->spans[band->nspans++];
+            span->roi = r;
+            span->seg_first = 0;
+            while (band->seg_x[span->seg_first] < roi->cx1) span->seg_first++;
+            span->seg_last = span->seg_first;
+            while (band->seg_x[span->seg_last + 1] < roi->cx2) span->seg_last++;
+            for (int sg = span->seg_first; sg <= span->seg_last; ++sg) band->seg_used[sg] = TRUE;
+        }
+        set->nbands++;
+    }
+
+    set->plan_width = width;
+    set->plan_height = height;
+    set->dirty = FALSE;
+}
+
+// All ROIs in one row-major sweep: every covered pixel is read once, however
+// many ROIs overlap it; ROI cost is per segment, not per pixel.
+static void
+roi_set_compute(RoiSet *set, const void *data, uint8_t datatype, int width, int height) {
+    if (set->nrois == 0) return;
+    if (set->dirty || set->plan_width != width || set->plan_height != height) {
+        roi_set_plan(set, width, height);
+    }
+
+    double acc_sum[MAX_ROIS], acc_sq[MAX_ROIS], acc_min[MAX_ROIS], acc_max[MAX_ROIS];
+    for (int r = 0; r < set->nrois; ++r) {
+        acc_sum[r] = 0; acc_sq[r] = 0;
+        acc_min[r] = 1e30; acc_max[r] = -1e30;
+    }
+
+    double seg_sum[2 * MAX_ROIS], seg_sq[2 * MAX_ROIS], seg_min[2 * MAX_ROIS], seg_max[2 * MAX_ROIS];
+
+    #define ROI_SWEEP(type) \
+        { \
+            for (int b = 0; b < set->nbands; ++b) { \
+                const RoiBand *band = &set->bands[b]; \
+                for (int y = band->y1; y < band->y2; ++y) { \
+                    const type *row = (const type*)data + (size_t)y * width; \
+                    for (int sg = 0; sg < band->nseg; ++sg) { \
+                        if (!band->seg_used[sg]) continue; \
+                        double s = 0, sq = 0, mn = 1e30, mx = -1e30; \
+                        for (int x = band->seg_x[sg]; x < band->seg_x[sg + 1]; ++x) { \
+                            double v = (double)row[x]; \
+                            s += v; sq += v * v; \
+                            if (v < mn) mn = v; \
+                            if (v > mx) mx = v; \
+                        } \
+                        seg_sum[sg] = s; seg_sq[sg] = sq; seg_min[sg] = mn; seg_max[sg] = mx; \
+                    } \
+                    for (int k = 0; k < band->nspans; ++k) { \
+                        const RoiSpan *span = &band->spans[k]; \
+                        int r = span->roi; \
+                        for (int sg = span->seg_first; sg <= span->seg_last; ++sg) { \
+                            acc_sum[r] += seg_sum[sg]; \
+                            acc_sq[r] += seg_sq[sg]; \
+                            if (seg_min[sg] < acc_min[r]) acc_min[r] = seg_min[sg]; \
+                            if (seg_max[sg] > acc_max[r]) acc_max[r] = seg_max[sg]; \
+                        } \
+                    } \
+                } \
+            } \
+        }
+
+    switch (datatype) {
+        case _DATATYPE_FLOAT: ROI_SWEEP(float); break;
+        case _DATATYPE_DOUBLE: ROI_SWEEP(double); break;
+        case _DATATYPE_UINT8: ROI_SWEEP(uint8_t); break;
+        case _DATATYPE_INT16: ROI_SWEEP(int16_t); break;
+        case _DATATYPE_UINT16: ROI_SWEEP(uint16_t); break;
+        case _DATATYPE_INT32: ROI_SWEEP(int32_t); break;
+        case _DATATYPE_UINT32: ROI_SWEEP(uint32_t); break;
+        default: return;
+    }
+
+    for (int r = 0; r < set->nrois; ++r) {
+        Roi *roi = &set->rois[r];
+        roi->count = (roi->cx2 > roi->cx1 && roi->cy2 > roi->cy1) ? (size_t)(roi->cx2 - roi->cx1) * (roi->cy2 - roi->cy1) : 0;
+        roi->sum = acc_sum[r];
+        if (roi->count > 0) {
+            roi->mean = acc_sum[r] / roi->count;
+            double var = acc_sq[r] / roi->count - roi->mean * roi->mean;
+            roi->rms = (var > 0) ? sqrt(var) : 0;
+            roi->min = acc_min[r];
+            roi->max = acc_max[r];
+        } else {
+            roi->mean = roi->rms = roi->min = roi->max = 0;
+        }
+    }
+}
+
+static void
+roi_set_push_trace(RoiSet *set) {
+    for (int r = 0; r < set->nrois; ++r) {
+        Roi *roi = &set->rois[r];
+        roi->trace[roi->trace_head] = (float)roi->mean;
+        roi->trace_head = (roi->trace_head + 1) % ROI_TRACE_LEN;
+        if (roi->trace_count < ROI_TRACE_LEN) roi->trace_count++;
+    }
+}
+
+static gboolean
+roi_set_add(RoiSet *set, const char *name, int x1, int y1, int x2, int y2) {
+    if (set->nrois >= MAX_ROIS || x2 <= x1 || y2 <= y1) return FALSE;
+
+    Roi *roi = &set->rois[set->nrois];
+    memset(roi, 0, sizeof(Roi));
+    roi->trace = (float*)calloc(ROI_TRACE_LEN, sizeof(float));
+    if (!roi->trace) return FALSE;
+    set->nrois++;
+    snprintf(roi->name, sizeof(roi->name), "%s", name);
+    roi->x1 = x1; roi->y1 = y1;
+    roi->x2 = x2; roi->y2 = y2;
+    set->dirty = TRUE;
+    return TRUE;
+}
+
+static void
+roi_set_clear(RoiSet *set) {
+    for (int r = 0; r < set->nrois; ++r) {
+        free(set->rois[r].trace);
+        set->rois[r].trace = NULL;
+    }
+    set->nrois = 0;
+    set->nbands = 0;
+    set->dirty = TRUE;
+}
+
+static void
+update_roi_stats_label(ViewerApp *app) {
+    if (!app->lbl_roi_stats) return;
+    RoiSet *set = &app->roi_set;
+
+    char buf[MAX_ROIS * 96 + 1];
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int r = 0; r < set->nrois && len < sizeof(buf); ++r) {
+        Roi *roi = &set->rois[r];
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%-6s avg %-10.4g rms %-10.4g [%.4g, %.4g]",
+                        r ? "\n" : "", roi->name, roi->mean, roi->rms, roi->min, roi->max);
+    }
+    gtk_label_set_text(GTK_LABEL(app->lbl_roi_stats), set->nrois ? buf : "No ROIs");
+}
+
+static void
+draw_roi_trace_func (GtkDrawingArea *area,
+                     cairo_t        *cr,
+                     int             width,
+                     int             height,
+                     gpointer        user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    RoiSet *set = &app->roi_set;
+
+    cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+    cairo_paint(cr);
+
+    // Shared vertical range over all ROI histories
+    double y_min = 1e30, y_max = -1e30;
+    int n_max = 0;
+    for (int r = 0; r < set->nrois; ++r) {
+        Roi *roi = &set->rois[r];
+        for (int i = 0; i < roi->trace_count; ++i) {
+            double v = roi->trace[i];
+            if (v < y_min) y_min = v;
+            if (v > y_max) y_max = v;
+        }
+        if (roi->trace_count > n_max) n_max = roi->trace_count;
+    }
+    if (n_max < 2) return;
+    if (y_max <= y_min) { y_max = y_min + 1.0; }
+
+    cairo_set_line_width(cr, 1.0);
+    for (int r = 0; r < set->nrois; ++r) {
+        Roi *roi = &set->rois[r];
+        if (roi->trace_count < 2) continue;
+
+        const double *c = roi_colors[r % 8];
+        cairo_set_source_rgb(cr, c[0], c[1], c[2]);
+
+        // Oldest sample at the left, newest at the right edge
+        int start = (roi->trace_head - roi->trace_count + ROI_TRACE_LEN) % ROI_TRACE_LEN;
+        for (int i = 0; i < roi->trace_count; ++i) {
+            double v = roi->trace[(start + i) % ROI_TRACE_LEN];
+            double x = width - 1 - (double)(roi->trace_count - 1 - i) / (n_max - 1) * (width - 1);
+            double y = height - 1 - (v - y_min) / (y_max - y_min) * (height - 1);
+            if (i == 0) cairo_move_to(cr, x, y);
+            else cairo_line_to(cr, x, y);
+        }
+        cairo_stroke(cr);
+    }
+}
+
+static void
+on_roi_add_clicked (GtkButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    if (!app->selection_active) return;
+
+    char name[32];
+    snprintf(name, sizeof(name), "R%d", app->roi_set.nrois + 1);
+    roi_set_add(&app->roi_set, name, app->sel_x1, app->sel_y1, app->sel_x2 + 1, app->sel_y2 + 1);
+
+    update_roi_stats_label(app);
+    gtk_widget_set_visible(app->roi_trace_area, app->roi_set.nrois > 0);
+    gtk_widget_queue_draw(app->selection_area);
+    app->force_redraw = TRUE;
+}
+
+static void
+on_roi_quadrants_clicked (GtkButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    int w = app->img_width, h = app->img_height;
+    if (w <= 0 || h <= 0) return;
+
+    roi_set_add(&app->roi_set, "Q1", w / 2, h / 2, w, h);
+    roi_set_add(&app->roi_set, "Q2", 0, h / 2, w / 2, h);
+    roi_set_add(&app->roi_set, "Q3", 0, 0, w / 2, h / 2);
+    roi_set_add(&app->roi_set, "Q4", w / 2, 0, w, h / 2);
+
+    update_roi_stats_label(app);
+    gtk_widget_set_visible(app->roi_trace_area, app->roi_set.nrois > 0);
+    gtk_widget_queue_draw(app->selection_area);
+    app->force_redraw = TRUE;
+}
+
+static void
+on_roi_clear_clicked (GtkButton *btn, gpointer user_data)
+{
+    ViewerApp *app = (ViewerApp *)user_data;
+    roi_set_clear(&app->roi_set);
+
+    update_roi_stats_label(app);
+    gtk_widget_set_visible(app->roi_trace_area, FALSE);
+    gtk_widget_queue_draw(app->selection_area);
+}
+
+// Statistics Output Stream
+
+static void
+stats_pub_clear_rows(StatsPublisher *pub) {
+    for (int r = 0; r < 1 + MAX_ROIS; ++r)
+        for (int k = 0; k < STATS_VEC_LEN; ++k) pub->rows[r][k] = NAN;
+    pub->pending = FALSE;
+}
+
+static StatsPublisher *
+stats_pub_open(const char *name, int depth) {
+    StatsPublisher *pub = (StatsPublisher*)calloc(1, sizeof(StatsPublisher));
+    if (!pub) return NULL;
+    pub->depth = depth > 0 ? (uint32_t)depth : 0;
+
+    uint32_t dims[3] = { STATS_VEC_LEN, 1 + MAX_ROIS, pub->depth };
+    errno_t err;
+    if (pub->depth > 0) {
+        err = ImageStreamIO_createIm_gpu(&pub->img, name, 3, dims, _DATATYPE_DOUBLE, -1, 1,
+                                         IMAGE_NB_SEMAPHORE, 0, MATH_DATA | CIRCULAR_BUFFER, 0);
+    } else {
+        err = ImageStreamIO_createIm(&pub->img, name, 2, dims, _DATATYPE_DOUBLE, 1, 0, 0);
+    }
+    if (err != IMAGESTREAMIO_SUCCESS) {
+        fprintf(stderr, "Cannot create stats stream %s\n", name);
+        free(pub);
+        return NULL;
+    }
+
+    stats_pub_clear_rows(pub);
+    size_t nslices = pub->depth > 0 ? pub->depth : 1;
+    for (size_t i = 0; i < nslices; ++i)
+        memcpy(pub->img.array.D + i * (1 + MAX_ROIS) * STATS_VEC_LEN, pub->rows, sizeof(pub->rows));
+    return pub;
+}
+
+static void
+stats_pub_close(StatsPublisher *pub) {
+    if (!pub) return;
+    ImageStreamIO_destroyIm(&pub->img);
+    free(pub);
+}
+
+static void
+stats_row_fill(double *r, double min, double max, double mean, double median,
+               double p10, double p90, double sum, size_t npix) {
+    r[0] = min; r[1] = max; r[2] = mean; r[3] = median;
+    r[4] = p10; r[5] = p90; r[6] = sum; r[7] = (double)npix;
+}
+
+static void
+stats_pub_set_row(StatsPublisher *pub, int row, double min, double max, double mean, double median,
+                  double p10, double p90, double sum, size_t npix) {
+    stats_row_fill(pub->rows[row], min, max, mean, median, p10, p90, sum, npix);
+    pub->pending = TRUE;
+}
+
+// Write the collected rows as one update (next slice in circular mode) and post the semaphores
+static void
+stats_pub_post(StatsPublisher *pub) {
+    if (!pub->pending) return;
+
+    IMAGE *img = &pub->img;
+    double *dst = img->array.D;
+    img->md->write = 1;
+    if (pub->depth > 0) {
+        uint64_t slice = (img->md->cnt0 == 0) ? 0 : (img->md->cnt1 + 1) % pub->depth;
+        dst += slice * (1 + MAX_ROIS) * STATS_VEC_LEN;
+        img->md->cnt1 = slice;
+    }
+    memcpy(dst, pub->rows, sizeof(pub->rows));
+    ImageStreamIO_UpdateIm(img);
+
+    stats_pub_clear_rows(pub);
 }
 
 static void
@@ -4350,7 +10348,9 @@ calculate_and_update_stats(ViewerApp *app, void *raw_data, int width, int height
 
     if (show_hist || trace_active || show_hist_roi_vert) {
         // Use Global Display Range for Histogram to align with vertical histograms/colorbar
-        compute_histogram(roi_data, count, datatype, app->current_min, app->current_max, app->hist_bins, app->hist_data, &app->hist_max_count);
+        HistRegion roi = { app->image, cnt0, raw_data, datatype, width, x1, y1, x2, y2 };
+        const uint32_t *hist = hist_cache_get(&app->hist_cache, &roi, app->current_min, app->current_max, app->hist_bins, &app->hist_max_count);
+        if (hist) memcpy(app->hist_data, hist, app->hist_bins * sizeof(guint32));
 
         if (show_hist && app->histogram_area) gtk_widget_queue_draw(app->histogram_area);
         if (show_hist_roi_vert && app->hist_area_right) gtk_widget_queue_draw(app->hist_area_right);
@@ -4424,6 +10424,8 @@ calculate_and_update_stats(ViewerApp *app, void *raw_data, int width, int height
                           app->hist_data, app->current_min, app->current_max);
     }
 
+    if (app->stats_pub) stats_pub_set_row(app->stats_pub, 0, min_v, max_v, mean, median, p01, p09, sum, count);
+
     // New Stats
     snprintf(buf, sizeof(buf), "%zu", count);
     gtk_editable_set_text(GTK_EDITABLE(app->entry_stat_npix), buf);
@@ -4450,11 +10452,7 @@ draw_image (ViewerApp *app)
     size_t frame_size = width * height * element_size;
 
     // Manage Raw Buffer (Primary)
-    if (!app->raw_buffer || app->raw_buffer_size < frame_size) {
-        if (app->raw_buffer) free(app->raw_buffer);
-        app->raw_buffer = malloc(frame_size);
-        app->raw_buffer_size = frame_size;
-    }
+    if (!big_reserve(&app->raw_buffer, &app->raw_buffer_size, frame_size)) return;
 
     // If not paused, copy fresh data. If paused, keep existing data.
     if (!app->paused) {
@@ -4473,24 +10471,49 @@ draw_image (ViewerApp *app)
         if (src_ptr) {
             memcpy(app->raw_buffer, src_ptr, frame_size);
             app->current_cnt0 = app->image->md->cnt0;
+            app->current_frame_time_valid = !opt_local_time &&
+                stream_frame_time(app->image, &app->current_frame_time);
 
             // Record to internal circular buffer if recording (based on app running)
             if (app->img_history_capacity > 0) {
-                // Resize internal buffer if frame size changed
-                if (frame_size != app->img_history_frame_size) {
-                    if (app->img_history_data) free(app->img_history_data);
-                    app->img_history_frame_size = frame_size;
-                    app->img_history_data = malloc(app->img_history_capacity * frame_size);
-                    // Reset head
-                    app->img_history_head = 0;
-                    memset(app->img_history_cnt0, 0, app->img_history_capacity * sizeof(uint64_t));
+                // Track t holds streams[t]; the other stream is paired by frame time
+                int cur = app->active_stream, other = 1 - cur;
+                IMAGE *other_img = app->streams[other].image;
+                const void *frames[HIST_TRACKS] = { NULL, NULL };
+                size_t sizes[HIST_TRACKS] = { 0, 0 };
+                int esizes[HIST_TRACKS] = { 1, 1 };
+                uint64_t pair_cnt0 = 0;
+
+                frames[cur] = src_ptr;
+                sizes[cur] = frame_size;
+                esizes[cur] = (int)element_size;
+                if (other_img && other_img->array.raw) {
+                    esizes[other] = (int)ImageStreamIO_typesize(other_img->md->datatype);
+                    sizes[other] = (size_t)other_img->md->size[0] * other_img->md->size[1] * esizes[other];
+                    frames[other] = stream_paired_frame(other_img, sizes[other], app->current_cnt0,
+                                                        app->current_frame_time_valid ? &app->current_frame_time : NULL,
+                                                        &pair_cnt0);
+                }
+
+                // Resize internal buffer if a track's frame size changed
+                if (sizes[0] != app->img_history_frame_size || sizes[1] != app->img_history_frame_size_sec) {
+                    trigger_dump_cancel(app);
+                    hreplay_invalidate(app);
+                    app->img_history_frame_size = sizes[0];
+                    app->img_history_frame_size_sec = sizes[1];
+                    size_t slots = mem_history_slots(app, sizes, esizes);
+                    if (slots && slots != app->img_history_capacity && !img_history_set_capacity(app, slots)) {
+                        app->img_history_capacity = 0;
+                    } else if (app->hist_codec) {
+                        hist_codec_configure(app->hist_codec, sizes, esizes);
+                    } else {
+                        img_history_alloc_data(app);
+                    }
+                    img_history_reset(app);
                 }
 
-                if (app->img_history_data) {
-                    void *dst_ptr = (char*)app->img_history_data + (app->img_history_head * frame_size);
-                    memcpy(dst_ptr, src_ptr, frame_size);
-                    app->img_history_cnt0[app->img_history_head] = app->image->md->cnt0;
-                    app->img_history_head = (app->img_history_head + 1) % app->img_history_capacity;
+                if (app->hist_codec || app->img_history_data) {
+                    img_history_record(app, frames, app->current_cnt0, pair_cnt0);
                 }
             }
         }
@@ -4521,11 +10544,7 @@ draw_image (ViewerApp *app)
         } else {
             size_t sec_frame_size = sec_img->md->size[0] * sec_img->md->size[1] * ImageStreamIO_typesize(sec_img->md->datatype);
 
-            if (!app->raw_buffer_sec || app->raw_buffer_sec_size < sec_frame_size) {
-                if (app->raw_buffer_sec) free(app->raw_buffer_sec);
-                app->raw_buffer_sec = malloc(sec_frame_size);
-                app->raw_buffer_sec_size = sec_frame_size;
-            }
+            if (!big_reserve(&app->raw_buffer_sec, &app->raw_buffer_sec_size, sec_frame_size)) return;
 
             if (!app->paused) {
                  void *src_sec = NULL;
@@ -4536,49 +10555,59 @@ draw_image (ViewerApp *app)
                      } else src_sec = sec_img->array.raw;
                  } else src_sec = sec_img->array.raw;
 
-                 if (src_sec) memcpy(app->raw_buffer_sec, src_sec, sec_frame_size);
+                 if (src_sec) {
+                     memcpy(app->raw_buffer_sec, src_sec, sec_frame_size);
+                     app->current_cnt0_sec = sec_img->md->cnt0;
+                 }
             }
         }
     }
 
     void *raw_data = app->raw_buffer;
     void *raw_data_sec = app->raw_buffer_sec;
+    uint64_t frame_cnt0 = app->current_cnt0;
+    uint64_t frame_cnt0_sec = app->current_cnt0_sec;
 
-    // Check for History Mode (Paused + Trace Hover + Update Off)
-    gboolean is_history = (app->paused &&
+    // Check for History Mode (history transport, or Paused + Trace Hover + Update Off)
+    gboolean is_history = app->hreplay.active ||
+                          (app->paused &&
                            !gtk_check_button_get_active(GTK_CHECK_BUTTON(app->btn_stats_update)) &&
                            app->trace_cursor_active);
 
     if (is_history) {
         // Fetch historical frame
-        if (!app->history_buffer || app->history_buffer_size < frame_size) {
-             if (app->history_buffer) free(app->history_buffer);
-             app->history_buffer = malloc(frame_size);
-             app->history_buffer_size = frame_size;
-        }
-
-        uint64_t target_cnt = app->trace_cnt0[app->trace_cursor_idx];
-
-        // Search in internal buffer
-        // Simple linear search is fast enough for 2000 items
-        int found_idx = -1;
-        if (app->img_history_cnt0) {
-            for (size_t i = 0; i < app->img_history_capacity; ++i) {
-                if (app->img_history_cnt0[i] == target_cnt) {
-                    found_idx = (int)i;
-                    break;
-                }
-            }
+        big_reserve(&app->history_buffer, &app->history_buffer_size, frame_size);
+
+        long found_idx = -1;
+        if (app->hreplay.active) {
+            found_idx = (long)app->hreplay.slot;
+        } else if (app->img_history_capacity > 0) {
+            // Trace samples carry the cnt0 of whichever stream was shown; try the
+            // current one first
+            uint64_t cnt0 = TRACE_AT(app, cnt0, app->trace_cursor_idx);
+            found_idx = img_history_find(app, app->active_stream, cnt0);
+            if (found_idx < 0 && app->streams[1].image) found_idx = img_history_find(app, !app->active_stream, cnt0);
         }
 
-        if (found_idx >= 0 && app->img_history_data && app->history_buffer) {
-            void *src_ptr = (char*)app->img_history_data + (found_idx * frame_size);
-            memcpy(app->history_buffer, src_ptr, frame_size);
+        // The displayed stream may differ from the one that keyed the slot (blink)
+        if (found_idx >= 0 && app->history_buffer &&
+            (hreplay_take(app, app->active_stream, (size_t)found_idx, app->history_buffer, frame_size) ||
+             img_history_fetch(app, app->active_stream, (size_t)found_idx, app->history_buffer, frame_size))) {
             raw_data = app->history_buffer;
+            frame_cnt0 = img_history_slot_cnt0(app, app->active_stream, (size_t)found_idx);
         }
 
-        // 2D History? Not supported yet (trace only stores 1D stats of primary).
-        // Secondary stream will freeze at current paused state.
+        // 2D / merge: the secondary frame recorded alongside
+        IMAGE *sec_img = app->streams[1].image;
+        if (found_idx >= 0 && raw_data_sec && sec_img && (app->mode_2d || app->mode_merge)) {
+            size_t sec_size = (size_t)sec_img->md->size[0] * sec_img->md->size[1] * ImageStreamIO_typesize(sec_img->md->datatype);
+            if (big_reserve(&app->history_buffer_sec, &app->history_buffer_sec_size, sec_size) &&
+                (hreplay_take(app, 1, (size_t)found_idx, app->history_buffer_sec, sec_size) ||
+                 img_history_fetch(app, 1, (size_t)found_idx, app->history_buffer_sec, sec_size))) {
+                raw_data_sec = app->history_buffer_sec;
+                frame_cnt0_sec = img_history_slot_cnt0(app, 1, (size_t)found_idx);
+            }
+        }
     }
 
     if (!raw_data) return;
@@ -4596,7 +10625,9 @@ draw_image (ViewerApp *app)
         if (!app->hist_data_full) {
             app->hist_data_full = (guint32*)calloc(app->hist_bins, sizeof(guint32));
         }
-        compute_histogram(raw_data, (size_t)width * height, datatype, app->current_min, app->current_max, app->hist_bins, app->hist_data_full, &app->hist_full_max_count);
+        HistRegion full = { app->image, frame_cnt0, raw_data, datatype, width, 0, 0, width, height };
+        const uint32_t *hist = hist_cache_get(&app->hist_cache, &full, app->current_min, app->current_max, app->hist_bins, &app->hist_full_max_count);
+        if (hist) memcpy(app->hist_data_full, hist, app->hist_bins * sizeof(guint32));
         if (app->hist_area_left) gtk_widget_queue_draw(app->hist_area_left);
     }
 
@@ -4609,22 +10640,40 @@ draw_image (ViewerApp *app)
     // Don't update trace if in history mode (avoid polluting trace with history)
     if (is_history) update_trace = FALSE;
 
-    if (app->selection_active && (stats_visible || update_trace)) {
-        uint64_t cnt = is_history ? app->trace_cnt0[app->trace_cursor_idx] : app->current_cnt0;
+    // Publish once per live frame
+    gboolean publish = app->stats_pub && !is_history && app->current_cnt0 != app->stats_pub->last_cnt0;
+
+    if (app->selection_active && (stats_visible || update_trace || publish)) {
+        uint64_t cnt = is_history ? TRACE_AT(app, cnt0, app->trace_cursor_idx) : app->current_cnt0;
         // Check for NULL pointer before call if needed, though calculate_and_update_stats handles logic
         if (app->btn_stats_update) // Ensure widget exists
              calculate_and_update_stats(app, raw_data, width, height, datatype, update_trace, cnt);
     }
 
+    // Named ROIs (single sweep for all of them)
+    if (app->roi_set.nrois > 0 && (stats_visible || update_trace || publish)) {
+        roi_set_compute(&app->roi_set, raw_data, datatype, width, height);
+        if (update_trace) roi_set_push_trace(&app->roi_set);
+        update_roi_stats_label(app);
+        if (app->roi_trace_area) gtk_widget_queue_draw(app->roi_trace_area);
+
+        if (publish) {
+            for (int i = 0; i < app->roi_set.nrois; ++i) {
+                const Roi *r = &app->roi_set.rois[i];
+                stats_pub_set_row(app->stats_pub, 1 + i, r->min, r->max, r->mean, NAN, NAN, NAN, r->sum, r->count);
+            }
+        }
+    }
+
+    if (publish) {
+        app->stats_pub->last_cnt0 = app->current_cnt0;
+        stats_pub_post(app->stats_pub);
+    }
+
     int stride = cairo_format_stride_for_width(CAIRO_FORMAT_RGB24, width);
     size_t required_size = stride * height;
 
-    if (!app->display_buffer || app->display_buffer_size < required_size) {
-        if (app->display_buffer) free(app->display_buffer);
-        app->display_buffer = malloc(required_size);
-        if (!app->display_buffer) return;
-        app->display_buffer_size = required_size;
-    }
+    if (!big_reserve((void **)&app->display_buffer, &app->display_buffer_size, required_size)) return;
 
     guchar *pixels = app->display_buffer;
 
@@ -4633,7 +10682,8 @@ draw_image (ViewerApp *app)
 
     // Calculate Autoscale (Primary)
     if (!app->fixed_min || !app->fixed_max) {
-        calculate_autoscale_limits(app, &min_val, &max_val, width, height, datatype, raw_data);
+        HistRegion frame = { app->image, frame_cnt0, raw_data, datatype, width, 0, 0, width, height };
+        calculate_autoscale_limits(app, &min_val, &max_val, &frame);
     }
 
     if (app->fixed_min) min_val = app->min_val;
@@ -4668,10 +10718,11 @@ draw_image (ViewerApp *app)
              if (rw <= 0 || rh <= 0) use_roi = FALSE;
         }
 
-        autoscale_process(&sec_min, &sec_max, sec->min_mode, sec->max_mode, app->auto_gain,
+        HistRegion sec_frame = { sec->image, frame_cnt0_sec, raw_data_sec, sec_type, sec_w, 0, 0, sec_w, sec_h };
+        autoscale_process(&sec_min, &sec_max, sec->min_mode, sec->max_mode, app->auto_gain, app->autoscale_tolerance,
                           sec->min_val, sec->max_val,
-                          raw_data_sec, sec_w, sec_h, sec_type,
-                          use_roi, rx, ry, rw, rh);
+                          &app->hist_cache, &sec_frame,
+                          use_roi, rx, ry, rw, rh, NULL);
 
         sec->min_val = sec_min;
         sec->max_val = sec_max;
@@ -4798,12 +10849,19 @@ update_display (gpointer user_data)
 {
     ViewerApp *app = (ViewerApp *)user_data;
 
+    if (app->player && player_tick(app->player)) update_play_ui(app);
+    hreplay_tick(app);
+
     if (!app->image) {
-        app->image = (IMAGE*) malloc(sizeof(IMAGE));
-        if (ImageStreamIO_openIm(app->image, app->image_name) != IMAGESTREAMIO_SUCCESS) {
-             free(app->image);
-             app->image = NULL;
-             return G_SOURCE_CONTINUE;
+        if (app->player && app->active_stream == 0) {
+            app->image = &app->player->image;
+        } else {
+            app->image = (IMAGE*) malloc(sizeof(IMAGE));
+            if (ImageStreamIO_openIm(app->image, app->image_name) != IMAGESTREAMIO_SUCCESS) {
+                 free(app->image);
+                 app->image = NULL;
+                 return G_SOURCE_CONTINUE;
+            }
         }
         printf("Connected to stream: %s\n", app->image_name);
         app->fit_window = TRUE;
@@ -4831,18 +10889,35 @@ update_display (gpointer user_data)
             gtk_window_set_title(win, title);
         }
         update_stream_ui_state(app);
+
+        if (opt_record && app->btn_record) {
+            opt_record = FALSE;
+            gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(app->btn_record), TRUE);
+        }
     }
 
-    // FPS Estimation
+    update_record_label(app);
+
+    // FPS Estimation (about once a second, over the producer's own time span when it has one)
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
     double dt = (now.tv_sec - app->last_fps_time.tv_sec) + (now.tv_nsec - app->last_fps_time.tv_nsec) / 1e9;
     if (dt >= 1.0) {
-        double fps = (double)(app->image->md->cnt0 - app->last_fps_cnt) / dt;
+        uint64_t cnt = app->image->md->cnt0;
+        struct timespec ptime = {0};
+        gboolean ptime_valid = !opt_local_time && stream_frame_time(app->image, &ptime);
+        if (ptime_valid && app->last_fps_ptime_valid) {
+            double pdt = (ptime.tv_sec - app->last_fps_ptime.tv_sec) + (ptime.tv_nsec - app->last_fps_ptime.tv_nsec) / 1e9;
+            if (pdt > 0) dt = pdt;
+        }
+        double fps = (double)(cnt - app->last_fps_cnt) / dt;
         if (fps < 0) fps = 0;
         app->current_fps = fps;
         app->last_fps_time = now;
-        app->last_fps_cnt = app->image->md->cnt0;
+        app->last_fps_cnt = cnt;
+        if (ptime_valid) app->last_fps_ptime = ptime;
+        app->last_fps_ptime_valid = ptime_valid;
+        update_mem_label(app);
     }
 
     static uint64_t last_cnt0 = 0;
@@ -4867,6 +10942,8 @@ update_display (gpointer user_data)
         if (app->selection_area) gtk_widget_queue_draw(app->selection_area);
     }
 
+    if (app->trigger) trigger_poll(app);
+
     return G_SOURCE_CONTINUE;
 }
 
@@ -4925,6 +11002,18 @@ activate (GtkApplication *app,
     g_signal_connect(viewer->btn_pause, "toggled", G_CALLBACK(on_pause_toggled), viewer);
     gtk_box_append(GTK_BOX(vbox_stream), viewer->btn_pause);
 
+    GtkWidget *hbox_record = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
+    gtk_box_append(GTK_BOX(vbox_stream), hbox_record);
+    viewer->btn_record = gtk_toggle_button_new_with_label("Rec");
+    gtk_widget_set_tooltip_text(viewer->btn_record, "Record the displayed stream to FITS cubes (--record-dir, --record-every)");
+    g_signal_connect(viewer->btn_record, "toggled", G_CALLBACK(on_record_toggled), viewer);
+    gtk_box_append(GTK_BOX(hbox_record), viewer->btn_record);
+    viewer->lbl_record = gtk_label_new("");
+    gtk_box_append(GTK_BOX(hbox_record), viewer->lbl_record);
+
+    viewer->lbl_mem = gtk_label_new("Mem 0 MB");
+    gtk_box_append(GTK_BOX(vbox_stream), viewer->lbl_mem);
+
     // Tbin Target Selector
     const char *tbin_targets[] = {"Primary", "Secondary", NULL};
     viewer->dropdown_tbin_target = gtk_drop_down_new_from_strings(tbin_targets);
@@ -4996,6 +11085,28 @@ activate (GtkApplication *app,
 
     g_signal_connect(popover_rms, "map", G_CALLBACK(refresh_rms_popover), viewer);
 
+    // Temporal Statistics (computed in-viewer)
+    GtkWidget *hbox_tstat = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
+    gtk_box_append(GTK_BOX(vbox_stream), hbox_tstat);
+
+    const char *tstat_opts[] = {"tstat: Off", "Mean", "RMS", "Min", "Max", NULL};
+    viewer->dropdown_tstat = gtk_drop_down_new_from_strings(tstat_opts);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(viewer->dropdown_tstat), TSTAT_OFF);
+    gtk_widget_set_tooltip_text(viewer->dropdown_tstat, "Per-pixel statistics over N frames, computed by the viewer");
+    g_signal_connect(viewer->dropdown_tstat, "notify::selected", G_CALLBACK(on_tstat_changed), viewer);
+    gtk_box_append(GTK_BOX(hbox_tstat), viewer->dropdown_tstat);
+
+    const char *tstat_window_opts[] = {"2", "4", "8", "16", "32", "64", "128", NULL};
+    viewer->dropdown_tstat_window = gtk_drop_down_new_from_strings(tstat_window_opts);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(viewer->dropdown_tstat_window), 3);
+    g_signal_connect(viewer->dropdown_tstat_window, "notify::selected", G_CALLBACK(on_tstat_changed), viewer);
+    gtk_box_append(GTK_BOX(hbox_tstat), viewer->dropdown_tstat_window);
+
+    viewer->check_tstat_exp = gtk_check_button_new_with_label("Exp");
+    gtk_widget_set_tooltip_text(viewer->check_tstat_exp, "Exponential decay (alpha = 1/N) instead of blocks of N frames");
+    g_signal_connect(viewer->check_tstat_exp, "toggled", G_CALLBACK(on_tstat_exp_toggled), viewer);
+    gtk_box_append(GTK_BOX(hbox_tstat), viewer->check_tstat_exp);
+
     // Group: Streams
     GtkWidget *vbox_streams = gtk_box_new(GTK_ORIENTATION_VERTICAL, 4);
     gtk_box_append(GTK_BOX(box_view), vbox_streams);
@@ -5241,6 +11352,15 @@ activate (GtkApplication *app,
     g_signal_connect(viewer->dropdown_gain, "notify::selected", G_CALLBACK(on_gain_changed), viewer);
     gtk_box_append(GTK_BOX(vbox_auto), viewer->dropdown_gain);
 
+    const char *sampling_opts[] = {"Sample: Exact", "0.05%", "0.1%", "0.2%", "0.5%", NULL};
+    viewer->dropdown_autoscale_sampling = gtk_drop_down_new_from_strings(sampling_opts);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(viewer->dropdown_autoscale_sampling), 0);
+    g_signal_connect(viewer->dropdown_autoscale_sampling, "notify::selected", G_CALLBACK(on_autoscale_sampling_changed), viewer);
+    gtk_box_append(GTK_BOX(vbox_auto), viewer->dropdown_autoscale_sampling);
+
+    viewer->lbl_autoscale_samples = gtk_label_new("N: -");
+    gtk_box_append(GTK_BOX(vbox_auto), viewer->lbl_autoscale_samples);
+
     gtk_box_append(GTK_BOX(box_levels), gtk_separator_new(GTK_ORIENTATION_VERTICAL));
 
     // Group: Min
@@ -5400,6 +11520,109 @@ activate (GtkApplication *app,
     g_signal_connect (btn_reset, "clicked", G_CALLBACK (on_btn_reset_selection_clicked), viewer);
     gtk_box_append (GTK_BOX (hbox_roi_btns), btn_reset);
 
+    // Playback transport (--play)
+    if (viewer->player) {
+        FilePlayer *p = viewer->player;
+        viewer->box_play = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+        gtk_widget_set_margin_start(viewer->box_play, 5);
+        gtk_widget_set_margin_end(viewer->box_play, 5);
+        gtk_box_append(GTK_BOX(vbox_main), viewer->box_play);
+
+        GtkWidget *btn_back = gtk_button_new_with_label("<");
+        gtk_widget_set_tooltip_text(btn_back, "Previous frame");
+        g_signal_connect(btn_back, "clicked", G_CALLBACK(on_play_back_clicked), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_play), btn_back);
+
+        viewer->btn_play = gtk_toggle_button_new_with_label("Play");
+        g_signal_connect(viewer->btn_play, "toggled", G_CALLBACK(on_play_toggled), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_play), viewer->btn_play);
+
+        GtkWidget *btn_forward = gtk_button_new_with_label(">");
+        gtk_widget_set_tooltip_text(btn_forward, "Next frame");
+        g_signal_connect(btn_forward, "clicked", G_CALLBACK(on_play_forward_clicked), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_play), btn_forward);
+
+        viewer->check_play_loop = gtk_check_button_new_with_label("loop");
+        gtk_check_button_set_active(GTK_CHECK_BUTTON(viewer->check_play_loop), p->loop);
+        g_signal_connect(viewer->check_play_loop, "toggled", G_CALLBACK(on_play_loop_toggled), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_play), viewer->check_play_loop);
+
+        gtk_box_append(GTK_BOX(viewer->box_play), gtk_label_new("fps"));
+        viewer->spin_play_fps = gtk_spin_button_new_with_range(0.1, 100000, 1);
+        gtk_spin_button_set_digits(GTK_SPIN_BUTTON(viewer->spin_play_fps), 1);
+        gtk_spin_button_set_value(GTK_SPIN_BUTTON(viewer->spin_play_fps), p->fps);
+        gtk_widget_set_tooltip_text(viewer->spin_play_fps, "Playback rate; above the display rate, frames in between are skipped");
+        g_signal_connect(viewer->spin_play_fps, "value-changed", G_CALLBACK(on_play_fps_changed), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_play), viewer->spin_play_fps);
+
+        viewer->scale_play = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0, p->nframes > 1 ? p->nframes - 1 : 1, 1);
+        gtk_scale_set_draw_value(GTK_SCALE(viewer->scale_play), FALSE);
+        gtk_widget_set_hexpand(viewer->scale_play, TRUE);
+        g_signal_connect(viewer->scale_play, "value-changed", G_CALLBACK(on_play_seek_changed), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_play), viewer->scale_play);
+
+        viewer->lbl_play = gtk_label_new("");
+        gtk_box_append(GTK_BOX(viewer->box_play), viewer->lbl_play);
+        update_play_ui(viewer);
+    }
+
+    // History transport (-H / --mem-budget)
+    if (viewer->img_history_capacity > 0) {
+        viewer->box_hreplay = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+        gtk_widget_set_margin_start(viewer->box_hreplay, 5);
+        gtk_widget_set_margin_end(viewer->box_hreplay, 5);
+        gtk_box_append(GTK_BOX(vbox_main), viewer->box_hreplay);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), gtk_label_new("History"));
+
+        GtkWidget *btn_live = gtk_button_new_with_label("Live");
+        gtk_widget_set_tooltip_text(btn_live, "Leave history replay and resume the live stream");
+        g_signal_connect(btn_live, "clicked", G_CALLBACK(on_hreplay_live_clicked), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), btn_live);
+
+        GtkWidget *btn_prev = gtk_button_new_with_label("|<");
+        gtk_widget_set_tooltip_text(btn_prev, "Previous recorded frame");
+        g_signal_connect(btn_prev, "clicked", G_CALLBACK(on_hreplay_prev_clicked), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), btn_prev);
+
+        viewer->btn_hreplay_back = gtk_toggle_button_new_with_label("<<");
+        gtk_widget_set_tooltip_text(viewer->btn_hreplay_back, "Play backward");
+        g_signal_connect(viewer->btn_hreplay_back, "toggled", G_CALLBACK(on_hreplay_play_toggled), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), viewer->btn_hreplay_back);
+
+        viewer->btn_hreplay_fwd = gtk_toggle_button_new_with_label(">>");
+        gtk_widget_set_tooltip_text(viewer->btn_hreplay_fwd, "Play forward");
+        g_signal_connect(viewer->btn_hreplay_fwd, "toggled", G_CALLBACK(on_hreplay_play_toggled), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), viewer->btn_hreplay_fwd);
+
+        GtkWidget *btn_next = gtk_button_new_with_label(">|");
+        gtk_widget_set_tooltip_text(btn_next, "Next recorded frame");
+        g_signal_connect(btn_next, "clicked", G_CALLBACK(on_hreplay_next_clicked), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), btn_next);
+
+        const char *rate_opts[] = {"1x", "1/2", "1/4", "1/8", "1/16", "1/32", "1/64", NULL};
+        viewer->dropdown_hreplay_rate = gtk_drop_down_new_from_strings(rate_opts);
+        gtk_widget_set_tooltip_text(viewer->dropdown_hreplay_rate, "Replay speed as a fraction of real time (recorded frame times)");
+        viewer->hreplay.rate = 1.0;
+        g_signal_connect(viewer->dropdown_hreplay_rate, "notify::selected", G_CALLBACK(on_hreplay_rate_changed), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), viewer->dropdown_hreplay_rate);
+
+        for (int m = 0; m < 2; ++m) {
+            GtkWidget *btn_mark = gtk_button_new_with_label(m ? "B" : "A");
+            gtk_widget_set_tooltip_text(btn_mark, m ? "Mark the shown frame as the loop end" : "Mark the shown frame as the loop start");
+            g_object_set_data(G_OBJECT(btn_mark), "mark", GINT_TO_POINTER(m));
+            g_signal_connect(btn_mark, "clicked", G_CALLBACK(on_hreplay_mark_clicked), viewer);
+            gtk_box_append(GTK_BOX(viewer->box_hreplay), btn_mark);
+        }
+
+        viewer->check_hreplay_loop = gtk_check_button_new_with_label("loop A-B");
+        g_signal_connect(viewer->check_hreplay_loop, "toggled", G_CALLBACK(on_hreplay_loop_toggled), viewer);
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), viewer->check_hreplay_loop);
+
+        viewer->lbl_hreplay = gtk_label_new("");
+        gtk_box_append(GTK_BOX(viewer->box_hreplay), viewer->lbl_hreplay);
+        update_hreplay_ui(viewer);
+    }
+
     // Middle Paned (Images vs Right Panel)
     // Now a child of the root VBox
     GtkWidget *paned_mid = gtk_paned_new(GTK_ORIENTATION_HORIZONTAL);
@@ -5756,6 +11979,37 @@ activate (GtkApplication *app,
     gtk_widget_set_size_request(viewer->entry_stat_sum, 60, -1);
     gtk_box_append(GTK_BOX(stat_row), viewer->entry_stat_sum);
 
+    // Named ROIs
+    stat_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(viewer->box_stats), stat_row);
+
+    gtk_box_append(GTK_BOX(stat_row), gtk_label_new("ROIs"));
+
+    GtkWidget *btn_roi_add = gtk_button_new_with_label("Add");
+    gtk_widget_set_tooltip_text(btn_roi_add, "Add the current selection as a named ROI");
+    g_signal_connect(btn_roi_add, "clicked", G_CALLBACK(on_roi_add_clicked), viewer);
+    gtk_box_append(GTK_BOX(stat_row), btn_roi_add);
+
+    GtkWidget *btn_roi_quad = gtk_button_new_with_label("Quad");
+    gtk_widget_set_tooltip_text(btn_roi_quad, "Add the four image quadrants");
+    g_signal_connect(btn_roi_quad, "clicked", G_CALLBACK(on_roi_quadrants_clicked), viewer);
+    gtk_box_append(GTK_BOX(stat_row), btn_roi_quad);
+
+    GtkWidget *btn_roi_clear = gtk_button_new_with_label("Clear");
+    g_signal_connect(btn_roi_clear, "clicked", G_CALLBACK(on_roi_clear_clicked), viewer);
+    gtk_box_append(GTK_BOX(stat_row), btn_roi_clear);
+
+    viewer->lbl_roi_stats = gtk_label_new("No ROIs");
+    gtk_label_set_xalign(GTK_LABEL(viewer->lbl_roi_stats), 0.0);
+    gtk_widget_add_css_class(viewer->lbl_roi_stats, "monospace");
+    gtk_box_append(GTK_BOX(viewer->box_stats), viewer->lbl_roi_stats);
+
+    viewer->roi_trace_area = gtk_drawing_area_new();
+    gtk_widget_set_size_request(viewer->roi_trace_area, 150, 100);
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(viewer->roi_trace_area), draw_roi_trace_func, viewer, NULL);
+    gtk_widget_set_visible(viewer->roi_trace_area, FALSE);
+    gtk_box_append(GTK_BOX(viewer->box_stats), viewer->roi_trace_area);
+
     // Hist Controls (Hist / Log)
     stat_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     gtk_box_append(GTK_BOX(viewer->box_stats), stat_row);
@@ -5810,6 +12064,57 @@ activate (GtkApplication *app,
     g_signal_connect(btn_inc, "clicked", G_CALLBACK(on_trace_dur_increase), viewer);
     gtk_box_append(GTK_BOX(stat_row), btn_inc);
 
+    viewer->lbl_trace_mem = gtk_label_new("0.0 MB");
+    gtk_widget_set_tooltip_text(viewer->lbl_trace_mem, "Trace memory (allocated as samples arrive, freed when the trace is off)");
+    gtk_box_append(GTK_BOX(stat_row), viewer->lbl_trace_mem);
+
+    viewer->lbl_trace_clock = gtk_label_new("");
+    gtk_widget_set_tooltip_text(viewer->lbl_trace_clock, "Trace time base (producer atime/writetime, or local clock when unset or --local-time)");
+    gtk_box_append(GTK_BOX(stat_row), viewer->lbl_trace_clock);
+
+    // Trace Export / Import
+    stat_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(viewer->box_stats), stat_row);
+
+    viewer->entry_trace_file = gtk_entry_new();
+    gtk_editable_set_text(GTK_EDITABLE(viewer->entry_trace_file), "trace.imtrc");
+    gtk_widget_set_hexpand(viewer->entry_trace_file, TRUE);
+    gtk_box_append(GTK_BOX(stat_row), viewer->entry_trace_file);
+
+    viewer->check_trace_csv = gtk_check_button_new_with_label("csv");
+    gtk_widget_set_tooltip_text(viewer->check_trace_csv, "Export stats as CSV (no histograms; cannot be imported)");
+    gtk_box_append(GTK_BOX(stat_row), viewer->check_trace_csv);
+
+    GtkWidget *btn_export = gtk_button_new_with_label("Export");
+    g_signal_connect(btn_export, "clicked", G_CALLBACK(on_trace_export_clicked), viewer);
+    gtk_box_append(GTK_BOX(stat_row), btn_export);
+
+    GtkWidget *btn_import = gtk_button_new_with_label("Import");
+    gtk_widget_set_tooltip_text(btn_import, "Show an exported trace (live samples stop until the trace is toggled off)");
+    g_signal_connect(btn_import, "clicked", G_CALLBACK(on_trace_import_clicked), viewer);
+    gtk_box_append(GTK_BOX(stat_row), btn_import);
+
+    viewer->lbl_trace_io = gtk_label_new("");
+    gtk_box_append(GTK_BOX(stat_row), viewer->lbl_trace_io);
+
+    if (viewer->trace_view) {
+        // Window end time in the recorded trace, spanning the chunk index
+        TraceFileHeader *th = viewer->trace_view->hdr;
+        uint64_t nchunks = (th->nsamples + TRACE_CHUNK_SAMPLES - 1) / TRACE_CHUNK_SAMPLES;
+        double t0 = nchunks > 0 ? th->index[0].t_first : 0;
+        double t1 = nchunks > 0 ? th->index[nchunks - 1].t_last : 0;
+        if (t1 <= t0) t1 = t0 + 1;
+        viewer->scale_trace_view = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, t0, t1, 0.001);
+        gtk_range_set_value(GTK_RANGE(viewer->scale_trace_view), t1);
+        gtk_scale_set_draw_value(GTK_SCALE(viewer->scale_trace_view), FALSE);
+        gtk_widget_set_hexpand(viewer->scale_trace_view, TRUE);
+        g_signal_connect(viewer->scale_trace_view, "value-changed", G_CALLBACK(on_trace_view_changed), viewer);
+        gtk_box_append(GTK_BOX(stat_row), viewer->scale_trace_view);
+
+        viewer->lbl_trace_view = gtk_label_new("");
+        gtk_box_append(GTK_BOX(stat_row), viewer->lbl_trace_view);
+    }
+
     // Trace Area
     viewer->trace_area = gtk_drawing_area_new();
     gtk_widget_set_size_request(viewer->trace_area, 150, 300);
@@ -5823,6 +12128,37 @@ activate (GtkApplication *app,
     g_signal_connect(trace_motion, "leave", G_CALLBACK(on_leave_trace), viewer);
     gtk_widget_add_controller(viewer->trace_area, trace_motion);
 
+
+    // PSD Controls
+    stat_row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_append(GTK_BOX(viewer->box_stats), stat_row);
+
+    viewer->check_psd = gtk_check_button_new_with_label("psd");
+    gtk_widget_set_tooltip_text(viewer->check_psd, "Welch spectrum of a trace curve over the trace duration");
+    g_signal_connect(viewer->check_psd, "toggled", G_CALLBACK(on_psd_toggled), viewer);
+    gtk_box_append(GTK_BOX(stat_row), viewer->check_psd);
+
+    const char *psd_curves[] = {"min", "max", "mean", "median", "p10", "p90", NULL};
+    viewer->dropdown_psd_curve = gtk_drop_down_new_from_strings(psd_curves);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(viewer->dropdown_psd_curve), TRACE_CURVE_MEAN);
+    g_signal_connect(viewer->dropdown_psd_curve, "notify::selected", G_CALLBACK(on_psd_settings_changed), viewer);
+    gtk_box_append(GTK_BOX(stat_row), viewer->dropdown_psd_curve);
+
+    const char *psd_len_opts[] = {"256", "512", "1024", "2048", "4096", NULL};
+    viewer->dropdown_psd_len = gtk_drop_down_new_from_strings(psd_len_opts);
+    gtk_drop_down_set_selected(GTK_DROP_DOWN(viewer->dropdown_psd_len), 2);
+    gtk_widget_set_tooltip_text(viewer->dropdown_psd_len, "Samples per segment (50% overlap)");
+    g_signal_connect(viewer->dropdown_psd_len, "notify::selected", G_CALLBACK(on_psd_settings_changed), viewer);
+    gtk_box_append(GTK_BOX(stat_row), viewer->dropdown_psd_len);
+
+    viewer->psd_area = gtk_drawing_area_new();
+    gtk_widget_set_size_request(viewer->psd_area, 150, 150);
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(viewer->psd_area), draw_psd_func, viewer, NULL);
+    gtk_widget_set_visible(viewer->psd_area, FALSE);
+    gtk_box_append(GTK_BOX(viewer->box_stats), viewer->psd_area);
+
+    if (viewer->trace_view) gtk_check_button_set_active(GTK_CHECK_BUTTON(viewer->check_trace), TRUE);
+
     GtkGesture *trace_click = gtk_gesture_click_new();
     gtk_gesture_single_set_button(GTK_GESTURE_SINGLE(trace_click), GDK_BUTTON_PRIMARY);
     g_signal_connect(trace_click, "pressed", G_CALLBACK(on_click_trace_pressed), viewer);
@@ -5893,13 +12229,22 @@ main (int    argc,
     }
     g_option_context_free (context);
 
-    if (argc < 2) {
-        printf("Usage: %s [options] <stream_name>\n", argv[0]);
+    if (!big_init(opt_huge_pages, opt_numa_node)) return 1;
+
+    if (argc < 2 && !opt_play) {
+        printf("Usage: %s [options] <stream_name>\n       %s [options] --play FILE\n", argv[0], argv[0]);
         return 1;
     }
 
+    if (opt_play) {
+        viewer.player = player_open(opt_play, opt_play_raw, opt_play_fps, opt_play_loop);
+        if (!viewer.player) return 1;
+        viewer.player->playing = TRUE;
+    }
+    const char *stream_name = viewer.player ? viewer.player->name : argv[1];
+
     // viewer.base_image_name removed from struct
-    viewer.image_name = strdup(argv[1]);
+    viewer.image_name = strdup(stream_name);
     // viewer.current_tbin removed
     // viewer.current_rms_mode removed
     viewer.min_val = opt_min;
@@ -5907,29 +12252,52 @@ main (int    argc,
     viewer.fixed_min = has_min;
     viewer.fixed_max = has_max;
 
-    // Allocate Trace Memory
-    viewer.trace_time = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-    viewer.trace_cnt0 = (uint64_t*)calloc(TRACE_MAX_SAMPLES, sizeof(uint64_t));
+    trace_hist_init_lut();
+
+    if (opt_trace_open) {
+        viewer.trace_view = trace_file_open(opt_trace_open, FALSE);
+        if (!viewer.trace_view) return 1;
+        if (opt_trace_record) printf("Browsing %s, --trace-record ignored\n", opt_trace_open);
+    } else if (opt_trace_record) {
+        viewer.trace_rec = trace_file_open(opt_trace_record, TRUE);
+        if (!viewer.trace_rec) return 1;
+    }
+
+    if (opt_stats_stream) {
+        viewer.stats_pub = stats_pub_open(opt_stats_stream, opt_stats_cb);
+        if (!viewer.stats_pub) return 1;
+    }
 
     // Allocate Internal Image History
-    if (opt_history > 0) {
-        viewer.img_history_capacity = opt_history;
-        viewer.img_history_cnt0 = (uint64_t*)calloc(opt_history, sizeof(uint64_t));
+    viewer.img_history_fd = -1;
+    mem_budget_init();
+    if (opt_history > 0 || opt_mem_budget > 0) {
+        // With a budget the depth is set when the first frame's size is known
+        size_t depth = opt_history > 0 ? (size_t)opt_history : 1;
+        if (!img_history_init(&viewer, depth)) return 1;
+        if (opt_history_compress && !(viewer.hist_codec = hist_codec_new(depth))) return 1;
+        if (opt_history_file) {
+            if (opt_history_compress) {
+                fprintf(stderr, "--history-file and --history-compress cannot be combined\n");
+                return 1;
+            }
+            viewer.img_history_fd = open(opt_history_file, O_RDWR | O_CREAT, 0644);
+            if (viewer.img_history_fd < 0) {
+                fprintf(stderr, "Cannot open history file %s\n", opt_history_file);
+                return 1;
+            }
+        }
     } else {
         viewer.img_history_capacity = 0;
         viewer.img_history_cnt0 = NULL;
     }
 
-    viewer.trace_min = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-    viewer.trace_max = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-    viewer.trace_mean = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-    viewer.trace_median = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-    viewer.trace_p01 = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-    viewer.trace_p09 = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-
-    viewer.trace_hist_data = (uint32_t*)calloc(TRACE_MAX_SAMPLES * TRACE_HIST_BINS, sizeof(uint32_t));
-    viewer.trace_hist_min = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
-    viewer.trace_hist_max = (double*)calloc(TRACE_MAX_SAMPLES, sizeof(double));
+    if (opt_trigger) {
+        viewer.trigger = trigger_new(opt_trigger, opt_trigger_pre, opt_trigger_post, opt_trigger_dir);
+        if (!viewer.trigger) return 1;
+        if (opt_mem_budget <= 0 && (size_t)opt_history < (size_t)viewer.trigger->pre + viewer.trigger->post + 1)
+            printf("History (-H %d) is shorter than --trigger-pre + --trigger-post + 1; dumps will be truncated\n", opt_history);
+    }
 
     viewer.trace_duration = 10.0; // Default 10s
     viewer.auto_gain = 0.1;
@@ -5942,7 +12310,7 @@ main (int    argc,
     // Initialize Primary Stream Context
     viewer.streams[0].image = NULL; // Will be set in activate/update
     viewer.streams[0].image_name = NULL;
-    viewer.streams[0].base_image_name = strdup(argv[1]);
+    viewer.streams[0].base_image_name = strdup(stream_name);
     viewer.streams[0].current_tbin = 1;
     viewer.streams[0].current_rms_mode = FALSE;
     viewer.streams[0].min_val = opt_min;
@@ -5965,35 +12333,44 @@ main (int    argc,
     status = g_application_run (G_APPLICATION (app), 0, NULL);
     g_object_unref (app);
 
+    recorder_stop(viewer.recorder);
+    tstat_stop(viewer.streams[0].tstat);
+    tstat_stop(viewer.streams[1].tstat);
     if (viewer.streams[0].base_image_name) free(viewer.streams[0].base_image_name);
     if (viewer.streams[1].base_image_name) free(viewer.streams[1].base_image_name);
     if (viewer.image_name) free(viewer.image_name);
 
-    if (viewer.image) {
+    if (viewer.image && !(viewer.player && viewer.image == &viewer.player->image)) {
         ImageStreamIO_closeIm(viewer.image);
         free(viewer.image);
     }
-    if (viewer.display_buffer) free(viewer.display_buffer);
-    if (viewer.raw_buffer) free(viewer.raw_buffer);
-    if (viewer.raw_buffer_sec) free(viewer.raw_buffer_sec);
-    if (viewer.history_buffer) free(viewer.history_buffer);
+    trigger_free(&viewer);
+    player_free(viewer.player);
+    big_free(viewer.display_buffer, viewer.display_buffer_size);
+    big_free(viewer.raw_buffer, viewer.raw_buffer_size);
+    big_free(viewer.raw_buffer_sec, viewer.raw_buffer_sec_size);
+    big_free(viewer.history_buffer, viewer.history_buffer_size);
+    big_free(viewer.history_buffer_sec, viewer.history_buffer_sec_size);
     if (viewer.hist_data) free(viewer.hist_data);
     if (viewer.hist_data_full) free(viewer.hist_data_full);
-    if (viewer.img_history_data) free(viewer.img_history_data);
+    hist_cache_free(&viewer.hist_cache);
+    roi_set_clear(&viewer.roi_set);
+    hreplay_free(&viewer);
+    hist_codec_free(viewer.hist_codec);
+    img_history_free_data(&viewer);
+    if (viewer.img_history_fd >= 0) close(viewer.img_history_fd);
     if (viewer.img_history_cnt0) free(viewer.img_history_cnt0);
-
-    if (viewer.trace_time) free(viewer.trace_time);
-    if (viewer.trace_cnt0) free(viewer.trace_cnt0);
-    if (viewer.trace_min) free(viewer.trace_min);
-    if (viewer.trace_max) free(viewer.trace_max);
-    if (viewer.trace_mean) free(viewer.trace_mean);
-    if (viewer.trace_median) free(viewer.trace_median);
-    if (viewer.trace_p01) free(viewer.trace_p01);
-    if (viewer.trace_p09) free(viewer.trace_p09);
-
-    if (viewer.trace_hist_data) free(viewer.trace_hist_data);
-    if (viewer.trace_hist_min) free(viewer.trace_hist_min);
-    if (viewer.trace_hist_max) free(viewer.trace_hist_max);
+    free(viewer.img_history_pair_cnt0);
+    free(viewer.img_history_src);
+    free(viewer.img_history_time);
+    if (viewer.img_history_index) free(viewer.img_history_index);
+
+    trace_io_shutdown(&viewer);
+    trace_free_chunks(&viewer);
+    trace_file_close(viewer.trace_view);
+    trace_file_close(viewer.trace_rec);
+    stats_pub_close(viewer.stats_pub);
+    psd_free(&viewer.psd);
 
     return status;
 }